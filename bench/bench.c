@@ -0,0 +1,1351 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "uritlib.h"
+
+#include "uritlib.c"
+#include "emitted.c"
+
+/* Count the library's allocations by routing them through these hooks */
+size_t bench_allocs;
+
+static void *bench_malloc(size_t size, void *ctx) { bench_allocs++; return malloc(size); }
+static void *bench_realloc(void *ptr, size_t size, void *ctx) { bench_allocs++; return realloc(ptr, size); }
+static void bench_free(void *ptr, void *ctx) { free(ptr); }
+
+typedef struct {
+	const UritVars *vars;
+	const char *tpl;
+	size_t iterations;
+	size_t bytes;
+} BenchThread;
+
+typedef enum { BENCH_PARSETEMPLATE, BENCH_EXPAND, BENCH_EXPANDTO } BenchApi;
+
+typedef struct {
+	const char *name;
+	const UritVars *vars;
+	size_t count;
+	char **templates;
+	size_t iterations;
+} BenchWorkload;
+
+char *bench_rfctemplates[] = {
+	"{count}", "{count*}", "{/count}", "{/count*}", "{;count}", "{;count*}", "{?count}", "{?count*}",
+	"{&count*}", "{var}", "{hello}", "{half}", "O{empty}X", "O{undef}X", "{x,y}", "{x,hello,y}",
+	"?{x,empty}", "?{x,undef}", "?{undef,y}", "{var:3}", "{var:30}", "{list}", "{list*}", "{keys}",
+	"{keys*}", "{+var}", "{+hello}", "{+half}", "{base}index", "{+base}index", "O{+empty}X", "O{+undef}X",
+	"{+path}/here", "here?ref={+path}", "up{+path}{var}/here", "{+x,hello,y}", "{+path,x}/here",
+	"{+path:6}/here", "{+list}", "{+list*}", "{+keys}", "{+keys*}", "{#var}", "{#hello}", "{#half}",
+	"foo{#empty}", "foo{#undef}", "{#x,hello,y}", "{#path,x}/here", "{#path:6}/here", "{#list}",
+	"{#list*}", "{#keys}", "{#keys*}", "{.who}", "{.who,who}", "{.half,who}", "www{.dom*}", "X{.var}",
+	"X{.empty}", "X{.undef}", "X{.var:3}", "X{.list}", "X{.list*}", "X{.keys}", "X{.keys*}",
+	"X{.empty_keys}", "X{.empty_keys*}", "{/who}", "{/who,who}", "{/half,who}", "{/who,dub}", "{/var}",
+	"{/var,empty}", "{/var,undef}", "{/var,x}/here", "{/var:1,var}", "{/list}", "{/list*}",
+	"{/list*,path:4}", "{/keys}", "{/keys*}", "{;who}", "{;half}", "{;empty}", "{;v,empty,who}",
+	"{;v,bar,who}", "{;x,y}", "{;x,y,empty}", "{;x,y,undef}", "{;hello:5}", "{;list}", "{;list*}",
+	"{;keys}", "{;keys*}", "{?who}", "{?half}", "{?x,y}", "{?x,y,empty}", "{?x,y,undef}", "{?var:3}",
+	"{?list}", "{?list*}", "{?keys}", "{?keys*}", "{&who}", "{&half}", "?fixed=yes{&x}", "{&x,y,empty}",
+	"{&x,y,undef}", "{&var:3}", "{&list}", "{&list*}", "{&keys}", "{&keys*}"
+};
+
+char *bench_rfcvalues[][2] = {
+	{"count", "(\"one\",\"two\",\"three\")"},
+	{"dom", "(\"example\",\"com\")"},
+	{"dub", "me/too"},
+	{"hello", "Hello World!"},
+	{"half", "50%"},
+	{"var", "value"},
+	{"who", "fred"},
+	{"base", "http://example.com/home/"},
+	{"path", "/foo/bar"},
+	{"list", "(\"red\",\"green\",\"blue\")"},
+	{"keys", "[(\"semi\",\";\"),(\"dot\",\".\"),(\"comma\",\",\")]"},
+	{"v", "6"},
+	{"x", "1024"},
+	{"y", "768"},
+	{"empty", ""},
+	{"empty_keys", "[]"}
+};
+
+void bench_vars(size_t count);
+void bench_threads(void);
+void bench_allocations(void);
+void bench_allocsites(void);
+void bench_encode(void);
+void bench_literals(void);
+void bench_builder(void);
+void bench_batch(void);
+void bench_match(void);
+void bench_router(size_t count);
+void bench_cache(void);
+void bench_slots(void);
+void bench_borrow(void);
+void bench_packed(void);
+void bench_loader(size_t count);
+void bench_json(void);
+void bench_reexpand(void);
+void bench_partial(void);
+void bench_bytecode(void);
+void bench_emitc(void);
+int bench_openbranchmisses(void);
+long long bench_readcounter(int fd);
+void bench_suite(void);
+void bench_workload(const BenchWorkload *w, BenchApi api);
+size_t bench_expandone(BenchApi api, const char *tpl, const UritTemplate *t, const UritVars *vars);
+int bench_rfclevel(const char *tpl, const UritVars *vars);
+int bench_compare(const void *a, const void *b);
+void *bench_threadmain(void *arg);
+double bench_now(void);
+
+int
+main(int argc, char **argv)
+{
+	size_t counts[3] = {10, 100, 10000};
+
+	urit_setallocator(bench_malloc, bench_realloc, bench_free, NULL);
+	if (argc > 1 && strcmp(argv[1], "suite") == 0) {
+		bench_suite();
+		return EXIT_SUCCESS;
+	}
+	for (int i = 0; i < 3; i++) {
+		bench_vars(counts[i]);
+	}
+	bench_threads();
+	bench_allocations();
+	bench_allocsites();
+	bench_encode();
+	bench_literals();
+	bench_builder();
+	bench_batch();
+	bench_match();
+	bench_router(10);
+	bench_router(1000);
+	bench_router(10000);
+	bench_cache();
+	bench_slots();
+	bench_borrow();
+	bench_packed();
+	bench_loader(100000);
+	bench_json();
+	bench_reexpand();
+	bench_partial();
+	bench_bytecode();
+	bench_emitc();
+	bench_suite();
+	return EXIT_SUCCESS;
+}
+
+double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Builds a set of count variables, then expands a template referencing
+ * eight of them spread across the set
+ */
+void
+bench_vars(size_t count)
+{
+	char name[32];
+	char tpl[256] = "http://example.com/";
+	size_t iterations = 200000;
+	UritVars vars = urit_newvars();
+	char (*names)[32] = malloc(sizeof(*names) * count);
+
+	for (size_t i = 0; i < count; i++) {
+		snprintf(names[i], sizeof(names[i]), "var%zu", i);
+	}
+	double start = bench_now();
+
+	for (size_t i = 0; i < count; i++) {
+		urit_addstringvar(&vars, names[i], "value");
+	}
+	double build = bench_now() - start;
+
+	strcat(tpl, "{?");
+	for (size_t i = 0; i < 8; i++) {
+		snprintf(name, sizeof(name), "%svar%zu", i ? "," : "", (i * 7919) % count);
+		strcat(tpl, name);
+	}
+	strcat(tpl, "}");
+
+	UritTemplate *t = urit_compile(tpl, NULL);
+	char buf[512];
+	size_t total = 0;
+
+	start = bench_now();
+	for (size_t i = 0; i < iterations; i++) {
+		UritString out = {0, sizeof(buf), buf, true};
+		urit_expandtemplate(t, &vars, &out);
+		total += out.len;
+	}
+	double expand = bench_now() - start;
+
+	start = bench_now();
+	for (size_t i = 0; i < iterations * 8; i++) {
+		const char *n = names[(i * 7919) % count];
+		total += urit_getvar(&vars, n, strlen(n)) != NULL;
+	}
+	double lookup = bench_now() - start;
+
+	printf("vars/%zu: build %.1f ns/var, lookup %.1f ns, expand %.1f ns (%zu)\n",
+		count, build / count, lookup / (iterations * 8), expand / iterations, total);
+	urit_freetemplate(t);
+	free(names);
+}
+
+void *
+bench_threadmain(void *arg)
+{
+	BenchThread *bt = arg;
+	char buf[512];
+
+	for (size_t i = 0; i < bt->iterations; i++) {
+		bt->bytes += urit_expandto(buf, sizeof(buf), bt->tpl, bt->vars, NULL);
+	}
+	return NULL;
+}
+
+/**
+ * Expands one template against one shared variable set from 1 up to as many
+ * threads as there are online processors
+ */
+void
+bench_threads(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t iterations = 200000;
+	UritVars vars = urit_newvars();
+
+	urit_addvariable(&vars, "id", "42");
+	urit_addvariable(&vars, "path", "/foo/bar");
+	urit_addvariable(&vars, "list", "(\"red\",\"green\",\"blue\")");
+	urit_addvariable(&vars, "keys", "[(\"semi\",\";\"),(\"dot\",\".\"),(\"comma\",\",\")]");
+
+	if (cpus < 1) {
+		cpus = 1;
+	}
+	for (long n = 1; n <= cpus; n = (n < cpus && n * 2 > cpus) ? cpus : n * 2) {
+		pthread_t *threads = malloc(sizeof(pthread_t) * n);
+		BenchThread *bts = malloc(sizeof(BenchThread) * n);
+		double start = bench_now();
+
+		for (long i = 0; i < n; i++) {
+			bts[i] = (BenchThread) {&vars, "http://example.com{+path}/items/{id}{/list*}{?keys*}", iterations, 0};
+			pthread_create(&threads[i], NULL, bench_threadmain, &bts[i]);
+		}
+		for (long i = 0; i < n; i++) {
+			pthread_join(threads[i], NULL);
+		}
+		double elapsed = bench_now() - start;
+
+		printf("threads/%ld: %.0f expansions/s\n", n, n * iterations / (elapsed / 1e9));
+		free(threads);
+		free(bts);
+	}
+}
+
+/**
+ * Reports heap allocations per expansion for each way of expanding
+ */
+void
+bench_allocations(void)
+{
+	char *tpl = "http://example.com{+path}/items/{id}{/list*}{?keys*}";
+	size_t iterations = 10000;
+	UritVars vars = urit_newvars();
+	UritContext *ctx = urit_newcontext();
+	UritTemplate *t = urit_compile(tpl, NULL);
+	char buf[512];
+	size_t before;
+
+	urit_addvariable(&vars, "id", "42");
+	urit_addvariable(&vars, "path", "/foo/bar");
+	urit_addvariable(&vars, "list", "(\"red\",\"green\",\"blue\")");
+	urit_addvariable(&vars, "keys", "[(\"semi\",\";\"),(\"dot\",\".\"),(\"comma\",\",\")]");
+
+	before = bench_allocs;
+	for (size_t i = 0; i < iterations; i++) {
+		UritResult res = urit_parsetemplate(tpl, vars);
+		urit_freeresult(&res);
+	}
+	printf("allocs/parsetemplate: %.2f\n", (double) (bench_allocs - before) / iterations);
+
+	before = bench_allocs;
+	for (size_t i = 0; i < iterations; i++) {
+		urit_parsetemplatein(ctx, tpl, vars);
+		urit_resetcontext(ctx);
+	}
+	printf("allocs/parsetemplatein: %.2f\n", (double) (bench_allocs - before) / iterations);
+
+	before = bench_allocs;
+	for (size_t i = 0; i < iterations; i++) {
+		free(urit_expand(t, &vars));
+	}
+	printf("allocs/expand: %.2f\n", (double) (bench_allocs - before) / iterations);
+
+	before = bench_allocs;
+	for (size_t i = 0; i < iterations; i++) {
+		urit_expandto(buf, sizeof(buf), tpl, &vars, NULL);
+	}
+	printf("allocs/expandto: %.2f\n", (double) (bench_allocs - before) / iterations);
+
+	urit_freetemplate(t);
+	urit_freecontext(ctx);
+}
+
+/**
+ * Lists which functions of the library allocate the most while variables
+ * are added and a template is compiled and expanded through every API
+ */
+void
+bench_allocsites(void)
+{
+	char *tpl = "http://example.com{+path}/items/{id}{/list*}{?keys*}";
+	UritAllocCount counts[URIT_ALLOC_SITES];
+	UritContext *ctx = urit_newcontext();
+	char buf[512];
+
+	urit_countallocations(true);
+	for (int i = 0; i < 1000; i++) {
+		UritVars vars = urit_newvars();
+
+		urit_addvariable(&vars, "id", "42");
+		urit_addvariable(&vars, "path", "/foo/bar");
+		urit_addvariable(&vars, "list", "(\"red\",\"green\",\"blue\")");
+		urit_addvariable(&vars, "keys", "[(\"semi\",\";\"),(\"dot\",\".\"),(\"comma\",\",\")]");
+
+		UritResult res = urit_parsetemplate(tpl, vars);
+		urit_freeresult(&res);
+		urit_parsetemplatein(ctx, tpl, vars);
+		urit_resetcontext(ctx);
+		UritTemplate *t = urit_compile(tpl, NULL);
+		urit_free(urit_expand(t, &vars));
+		urit_freetemplate(t);
+		urit_expandto(buf, sizeof(buf), tpl, &vars, NULL);
+	}
+	size_t sites = urit_allocationcounts(counts, URIT_ALLOC_SITES);
+	urit_countallocations(false);
+
+	for (size_t i = 0; i < sites && i < 8; i++) {
+		printf("allocsite/%s: %.2f calls, %.0f bytes per round\n", counts[i].function, counts[i].calls / 1000.0, counts[i].bytes / 1000.0);
+	}
+	urit_freecontext(ctx);
+}
+
+/**
+ * Percent-encoding throughput on 4 KB values in both encoding modes
+ */
+void
+bench_encode(void)
+{
+	const char *ascii = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJ0123456789-._~/?=&";
+	const char *utf8 = "h\xC3\xA9llo w\xC3\xB6rld \xE2\x82\xAC ";
+	const char *inputs[2] = {ascii, utf8};
+	const char *names[2] = {"ascii", "utf8"};
+	size_t iterations = 20000;
+	char value[4097];
+
+	for (int k = 0; k < 2; k++) {
+		size_t len = strlen(inputs[k]);
+		size_t size = 0;
+
+		while (size + len <= 4096) {
+			memcpy(value + size, inputs[k], len);
+			size += len;
+		}
+		value[size] = '\0';
+
+		for (int allow = 0; allow < 2; allow++) {
+			UritString *out = urit_newstring();
+			double start = bench_now();
+
+			for (size_t i = 0; i < iterations; i++) {
+				out->len = 0;
+				urit_encode(out, value, size, allow, 0);
+			}
+			double elapsed = bench_now() - start;
+
+			printf("encode/%s/%s: %.1f MB/s\n", names[k], allow ? "reserved" : "unreserved",
+				size * iterations / (elapsed / 1e9) / 1e6);
+			free(out->str);
+			free(out);
+		}
+	}
+}
+
+/**
+ * A 2 KB template that is almost all literal text with four expressions
+ */
+void
+bench_literals(void)
+{
+	const char *segment = "/segment-with_some.literal~text/and?more=stuff&x=1";
+	size_t iterations = 50000;
+	UritVars vars = urit_newvars();
+	char tpl[4096];
+	char buf[4096];
+	size_t len = 0;
+
+	for (int e = 0; e < 4; e++) {
+		for (int k = 0; k < 10; k++) {
+			len += sprintf(tpl + len, "%s", segment);
+		}
+		len += sprintf(tpl + len, "{var%d}", e);
+	}
+	urit_addstringvar(&vars, "var0", "a");
+	urit_addstringvar(&vars, "var2", "b");
+
+	double start = bench_now();
+	for (size_t i = 0; i < iterations; i++) {
+		urit_expandto(buf, sizeof(buf), tpl, &vars, NULL);
+	}
+	double expandto = bench_now() - start;
+
+	start = bench_now();
+	for (size_t i = 0; i < iterations; i++) {
+		urit_freetemplate(urit_compile(tpl, NULL));
+	}
+	double compile = bench_now() - start;
+
+	printf("literals/%zu: expandto %.1f ns (%.1f MB/s), compile %.1f ns\n", len,
+		expandto / iterations, len * iterations / (expandto / 1e9) / 1e6, compile / iterations);
+}
+
+/**
+ * Builds a 64 KB URI from 8-byte appends, first from an empty string and then
+ * reusing the same string after a reset
+ */
+void
+bench_builder(void)
+{
+	UritString *uri = urit_newstring();
+
+	for (int pass = 0; pass < 2; pass++) {
+		size_t before = bench_allocs;
+		double start = bench_now();
+
+		urit_resetstring(uri);
+		for (size_t i = 0; i < 65536 / 8; i++) {
+			urit_appendbytes(uri, "segment/", 8);
+		}
+		double elapsed = bench_now() - start;
+
+		printf("builder/%s: %zu bytes, %zu allocs, %.1f us\n", pass ? "reused" : "fresh",
+			uri->len, bench_allocs - before, elapsed / 1e3);
+	}
+	urit_freestring(uri);
+}
+
+/**
+ * Expands one template for 100k rows, one urit_parsetemplate call per row
+ * against a single urit_expandbatch call
+ */
+void
+bench_batch(void)
+{
+	char *tpl = "/products/{id}{?utm*}";
+	size_t count = 100000;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	UritVars *sets = malloc(sizeof(UritVars) * count);
+	UritTemplate *t = urit_compile(tpl, NULL);
+	UritBatch *batch = urit_newbatch();
+	char id[32];
+
+	for (size_t i = 0; i < count; i++) {
+		sets[i] = urit_newvars();
+		snprintf(id, sizeof(id), "%zu", i);
+		urit_addvariable(&sets[i], "id", id);
+		urit_addvariable(&sets[i], "utm", "[(\"source\",\"feed\"),(\"medium\",\"web\")]");
+	}
+
+	double start = bench_now();
+	for (size_t i = 0; i < count; i++) {
+		UritResult res = urit_parsetemplate(tpl, sets[i]);
+		urit_freeresult(&res);
+	}
+	double single = bench_now() - start;
+	printf("batch/parsetemplate: %.0f rows/s\n", count / (single / 1e9));
+
+	for (long threads = 1; threads <= cpus; threads = (threads < cpus && threads * 2 > cpus) ? cpus : threads * 2) {
+		start = bench_now();
+		urit_expandbatch(batch, t, sets, count, '\n', threads);
+		double elapsed = bench_now() - start;
+
+		printf("batch/%ld: %.0f rows/s, %zu bytes\n", threads, count / (elapsed / 1e9), batch->uris->len);
+	}
+	urit_freebatch(batch);
+	urit_freetemplate(t);
+	free(sets);
+}
+
+void
+bench_match(void)
+{
+	char *routes[][2] = {
+		{"/users/{id}/posts/{post}{?page,sort}", "/users/1234/posts/hello-world?page=2&sort=date"},
+		{"/files{/dir,name}{.ext}", "/files/reports/q3%20summary.pdf"},
+		{"{+base}/api/{version}/search{?q}", "https://example.com/v/api/2/search?q=caf%C3%A9%20au%20lait"}
+	};
+	size_t iterations = 200000;
+	UritVars vars = urit_newvars();
+
+	for (int r = 0; r < 3; r++) {
+		UritTemplate *t = urit_compile(routes[r][0], NULL);
+		size_t len = strlen(routes[r][1]);
+		size_t matched = 0;
+
+		double start = bench_now();
+		for (size_t i = 0; i < iterations; i++) {
+			matched += urit_match(t, routes[r][1], &vars) == URIT_OK;
+		}
+		double elapsed = bench_now() - start;
+
+		printf("match/%s: %.1f ns (%.1f MB/s), %zu matched\n", routes[r][0], elapsed / iterations,
+			len * iterations / (elapsed / 1e9) / 1e6, matched);
+		urit_freetemplate(t);
+	}
+}
+
+void
+bench_router(size_t count)
+{
+	size_t lookups = 1000;
+	size_t iterations = 200;
+	UritRouter *router = urit_newrouter();
+	UritVars vars = urit_newvars();
+	char **uris = malloc(sizeof(char *) * lookups);
+	char tpl[128];
+	size_t found = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		if (i % 3) {
+			snprintf(tpl, sizeof(tpl), "/svc%zu/res%zu/{id%zu}{?page,limit}", i % 50, i, i);
+		} else {
+			snprintf(tpl, sizeof(tpl), "/svc%zu/res%zu/{id%zu}/items{/item}", i % 50, i, i);
+		}
+		urit_addroute(router, tpl, NULL);
+	}
+	for (size_t i = 0; i < lookups; i++) {
+		size_t r = (i * 7919) % count;
+
+		uris[i] = malloc(128);
+		if (r % 3) {
+			snprintf(uris[i], 128, "/svc%zu/res%zu/user-%zu?page=2&limit=50", r % 50, r, i);
+		} else {
+			snprintf(uris[i], 128, "/svc%zu/res%zu/user-%zu/items/%zu", r % 50, r, i, i);
+		}
+	}
+
+	double start = bench_now();
+	for (size_t n = 0; n < iterations; n++) {
+		for (size_t i = 0; i < lookups; i++) {
+			found += urit_route(router, uris[i], NULL, NULL) == URIT_OK;
+		}
+	}
+	double routed = (bench_now() - start) / (iterations * lookups);
+
+	size_t linear = count > 1000 ? 2 : iterations;
+	start = bench_now();
+	for (size_t n = 0; n < linear; n++) {
+		for (size_t i = 0; i < lookups; i++) {
+			for (size_t r = 0; r < router->count; r++) {
+				if (urit_match(router->templates[r], uris[i], &vars) == URIT_OK) {
+					break;
+				}
+			}
+		}
+	}
+	double scanned = (bench_now() - start) / (linear * lookups);
+
+	printf("router/%zu: route %.1f ns, linear match %.1f ns, %zu found\n", count, routed, scanned, found);
+	for (size_t i = 0; i < lookups; i++) {
+		free(uris[i]);
+	}
+	free(uris);
+	urit_freerouter(router);
+}
+
+void
+bench_cache(void)
+{
+	size_t count = 300;
+	size_t iterations = 100;
+	size_t capacities[3] = {0, 150, 300};
+	char (*tpls)[128] = malloc(sizeof(*tpls) * count);
+	UritVars vars = urit_newvars();
+
+	urit_addstringvar(&vars, "id", "1234");
+	urit_addstringvar(&vars, "q", "hello world");
+	for (size_t i = 0; i < count; i++) {
+		snprintf(tpls[i], sizeof(tpls[i]), "https://api.example.com/v1/tenants/%zu/resources/{id}/history{?q,page,limit}", i);
+	}
+
+	for (int c = 0; c < 3; c++) {
+		urit_setcache(capacities[c]);
+		UritCacheStats before = urit_cachestats();
+		double start = bench_now();
+		for (size_t n = 0; n < iterations; n++) {
+			for (size_t i = 0; i < count; i++) {
+				UritResult res = urit_parsetemplate(tpls[i], vars);
+				urit_freeresult(&res);
+			}
+		}
+		double elapsed = (bench_now() - start) / (iterations * count);
+		UritCacheStats stats = urit_cachestats();
+
+		printf("cache/%zu of %zu: %.1f ns, %zu hits, %zu misses, %zu evictions\n", capacities[c], count, elapsed,
+			stats.hits - before.hits, stats.misses - before.misses, stats.evictions - before.evictions);
+	}
+	urit_setcache(0);
+	free(tpls);
+}
+
+void
+bench_slots(void)
+{
+	const char *schema[6] = {"tenant", "resource", "id", "page", "limit", "sort"};
+	char *values[6] = {"acme", "orders", "1234", "2", "50", "date"};
+	char *tpl = "/t/{tenant}/{resource}/{id}{?page,limit,sort}";
+	size_t iterations = 500000;
+	UritTemplate *t = urit_compile(tpl, NULL);
+	UritSlots *slots = urit_newslots(6);
+	UritString *uri = urit_newstring();
+	UritVars vars = urit_newvars();
+	char name[16];
+
+	for (int i = 0; i < 100; i++) {
+		sprintf(name, "other%d", i);
+		urit_addstringvar(&vars, name, "x");
+	}
+	for (int i = 0; i < 6; i++) {
+		urit_addstringvar(&vars, (char *) schema[i], values[i]);
+		urit_setslotstring(slots, i, values[i]);
+	}
+	urit_bindtemplate(t, schema, 6);
+	urit_reservestring(uri, 256);
+
+	double start = bench_now();
+	for (size_t i = 0; i < iterations; i++) {
+		urit_resetstring(uri);
+		urit_expandinto(uri, t, &vars);
+	}
+	double named = bench_now() - start;
+
+	start = bench_now();
+	for (size_t i = 0; i < iterations; i++) {
+		urit_resetstring(uri);
+		urit_expandslotsinto(uri, t, slots);
+	}
+	double slotted = bench_now() - start;
+
+	printf("slots/%s: by name %.1f ns, by slot %.1f ns\n", tpl, named / iterations, slotted / iterations);
+	urit_freestring(uri);
+	urit_freeslots(slots);
+	urit_freetemplate(t);
+}
+
+/**
+ * Sets the variables of a request from a parsed request line, copying
+ * them and then borrowing them, and expands once per request
+ */
+void
+bench_borrow(void)
+{
+	const char *request = "GET /t/acme/orders/1234?page=2&limit=50 HTTP/1.1";
+	const char *names[5] = {"tenant", "resource", "id", "page", "limit"};
+	size_t offsets[5][2] = {{7, 4}, {12, 6}, {19, 4}, {29, 1}, {37, 2}};
+	char *tpl = "/t/{tenant}/{resource}/{id}{?page,limit}";
+	size_t iterations = 500000;
+	UritTemplate *t = urit_compile(tpl, NULL);
+	UritString *uri = urit_newstring();
+	UritVars vars = urit_newvars();
+	char copies[5][8];
+
+	for (int k = 0; k < 5; k++) {
+		memcpy(copies[k], request + offsets[k][0], offsets[k][1]);
+		copies[k][offsets[k][1]] = '\0';
+	}
+	urit_reservestring(uri, 256);
+
+	size_t allocs = bench_allocs;
+	double start = bench_now();
+	for (size_t i = 0; i < iterations; i++) {
+		for (int k = 0; k < 5; k++) {
+			urit_addstringvar(&vars, (char *) names[k], copies[k]);
+		}
+		urit_resetstring(uri);
+		urit_expandinto(uri, t, &vars);
+	}
+	double copied = bench_now() - start;
+	size_t copiedallocs = bench_allocs - allocs;
+
+	allocs = bench_allocs;
+	start = bench_now();
+	for (size_t i = 0; i < iterations; i++) {
+		for (int k = 0; k < 5; k++) {
+			urit_borrowstringvar(&vars, (char *) names[k], request + offsets[k][0], offsets[k][1]);
+		}
+		urit_resetstring(uri);
+		urit_expandinto(uri, t, &vars);
+	}
+	double borrowed = bench_now() - start;
+
+	printf("borrow/%s: copied %.1f ns %.2f allocs, borrowed %.1f ns %.2f allocs\n", tpl,
+		copied / iterations, (double) copiedallocs / iterations,
+		borrowed / iterations, (double) (bench_allocs - allocs) / iterations);
+	urit_freevars(&vars);
+	urit_freestring(uri);
+	urit_freetemplate(t);
+}
+
+/**
+ * Builds a 500-pair map and a 500-item list and explodes them, which walks
+ * every key and value once per expansion
+ */
+void
+bench_packed(void)
+{
+	size_t count = 500;
+	size_t iterations = 2000;
+	UritTemplate *t = urit_compile("/search{?params*}{&tags*}", NULL);
+	UritString *uri = urit_newstring();
+	UritVars vars = urit_newvars();
+	char key[16];
+	char val[16];
+
+	size_t allocs = bench_allocs;
+	double start = bench_now();
+	for (size_t i = 0; i < iterations; i++) {
+		UritMap *map = urit_newmap();
+		UritList *list = urit_newlist();
+
+		for (size_t k = 0; k < count; k++) {
+			sprintf(key, "key%zu", k);
+			sprintf(val, "value%zu", k);
+			urit_mapaddkeyval(key, val, map);
+			urit_listadditem(val, list);
+		}
+		urit_varsaddmap(&vars, "params", map);
+		urit_varsaddlist(&vars, "tags", list);
+	}
+	double built = bench_now() - start;
+	size_t builtallocs = bench_allocs - allocs;
+
+	urit_reservestring(uri, 32768);
+	start = bench_now();
+	for (size_t i = 0; i < iterations; i++) {
+		urit_resetstring(uri);
+		urit_expandinto(uri, t, &vars);
+	}
+	double expanded = bench_now() - start;
+
+	printf("packed/%zu pairs and items: build %.1f us %.1f allocs, expand %.1f us\n", count,
+		built / iterations / 1e3, (double) builtallocs / iterations, expanded / iterations / 1e3);
+	urit_freevars(&vars);
+	urit_freestring(uri);
+	urit_freetemplate(t);
+}
+
+/**
+ * Loads a list literal and a map literal of count items each through
+ * urit_addvariable, some of them with escapes
+ */
+void
+bench_loader(size_t count)
+{
+	size_t iterations = 50;
+	char *list = malloc(count * 24 + 3);
+	char *map = malloc(count * 48 + 3);
+	size_t listlen = 1;
+	size_t maplen = 1;
+
+	list[0] = '(';
+	map[0] = '[';
+	for (size_t k = 0; k < count; k++) {
+		const char *sep = k ? "," : "";
+
+		listlen += sprintf(list + listlen, k % 10 ? "%s\"item-%zu\"" : "%s\"it\\\"em %zu\"", sep, k);
+		maplen += sprintf(map + maplen, "%s(\"key%zu\", \"value-%zu\")", sep, k, k);
+	}
+	strcpy(list + listlen, ")");
+	strcpy(map + maplen, "]");
+
+	double start = bench_now();
+	for (size_t i = 0; i < iterations; i++) {
+		UritVars vars = urit_newvars();
+
+		urit_addvariable(&vars, "list", list);
+		urit_freevars(&vars);
+	}
+	double lists = bench_now() - start;
+
+	start = bench_now();
+	for (size_t i = 0; i < iterations; i++) {
+		UritVars vars = urit_newvars();
+
+		urit_addvariable(&vars, "map", map);
+		urit_freevars(&vars);
+	}
+	double maps = bench_now() - start;
+
+	printf("loader/%zu items: list %.2f ms %.0f MB/s, map %.2f ms %.0f MB/s\n", count,
+		lists / iterations / 1e6, listlen * iterations / (lists / 1e3),
+		maps / iterations / 1e6, maplen * iterations / (maps / 1e3));
+	free(list);
+	free(map);
+}
+
+/**
+ * Reads a multi-megabyte JSON document of strings, arrays and objects with
+ * urit_varsfromjson, against pushing the same variables through
+ * urit_addvariable as already converted literals
+ */
+void
+bench_json(void)
+{
+	size_t strings = 20000;
+	size_t containers = 200;
+	size_t items = 1000;
+	size_t iterations = 10;
+	size_t size = 64 * 1024 * 1024;
+	char *json = malloc(size);
+	char **names = malloc(sizeof(char *) * (strings + containers));
+	char **literals = malloc(sizeof(char *) * (strings + containers));
+	size_t len = 0;
+
+	len += sprintf(json + len, "{");
+	for (size_t k = 0; k < strings + containers; k++) {
+		char *lit = malloc(items * 40 + 8);
+		size_t litlen = 0;
+
+		names[k] = malloc(16);
+		sprintf(names[k], "v%zu", k);
+		len += sprintf(json + len, "%s\"%s\":", k ? "," : "", names[k]);
+		if (k < strings) {
+			len += sprintf(json + len, k % 8 ? "\"value-%zu\"" : "\"va\\\"lue-%zu\"", k);
+			litlen += sprintf(lit, k % 8 ? "value-%zu" : "va\"lue-%zu", k);
+		} else if (k % 2) {
+			len += sprintf(json + len, "[");
+			litlen += sprintf(lit, "(");
+			for (size_t i = 0; i < items; i++) {
+				len += sprintf(json + len, "%s\"item-%zu\"", i ? "," : "", i);
+				litlen += sprintf(lit + litlen, "%s\"item-%zu\"", i ? "," : "", i);
+			}
+			len += sprintf(json + len, "]");
+			litlen += sprintf(lit + litlen, ")");
+		} else {
+			len += sprintf(json + len, "{");
+			litlen += sprintf(lit, "[");
+			for (size_t i = 0; i < items; i++) {
+				len += sprintf(json + len, "%s\"key%zu\":\"value-%zu\"", i ? "," : "", i, i);
+				litlen += sprintf(lit + litlen, "%s(\"key%zu\",\"value-%zu\")", i ? "," : "", i, i);
+			}
+			len += sprintf(json + len, "}");
+			litlen += sprintf(lit + litlen, "]");
+		}
+		literals[k] = lit;
+	}
+	len += sprintf(json + len, "}");
+
+	size_t allocs = bench_allocs;
+	double start = bench_now();
+	for (size_t i = 0; i < iterations; i++) {
+		UritVars vars = urit_newvars();
+
+		urit_varsfromjson(json, len, &vars);
+		urit_freevars(&vars);
+	}
+	double read = bench_now() - start;
+	size_t readallocs = bench_allocs - allocs;
+
+	allocs = bench_allocs;
+	start = bench_now();
+	for (size_t i = 0; i < iterations; i++) {
+		UritVars vars = urit_newvars();
+
+		for (size_t k = 0; k < strings + containers; k++) {
+			urit_addvariable(&vars, names[k], literals[k]);
+		}
+		urit_freevars(&vars);
+	}
+	double loaded = bench_now() - start;
+
+	printf("json/%.1f MB: varsfromjson %.2f ms %.0f MB/s %zu allocs, addvariable %.2f ms %zu allocs\n", len / 1e6,
+		read / iterations / 1e6, len * iterations / (read / 1e3), readallocs / iterations,
+		loaded / iterations / 1e6, (bench_allocs - allocs) / iterations);
+	for (size_t k = 0; k < strings + containers; k++) {
+		free(names[k]);
+		free(literals[k]);
+	}
+	free(names);
+	free(literals);
+	free(json);
+}
+
+/**
+ * Renders consecutive page links of one template and variable set, fully
+ * and by re-expanding only the expressions that use the page
+ */
+void
+bench_reexpand(void)
+{
+	char *tpl = "https://{host}/v1/{tenant}/{resource}{?status,sort,limit}{&fields*}{&page}";
+	char *fields[6] = {"id", "customer", "total", "currency", "created_at", "updated_at"};
+	size_t iterations = 1000000;
+	UritTemplate *t = urit_compile(tpl, NULL);
+	UritString *uri = urit_newstring();
+	UritVars vars = urit_newvars();
+	char pages[100][8];
+
+	for (int k = 0; k < 100; k++) {
+		sprintf(pages[k], "%d", k + 1);
+	}
+	urit_addstringvar(&vars, "host", "api.example.com");
+	urit_addstringvar(&vars, "tenant", "acme corp");
+	urit_addstringvar(&vars, "resource", "orders");
+	urit_addstringvar(&vars, "status", "open");
+	urit_addstringvar(&vars, "sort", "-created_at");
+	urit_addstringvar(&vars, "limit", "50");
+	urit_addlistvar(&vars, "fields", 6, fields);
+	urit_borrowstringvar(&vars, "page", pages[0], 1);
+	urit_reservestring(uri, 256);
+
+	double start = bench_now();
+	for (size_t i = 0; i < iterations; i++) {
+		urit_borrowstringvar(&vars, "page", pages[i % 100], strlen(pages[i % 100]));
+		urit_resetstring(uri);
+		urit_expandinto(uri, t, &vars);
+	}
+	double full = bench_now() - start;
+
+	UritExpansion *exp = urit_newexpansion(t, &vars);
+	start = bench_now();
+	for (size_t i = 0; i < iterations; i++) {
+		urit_borrowstringvar(&vars, "page", pages[i % 100], strlen(pages[i % 100]));
+		urit_reexpand(exp, "page");
+	}
+	double incremental = bench_now() - start;
+
+	printf("reexpand/%s: full %.1f ns, incremental %.1f ns\n", tpl, full / iterations, incremental / iterations);
+	urit_freeexpansion(exp);
+	urit_freevars(&vars);
+	urit_freestring(uri);
+	urit_freetemplate(t);
+}
+
+void
+bench_partial(void)
+{
+	char *tpl = "https://{host}/{apiVersion}/{tenant}/users/{id}{?fields,lang}";
+	char ids[100][8];
+	size_t iterations = 1000000;
+	UritTemplate *t = urit_compile(tpl, NULL);
+	UritString *uri = urit_newstring();
+	UritVars constants = urit_newvars();
+	UritVars request = urit_newvars();
+	UritVars all = urit_newvars();
+
+	for (int k = 0; k < 100; k++) {
+		sprintf(ids[k], "%d", k + 1000);
+	}
+	urit_addstringvar(&constants, "host", "api.example.com");
+	urit_addstringvar(&constants, "apiVersion", "v1");
+	urit_addstringvar(&constants, "tenant", "acme corp");
+	urit_addstringvar(&all, "host", "api.example.com");
+	urit_addstringvar(&all, "apiVersion", "v1");
+	urit_addstringvar(&all, "tenant", "acme corp");
+	urit_addstringvar(&all, "fields", "name,email");
+	urit_addstringvar(&request, "fields", "name,email");
+	urit_borrowstringvar(&all, "id", ids[0], 4);
+	urit_borrowstringvar(&request, "id", ids[0], 4);
+	urit_reservestring(uri, 256);
+
+	double start = bench_now();
+	for (size_t i = 0; i < iterations; i++) {
+		urit_borrowstringvar(&all, "id", ids[i % 100], 4);
+		urit_resetstring(uri);
+		urit_expandinto(uri, t, &all);
+	}
+	double full = bench_now() - start;
+
+	UritTemplate *p = urit_partial(t, &constants);
+	start = bench_now();
+	for (size_t i = 0; i < iterations; i++) {
+		urit_borrowstringvar(&request, "id", ids[i % 100], 4);
+		urit_resetstring(uri);
+		urit_expandinto(uri, p, &request);
+	}
+	double partial = bench_now() - start;
+
+	printf("partial/%s: %zu parts %.1f ns, %zu parts %.1f ns\n", tpl, t->count, full / iterations, p->count, partial / iterations);
+	urit_freetemplate(p);
+	urit_freevars(&all);
+	urit_freevars(&request);
+	urit_freevars(&constants);
+	urit_freestring(uri);
+	urit_freetemplate(t);
+}
+
+/**
+ * Expands the RFC 6570 examples and a typical API template by walking their
+ * parts and by running their bytecode, printing the time per expansion and,
+ * where the kernel exposes the counter, branch misses per expansion
+ */
+void
+bench_bytecode(void)
+{
+	size_t count = sizeof(bench_rfctemplates) / sizeof(bench_rfctemplates[0]);
+	size_t iterations = 2000;
+	char *api = "https://{host}/v1/{tenant}/{resource}{/id}{?status,sort,limit}{&fields*}";
+	char *fields[4] = {"id", "customer", "total", "created at"};
+	UritTemplate *rfc[sizeof(bench_rfctemplates) / sizeof(bench_rfctemplates[0])];
+	UritTemplate *t = urit_compile(api, NULL);
+	UritString *uri = urit_newstring();
+	UritVars rfcvars = urit_newvars();
+	UritVars vars = urit_newvars();
+	int fd = bench_openbranchmisses();
+
+	for (size_t i = 0; i < sizeof(bench_rfcvalues) / sizeof(bench_rfcvalues[0]); i++) {
+		urit_addvariable(&rfcvars, bench_rfcvalues[i][0], bench_rfcvalues[i][1]);
+	}
+	for (size_t i = 0; i < count; i++) {
+		rfc[i] = urit_compile(bench_rfctemplates[i], NULL);
+	}
+	urit_addstringvar(&vars, "host", "api.example.com");
+	urit_addstringvar(&vars, "tenant", "acme");
+	urit_addstringvar(&vars, "resource", "orders");
+	urit_addstringvar(&vars, "id", "1042");
+	urit_addstringvar(&vars, "status", "open");
+	urit_addstringvar(&vars, "limit", "50");
+	urit_addlistvar(&vars, "fields", 4, fields);
+	urit_reservestring(uri, 1024);
+
+	for (int code = 0; code < 2; code++) {
+		double start = bench_now();
+		long long misses = bench_readcounter(fd);
+
+		for (size_t n = 0; n < iterations; n++) {
+			for (size_t i = 0; i < count; i++) {
+				UritTemplate walked = *rfc[i];
+
+				if (!code) {
+					walked.code = NULL;
+				}
+				urit_resetstring(uri);
+				urit_expandtemplate(&walked, &rfcvars, uri);
+			}
+		}
+		double rfcns = (bench_now() - start) / (iterations * count);
+		double rfcmisses = (double) (bench_readcounter(fd) - misses) / (iterations * count);
+		UritTemplate walked = *t;
+
+		if (!code) {
+			walked.code = NULL;
+		}
+		start = bench_now();
+		misses = bench_readcounter(fd);
+		for (size_t n = 0; n < iterations * 100; n++) {
+			urit_resetstring(uri);
+			urit_expandtemplate(&walked, &vars, uri);
+		}
+		double apins = (bench_now() - start) / (iterations * 100);
+		double apimisses = (double) (bench_readcounter(fd) - misses) / (iterations * 100);
+
+		if (fd < 0) {
+			printf("bytecode/%s: rfc %.1f ns, api %.1f ns, branch misses n/a\n", code ? "interpreter" : "walker", rfcns, apins);
+		} else {
+			printf("bytecode/%s: rfc %.1f ns %.2f misses, api %.1f ns %.2f misses\n", code ? "interpreter" : "walker", rfcns, rfcmisses, apins, apimisses);
+		}
+	}
+	for (size_t i = 0; i < count; i++) {
+		urit_freetemplate(rfc[i]);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	urit_freevars(&rfcvars);
+	urit_freevars(&vars);
+	urit_freestring(uri);
+	urit_freetemplate(t);
+}
+
+/**
+ * Expands the template of emitted.c with its bytecode and with the function
+ * urit --emit-c generated for it
+ */
+void
+bench_emitc(void)
+{
+	char *tpl = "https://{host}/v1/{tenant}/{resource}{/id}{?status,sort,limit}{&fields*}";
+	char *fields[4] = {"id", "customer", "total", "created at"};
+	UritSlice slices[4] = {{"id", 2}, {"customer", 8}, {"total", 5}, {"created at", 10}};
+	size_t iterations = 1000000;
+	UritTemplate *t = urit_compile(tpl, NULL);
+	UritString *uri = urit_newstring();
+	UritVars vars = urit_newvars();
+	char buf[256];
+	size_t len = 0;
+
+	urit_addstringvar(&vars, "host", "api.example.com");
+	urit_addstringvar(&vars, "tenant", "acme");
+	urit_addstringvar(&vars, "resource", "orders");
+	urit_addstringvar(&vars, "id", "1042");
+	urit_addstringvar(&vars, "status", "open");
+	urit_addstringvar(&vars, "limit", "50");
+	urit_addlistvar(&vars, "fields", 4, fields);
+	urit_reservestring(uri, 256);
+
+	double start = bench_now();
+	for (size_t i = 0; i < iterations; i++) {
+		urit_resetstring(uri);
+		urit_expandinto(uri, t, &vars);
+	}
+	double interpreted = bench_now() - start;
+
+	start = bench_now();
+	for (size_t i = 0; i < iterations; i++) {
+		len += bench_generated(buf, sizeof(buf), "api.example.com", 15, "acme", 4, "orders", 6, "1042", 4,
+			"open", 4, NULL, 0, "50", 2, slices, 4);
+	}
+	double generated = bench_now() - start;
+
+	if (len != uri->len * iterations || strcmp(buf, uri->str) != 0) {
+		printf("emitc: generated %s, interpreted %s\n", buf, uri->str);
+	}
+	printf("emitc/%s: interpreted %.1f ns, generated %.1f ns\n", tpl, interpreted / iterations, generated / iterations);
+	urit_freevars(&vars);
+	urit_freestring(uri);
+	urit_freetemplate(t);
+}
+
+/**
+ * Opens a counter of the branches this thread mispredicts in user space,
+ * returning -1 where there is none
+ */
+int
+bench_openbranchmisses(void)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+long long
+bench_readcounter(int fd)
+{
+	long long count = 0;
+
+	if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) {
+		return 0;
+	}
+	return count;
+}
+
+/**
+ * Runs every workload through each API and prints one tab-separated row per
+ * pair, so the output of two releases can be diffed. ns is the mean of an
+ * untimed loop; p50 and p99 come from timing each expansion on its own and
+ * so include the cost of reading the clock.
+ */
+void
+bench_suite(void)
+{
+	char *names[4] = {"rfc-level1", "rfc-level2", "rfc-level3", "rfc-level4"};
+	size_t count = sizeof(bench_rfctemplates) / sizeof(bench_rfctemplates[0]);
+	char *levels[4][sizeof(bench_rfctemplates) / sizeof(bench_rfctemplates[0])];
+	BenchWorkload workloads[7];
+	size_t n = 0;
+	UritVars rfc = urit_newvars();
+	UritVars large = urit_newvars();
+	UritVars many = urit_newvars();
+	char *largetpls[2] = {"/search{?q}", "/raw{+q}"};
+	char *manytpls[2] = {0};
+	char *value = malloc(16384 + 1);
+	char name[16];
+	char tpl[1024];
+	size_t len = 0;
+
+	for (size_t i = 0; i < sizeof(bench_rfcvalues) / sizeof(bench_rfcvalues[0]); i++) {
+		urit_addvariable(&rfc, bench_rfcvalues[i][0], bench_rfcvalues[i][1]);
+	}
+	for (int l = 0; l < 4; l++) {
+		size_t k = 0;
+
+		for (size_t i = 0; i < count; i++) {
+			if (bench_rfclevel(bench_rfctemplates[i], &rfc) == l + 1) {
+				levels[l][k++] = bench_rfctemplates[i];
+			}
+		}
+		workloads[n++] = (BenchWorkload) {names[l], &rfc, k, levels[l], 2000};
+	}
+
+	for (size_t i = 0; i < 16384; i++) {
+		value[i] = i % 64 == 63 ? ' ' : "abcdefghijklmnopqrstuvwxyz0123456789-._~/?#[]@!$&'()*+,;=%"[i % 58];
+	}
+	value[16384] = '\0';
+	urit_addstringvar(&large, "q", value);
+	workloads[n++] = (BenchWorkload) {"large-value", &large, 2, largetpls, 200};
+
+	for (int i = 0; i < 1000; i++) {
+		sprintf(name, "v%d", i);
+		urit_addstringvar(&many, name, name);
+	}
+	len = sprintf(tpl, "/items/{v999}{?");
+	for (int i = 0; i < 1000; i += 20) {
+		len += sprintf(tpl + len, "%sv%d", i ? "," : "", i);
+	}
+	sprintf(tpl + len, "}");
+	manytpls[0] = tpl;
+	workloads[n++] = (BenchWorkload) {"many-vars", &many, 1, manytpls, 20000};
+
+	puts("workload\tapi\texpansions\tns\tp50_ns\tp99_ns\tbytes_per_s\tallocs");
+	for (size_t w = 0; w < n; w++) {
+		bench_workload(&workloads[w], BENCH_PARSETEMPLATE);
+		bench_workload(&workloads[w], BENCH_EXPAND);
+		bench_workload(&workloads[w], BENCH_EXPANDTO);
+	}
+	free(value);
+}
+
+void
+bench_workload(const BenchWorkload *w, BenchApi api)
+{
+	char *apis[3] = {"parsetemplate", "expand", "expandto"};
+	size_t total = w->iterations * w->count;
+	UritTemplate **compiled = malloc(sizeof(UritTemplate *) * w->count);
+	double *samples = malloc(sizeof(double) * total);
+	size_t bytes = 0;
+	size_t allocs;
+	size_t k = 0;
+
+	for (size_t t = 0; t < w->count; t++) {
+		compiled[t] = urit_compile(w->templates[t], NULL);
+	}
+
+	allocs = bench_allocs;
+	double start = bench_now();
+	for (size_t i = 0; i < w->iterations; i++) {
+		for (size_t t = 0; t < w->count; t++) {
+			bytes += bench_expandone(api, w->templates[t], compiled[t], w->vars);
+		}
+	}
+	double elapsed = bench_now() - start;
+	allocs = bench_allocs - allocs;
+
+	for (size_t i = 0; i < w->iterations; i++) {
+		for (size_t t = 0; t < w->count; t++) {
+			double before = bench_now();
+			bench_expandone(api, w->templates[t], compiled[t], w->vars);
+			samples[k++] = bench_now() - before;
+		}
+	}
+	qsort(samples, total, sizeof(double), bench_compare);
+
+	printf("%s\t%s\t%zu\t%.1f\t%.0f\t%.0f\t%.0f\t%.2f\n", w->name, apis[api], total, elapsed / total,
+		samples[total / 2], samples[total * 99 / 100], bytes / (elapsed / 1e9), (double) allocs / total);
+
+	for (size_t t = 0; t < w->count; t++) {
+		urit_freetemplate(compiled[t]);
+	}
+	free(compiled);
+	free(samples);
+}
+
+/**
+ * Expands one template through api, returning the length of the URI
+ */
+size_t
+bench_expandone(BenchApi api, const char *tpl, const UritTemplate *t, const UritVars *vars)
+{
+	static char buf[65536];
+	size_t len;
+
+	switch (api) {
+		case BENCH_PARSETEMPLATE: {
+			UritResult res = urit_parsetemplate((char *) tpl, *vars);
+			len = res.uriref->len;
+			urit_freeresult(&res);
+			return len;
+		}
+		case BENCH_EXPAND: {
+			char *uri = urit_expand(t, vars);
+			len = strlen(uri);
+			free(uri);
+			return len;
+		}
+		default:
+			return urit_expandto(buf, sizeof(buf), tpl, vars, NULL);
+	}
+}
+
+/**
+ * The RFC 6570 level a template needs: 4 for prefixes, explodes or
+ * composite values, 3 for several varspecs or the . / ; ? & operators, 2
+ * for + and # and 1 otherwise
+ */
+int
+bench_rfclevel(const char *tpl, const UritVars *vars)
+{
+	UritTemplate *t = urit_compile(tpl, NULL);
+	int level = 1;
+
+	for (size_t i = 0; i < t->count; i++) {
+		const UritPart *part = &t->parts[i];
+
+		if (part->type == URIT_LITERAL) {
+			continue;
+		}
+		for (size_t k = 0; k < part->count; k++) {
+			const UritVar *var = urit_getvar(vars, part->varspecs[k].name, part->varspecs[k].len);
+
+			if (part->varspecs[k].expl || part->varspecs[k].prefix || (var && var->type != URIT_STRING)) {
+				level = 4;
+			}
+		}
+		if (level < 3 && (part->count > 1 || (part->oprule.op && strchr("./;?&", part->oprule.op)))) {
+			level = 3;
+		}
+		if (level < 2 && part->oprule.op) {
+			level = 2;
+		}
+	}
+	urit_freetemplate(t);
+	return level;
+}
+
+int
+bench_compare(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
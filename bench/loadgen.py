@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+"""Load generator for `urit --serve`.
+
+Sends the same mix of requests to the server over a pipe and over a Unix
+socket, pipelining them, and to the one-shot CLI with one process per
+request, and prints requests/second for each.
+
+    python3 bench/loadgen.py [--urit ./urit] [--requests 200000] [--oneshot 500] [--clients 4]
+"""
+
+import argparse
+import json
+import os
+import socket
+import subprocess
+import tempfile
+import threading
+import time
+
+TEMPLATES = [
+    ("/users/{id}", lambda i: {"id": str(i)}),
+    ("/search{?q,page}", lambda i: {"q": "term %d" % i, "page": str(i % 10)}),
+    ("/t/{tenant}/{resource}/{id}{?page,limit}",
+     lambda i: {"tenant": "acme", "resource": "orders", "id": str(i), "page": "2", "limit": "50"}),
+    ("/colors{/list*}", lambda i: {"list": ["red", "green", str(i)]}),
+    ("/q{?params*}", lambda i: {"params": {"a": str(i), "b": "x y"}}),
+]
+
+
+def make_requests(count):
+    requests = []
+    for i in range(count):
+        tpl, make = TEMPLATES[i % len(TEMPLATES)]
+        requests.append((tpl, make(i)))
+    return requests
+
+
+def encode(requests):
+    return b"".join(("%s\t%s\n" % (tpl, json.dumps(v))).encode() for tpl, v in requests)
+
+
+def drain(stream, expected, counts, index):
+    seen = 0
+    while seen < expected:
+        chunk = stream.read(1 << 16) if hasattr(stream, "read") else stream.recv(1 << 16)
+        if not chunk:
+            break
+        seen += chunk.count(b"\n")
+    counts[index] = seen
+
+
+def run_pipe(urit, payload, count):
+    proc = subprocess.Popen([urit, "--serve"], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+    counts = [0]
+    start = time.perf_counter()
+    reader = threading.Thread(target=drain, args=(proc.stdout, count, counts, 0))
+    reader.start()
+    proc.stdin.write(payload)
+    proc.stdin.close()
+    reader.join()
+    elapsed = time.perf_counter() - start
+    proc.wait()
+    return counts[0], elapsed
+
+
+def run_socket(urit, payload, count, clients):
+    path = os.path.join(tempfile.mkdtemp(), "urit.sock")
+    proc = subprocess.Popen([urit, "--serve=" + path], stderr=subprocess.DEVNULL)
+    while not os.path.exists(path):
+        time.sleep(0.01)
+    lines = payload.splitlines(keepends=True)
+    shares = [b"".join(lines[k::clients]) for k in range(clients)]
+    counts = [0] * clients
+    socks = []
+    for k in range(clients):
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        s.connect(path)
+        socks.append(s)
+    start = time.perf_counter()
+    readers = []
+    for k, s in enumerate(socks):
+        expected = shares[k].count(b"\n")
+        t = threading.Thread(target=drain, args=(s, expected, counts, k))
+        t.start()
+        readers.append(t)
+        threading.Thread(target=s.sendall, args=(shares[k],)).start()
+    for t in readers:
+        t.join()
+    elapsed = time.perf_counter() - start
+    for s in socks:
+        s.close()
+    proc.terminate()
+    proc.wait()
+    os.unlink(path)
+    return sum(counts), elapsed
+
+
+def literal(value):
+    if isinstance(value, list):
+        return "(%s)" % ",".join('"%s"' % v for v in value)
+    if isinstance(value, dict):
+        return "[%s]" % ",".join('("%s","%s")' % kv for kv in value.items())
+    return value
+
+
+def run_oneshot(urit, requests):
+    start = time.perf_counter()
+    for tpl, variables in requests:
+        args = [urit, tpl] + ["--%s=%s" % (k, literal(v)) for k, v in variables.items()]
+        subprocess.run(args, stdout=subprocess.DEVNULL, check=True)
+    return len(requests), time.perf_counter() - start
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--urit", default=os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "urit"))
+    parser.add_argument("--requests", type=int, default=200000)
+    parser.add_argument("--oneshot", type=int, default=500)
+    parser.add_argument("--clients", type=int, default=4)
+    args = parser.parse_args()
+
+    requests = make_requests(args.requests)
+    payload = encode(requests)
+    results = [
+        ("serve/stdin", run_pipe(args.urit, payload, len(requests))),
+        ("serve/socket x%d" % args.clients, run_socket(args.urit, payload, len(requests), args.clients)),
+        ("one-shot", run_oneshot(args.urit, requests[:args.oneshot])),
+    ]
+    for name, (done, elapsed) in results:
+        print("%s: %d requests in %.3f s, %.0f requests/s" % (name, done, elapsed, done / elapsed))
+
+
+if __name__ == "__main__":
+    main()
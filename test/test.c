@@ -3,20 +3,54 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include "uritlib.h"
 #include "uritlib.c"
 
+/**
+ * Where ./test --emit-c=FILE writes a C function for every fixture along
+ * with a check of its output against the interpreter's
+ */
+FILE *test_emitted = NULL;
+size_t test_emittedcount = 0;
+
 bool test_add_generic(void);
 bool test_add_strings(void);
 bool test_add_lists(void);
 bool test_add_maps(void);
+bool test_many_vars(void);
+bool test_threads(void);
+bool test_batch(void);
+bool test_match(void);
+bool test_router(void);
+bool test_cache(void);
+bool test_allocator(void);
+bool test_slots(void);
+bool test_borrow(void);
+bool test_literals(void);
+bool test_json(void);
+bool test_reexpand(void);
+bool test_partial(void);
+bool test_bytecode(void);
+void *test_alloc(size_t size, void *ctx);
+void *test_realloc(void *ptr, size_t size, void *ctx);
+void test_free(void *ptr, void *ctx);
+void *test_threadmain(void *arg);
 bool test_templates(UritVars vars, size_t count, char templates[][2][100]);
+void test_emitcase(const char *tpl, const UritVars *vars);
 
 int
 main(int argc, char **argv)
 {
 	bool success;
 
+	if (argc == 2 && strncmp(argv[1], "--emit-c=", 9) == 0) {
+		if (!(test_emitted = fopen(argv[1] + 9, "w"))) {
+			printf("Cannot write %s\n", argv[1] + 9);
+			return EXIT_FAILURE;
+		}
+		fputs("#include <stdio.h>\n#include <stdlib.h>\n#include \"uritrt.h\"\n", test_emitted);
+	}
 	puts("test_add_generic()");
 	success = test_add_generic();
 	if (!success) {
@@ -49,16 +83,270 @@ main(int argc, char **argv)
 	} else {
 		puts("  success");
 	}
+	puts("test_many_vars()");
+	success = test_many_vars();
+	if (!success) {
+		puts("test_many_vars failed");
+		return EXIT_SUCCESS;
+	} else {
+		puts("  success");
+	}
+	puts("test_threads()");
+	success = test_threads();
+	if (!success) {
+		puts("test_threads failed");
+		return EXIT_SUCCESS;
+	} else {
+		puts("  success");
+	}
+	puts("test_batch()");
+	success = test_batch();
+	if (!success) {
+		puts("test_batch failed");
+		return EXIT_SUCCESS;
+	} else {
+		puts("  success");
+	}
+	puts("test_match()");
+	success = test_match();
+	if (!success) {
+		puts("test_match failed");
+		return EXIT_SUCCESS;
+	} else {
+		puts("  success");
+	}
+	puts("test_router()");
+	success = test_router();
+	if (!success) {
+		puts("test_router failed");
+		return EXIT_SUCCESS;
+	} else {
+		puts("  success");
+	}
+	puts("test_cache()");
+	success = test_cache();
+	if (!success) {
+		puts("test_cache failed");
+		return EXIT_SUCCESS;
+	} else {
+		puts("  success");
+	}
+	puts("test_allocator()");
+	success = test_allocator();
+	if (!success) {
+		puts("test_allocator failed");
+		return EXIT_SUCCESS;
+	} else {
+		puts("  success");
+	}
+	puts("test_slots()");
+	success = test_slots();
+	if (!success) {
+		puts("test_slots failed");
+		return EXIT_SUCCESS;
+	} else {
+		puts("  success");
+	}
+	puts("test_borrow()");
+	success = test_borrow();
+	if (!success) {
+		puts("test_borrow failed");
+		return EXIT_SUCCESS;
+	} else {
+		puts("  success");
+	}
+	puts("test_literals()");
+	success = test_literals();
+	if (!success) {
+		puts("test_literals failed");
+		return EXIT_SUCCESS;
+	} else {
+		puts("  success");
+	}
+	puts("test_json()");
+	success = test_json();
+	if (!success) {
+		puts("test_json failed");
+		return EXIT_SUCCESS;
+	} else {
+		puts("  success");
+	}
+	puts("test_reexpand()");
+	success = test_reexpand();
+	if (!success) {
+		puts("test_reexpand failed");
+		return EXIT_SUCCESS;
+	} else {
+		puts("  success");
+	}
+	puts("test_partial()");
+	success = test_partial();
+	if (!success) {
+		puts("test_partial failed");
+		return EXIT_SUCCESS;
+	} else {
+		puts("  success");
+	}
+	puts("test_bytecode()");
+	success = test_bytecode();
+	if (!success) {
+		puts("test_bytecode failed");
+		return EXIT_SUCCESS;
+	} else {
+		puts("  success");
+	}
 	puts("All tests have passed");
 
+	if (test_emitted) {
+		fputs("\nint\nmain(void)\n{\n\tint failures = 0;\n\n", test_emitted);
+		for (size_t i = 0; i < test_emittedcount; i++) {
+			fprintf(test_emitted, "\tfailures += check%zu();\n", i);
+		}
+		fprintf(test_emitted, "\tif (failures) {\n\t\tprintf(\"%%d of %zu generated functions failed\\n\", failures);\n"
+			"\t\treturn EXIT_FAILURE;\n\t}\n\tputs(\"All %zu generated functions match\");\n\treturn EXIT_SUCCESS;\n}\n",
+			test_emittedcount, test_emittedcount);
+		fclose(test_emitted);
+	}
 	return EXIT_SUCCESS;
 }
 
+bool
+test_bytecode(void)
+{
+	char templates[][100] = {
+		"/a{x}b{+x:3}{#x,undef,empty}",
+		"{?x,empty,undef}{&list,emptylist}{;x,empty,list,map,emptymap}",
+		"{list*}{+list*}{#map*}{.list*,map*}{/list*,emptylist*}",
+		"{;list*,map*,emptymap*}{?list*,map*}{&map*,emptylist*}",
+		"{list:2,map:1}{?list:2,map:1,x:2}{;list*,map*}",
+		"{undef}{?undef}{/undef*}",
+	};
+	char *list[3] = {"red", "green blue", "%41"};
+	char *map[2][2] = {{"semi", ";"}, {"dot", "."}};
+	bool success = true;
+	UritVars vars = urit_newvars();
+
+	urit_addstringvar(&vars, "x", "Hello World!");
+	urit_addstringvar(&vars, "empty", "");
+	urit_addlistvar(&vars, "list", 3, list);
+	urit_addlistvar(&vars, "emptylist", 0, NULL);
+	urit_addmapvar(&vars, "map", 2, map);
+	urit_addmapvar(&vars, "emptymap", 0, NULL);
+
+	for (int i = 0; i < sizeof(templates) / sizeof(templates[0]); i++) {
+		UritTemplate *tpl = urit_compile(templates[i], NULL);
+		UritTemplate walked = *tpl;
+
+		walked.code = NULL;
+		char *expected = urit_expand(&walked, &vars);
+		char *uri = urit_expand(tpl, &vars);
+
+		test_emitcase(templates[i], &vars);
+
+		if (strcmp(uri, expected) != 0) {
+			success = false;
+			printf("Running %s gave %s, should be %s\n", templates[i], uri, expected);
+		}
+		free(expected);
+		free(uri);
+		urit_freetemplate(tpl);
+	}
+	urit_freevars(&vars);
+	return success;
+}
+
+/**
+ * Writes the function urit_emitc generates for tpl to test_emitted, with a
+ * check that calls it with vars and compares what it writes, whole and
+ * truncated, with urit_expand
+ */
+void
+test_emitcase(const char *tpl, const UritVars *vars)
+{
+	if (!test_emitted) {
+		return;
+	}
+	UritTemplate *t = urit_compile(tpl, NULL);
+	UritString *code = urit_newstring();
+	UritString *args = urit_newstring();
+	const UritVarSpec **params = malloc(sizeof(UritVarSpec *) * strlen(tpl));
+	size_t n = test_emittedcount++;
+	char name[32];
+
+	sprintf(name, "generated%zu", n);
+	urit_emitc(code, t, name, vars);
+	fprintf(test_emitted, "\n%s\nint\ncheck%zu(void)\n{\n", code->str, n);
+
+	for (size_t i = 0, count = urit_emitparams(t, params); i < count; i++) {
+		const UritVar *var = urit_getvar(vars, params[i]->name, params[i]->len);
+
+		if (!var) {
+			urit_appendformat(args, ", NULL, 0");
+		} else if (var->type == URIT_STRING) {
+			urit_appendformat(args, ", ");
+			urit_appendcstring(args, var->val_string, var->len, '"');
+			urit_appendformat(args, ", %zu", var->len);
+		} else {
+			size_t items = var->type == URIT_LIST ? var->val_list->count : var->val_map->count;
+
+			fprintf(test_emitted, var->type == URIT_LIST ? "\tstatic const UritSlice arg%zu[] = {{\"\", 0}" :
+				"\tstatic const UritSlice arg%zu[][2] = {{{\"\", 0}, {\"\", 0}}", i);
+			for (size_t k = 0; k < items; k++) {
+				UritString *item = urit_newstring();
+				size_t len;
+
+				if (var->type == URIT_LIST) {
+					const char *str = urit_listitem(var->val_list, k, &len);
+
+					urit_appendcstring(item, str, len, '"');
+					fprintf(test_emitted, ", {%s, %zu}", item->str, len);
+				} else {
+					UritPair pair = urit_mapitem(var->val_map, k);
+
+					urit_appendformat(item, "{{");
+					urit_appendcstring(item, pair.key, pair.keylen, '"');
+					urit_appendformat(item, ", %zu}, {", pair.keylen);
+					urit_appendcstring(item, pair.val, pair.vallen, '"');
+					urit_appendformat(item, ", %zu}}", pair.vallen);
+					fprintf(test_emitted, ", %s", item->str);
+				}
+				urit_freestring(item);
+			}
+			fputs("};\n", test_emitted);
+			urit_appendformat(args, ", arg%zu + 1, %zu", i, items);
+		}
+	}
+	char *expected = urit_expand(t, vars);
+	UritString *literal = urit_newstring();
+
+	urit_appendcstring(literal, expected, strlen(expected), '"');
+	fprintf(test_emitted, "\tchar buf[256];\n\tchar small[8] = {0};\n"
+		"\tsize_t len = %s(buf, sizeof(buf)%s);\n\tsize_t smalllen = %s(small, sizeof(small)%s);\n\n"
+		"\tif (len != %zu || strcmp(buf, %s) != 0 || smalllen != len || strncmp(small, buf, sizeof(small) - 1) != 0 || small[sizeof(small) - 1]) {\n"
+		"\t\tprintf(\"Generated code for %%s gave %%s, should be %%s\\n\", ",
+		name, args->str, name, args->str, strlen(expected), literal->str);
+	urit_resetstring(args);
+	urit_appendcstring(args, tpl, strlen(tpl), '"');
+	fprintf(test_emitted, "%s, buf, %s);\n\t\treturn 1;\n\t}\n\treturn 0;\n}\n", args->str, literal->str);
+
+	free(expected);
+	free(params);
+	urit_freestring(literal);
+	urit_freestring(args);
+	urit_freestring(code);
+	urit_freetemplate(t);
+}
+
 bool
 test_templates(UritVars vars, size_t count, char templates[][2][100])
 {
 	bool success = true;
 	char templateUrl[100] = "http://www.example.com/";
+	UritContext *ctx = urit_newcontext();
+	UritString *uri = urit_newstring();
+
+	urit_reservestring(uri, 200);
+	size_t reserved = uri->size;
 
 	for (int i = 0; i < (int) count; i++) {
 		char template[100];
@@ -76,7 +364,46 @@ test_templates(UritVars vars, size_t count, char templates[][2][100])
 			success = false;
 			printf("Expanding '%s' failed, %s should be %s Res: %d\n", template, res.uri, correctExpansion, pos);
 		}
+		urit_freeresult(&res);
+
+		res = urit_parsetemplatein(ctx, template, vars);
+		if (strcmp(res.uri, correctExpansion) != 0) {
+			success = false;
+			printf("Expanding '%s' in a context failed, %s should be %s\n", template, res.uri, correctExpansion);
+		}
+		urit_resetcontext(ctx);
+
+		UritTemplate *tpl = urit_compile(template, NULL);
+		for (int j = 0; j < 2; j++) {
+			char *expanded = urit_expand(tpl, &vars);
+			if (strcmp(expanded, correctExpansion) != 0) {
+				success = false;
+				printf("Compiled expansion of '%s' failed, %s should be %s\n", template, expanded, correctExpansion);
+			}
+			free(expanded);
+		}
+		urit_resetstring(uri);
+		urit_expandinto(uri, tpl, &vars);
+		if (strcmp(uri->str, correctExpansion) != 0 || uri->size != reserved) {
+			success = false;
+			printf("Expanding '%s' into a reused string failed, %s should be %s\n", template, uri->str, correctExpansion);
+		}
+		urit_freetemplate(tpl);
+		test_emitcase(template, &vars);
+
+		char buf[100];
+		char small[8];
+		UritStatus st;
+		size_t len = urit_expandto(buf, sizeof(buf), template, &vars, &st);
+		size_t smalllen = urit_expandto(small, sizeof(small), template, &vars, NULL);
+		if (st != URIT_OK || len != strlen(correctExpansion) || strcmp(buf, correctExpansion) != 0 ||
+			smalllen != len || strncmp(small, correctExpansion, sizeof(small) - 1) != 0 || small[sizeof(small) - 1]) {
+			success = false;
+			printf("Expanding '%s' into a buffer failed, %s should be %s\n", template, buf, correctExpansion);
+		}
 	}
+	urit_freecontext(ctx);
+	urit_freestring(uri);
 	return success;
 }
 
@@ -437,3 +764,651 @@ bool test_add_maps(void)
 	return success;
 }
 
+
+bool
+test_many_vars(void)
+{
+	char name[16];
+	char value[16];
+	char uri[64];
+	UritVars vars = urit_newvars();
+
+	for (int i = 0; i < 1000; i++) {
+		sprintf(name, "v%d", i);
+		sprintf(value, "%d", i * 2);
+		urit_addstringvar(&vars, name, value);
+	}
+	urit_addstringvar(&vars, "v500", "replaced");
+
+	if (vars.count != 1000 || urit_addvariable(&vars, "v1", "x") != URIT_DUPLICATE_VARIABLE) {
+		return false;
+	}
+	urit_expandto(uri, sizeof(uri), "{?v0,v999,v500,v1000}", &vars, NULL);
+	if (strcmp(uri, "?v0=0&v999=1998&v500=replaced") != 0) {
+		printf("Expanding with 1000 variables failed: %s\n", uri);
+		return false;
+	}
+	return true;
+}
+
+char thread_templates[][2][100] = {
+	{"{/list*,path:4}", "/red/green/blue/%2Ffoo"},
+	{"{?x,y,empty}", "?x=1024&y=768&empty="},
+	{"{;keys*}", ";semi=%3B;dot=.;comma=%2C"},
+	{"{#path,x}/here", "#/foo/bar,1024/here"}
+};
+
+void *
+test_threadmain(void *arg)
+{
+	UritVars *vars = arg;
+	char uri[100];
+
+	for (int i = 0; i < 2000; i++) {
+		for (int j = 0; j < 4; j++) {
+			urit_expandto(uri, sizeof(uri), thread_templates[j][0], vars, NULL);
+			if (strcmp(uri, thread_templates[j][1]) != 0) {
+				printf("Concurrent expansion of '%s' failed: %s\n", thread_templates[j][0], uri);
+				return (void *) 1;
+			}
+		}
+	}
+	return NULL;
+}
+
+bool
+test_threads(void)
+{
+	pthread_t threads[4];
+	void *failed;
+	bool success = true;
+	UritVars vars = urit_newvars();
+
+	urit_addvariable(&vars, "list", "(\"red\",\"green\",\"blue\")");
+	urit_addvariable(&vars, "keys", "[(\"semi\",\";\"),(\"dot\",\".\"),(\"comma\",\",\")]");
+	urit_addvariable(&vars, "path", "/foo/bar");
+	urit_addvariable(&vars, "x", "1024");
+	urit_addvariable(&vars, "y", "768");
+	urit_addvariable(&vars, "empty", "");
+
+	for (int i = 0; i < 4; i++) {
+		pthread_create(&threads[i], NULL, test_threadmain, &vars);
+	}
+	for (int i = 0; i < 4; i++) {
+		pthread_join(threads[i], &failed);
+		if (failed) {
+			success = false;
+		}
+	}
+	return success;
+}
+
+bool
+test_batch(void)
+{
+	char id[16];
+	char uri[100];
+	UritVars sets[50];
+	UritTemplate *tpl = urit_compile("/products/{id}{?utm*}", NULL);
+	UritBatch *batch = urit_newbatch();
+
+	for (int i = 0; i < 50; i++) {
+		sets[i] = urit_newvars();
+		sprintf(id, "%d", i);
+		urit_addvariable(&sets[i], "id", id);
+		if (i % 2) {
+			urit_addvariable(&sets[i], "utm", "[(\"source\",\"feed\"),(\"medium\",\"web\")]");
+		}
+	}
+	for (size_t threads = 1; threads <= 4; threads += 3) {
+		urit_expandbatch(batch, tpl, sets, 50, '\n', threads);
+
+		for (int i = 0; i < 50; i++) {
+			size_t len = batch->offsets[i + 1] - batch->offsets[i] - 1;
+			size_t expected = urit_expandto(uri, sizeof(uri), "/products/{id}{?utm*}", &sets[i], NULL);
+
+			if (len != expected || strncmp(batch->uris->str + batch->offsets[i], uri, len) != 0 ||
+				batch->uris->str[batch->offsets[i + 1] - 1] != '\n') {
+				printf("Batch row %d with %zu threads failed, should be %s\n", i, threads, uri);
+				return false;
+			}
+		}
+	}
+	urit_freebatch(batch);
+	urit_freetemplate(tpl);
+	return true;
+}
+
+bool
+test_match(void)
+{
+	char templates[][2][100] = {
+		{"/users/{id}.json", "/users/42.json"},
+		{"/users/{id}{?fields,limit}", "/users/42?fields=a,b&limit=10"},
+		{"/search{?q}{&page}", "/search?q=Hello%20World%21&page=2"},
+		{"{/who,dub}", "/fred/me%2Ftoo"},
+		{"{/list*,path:4}", "/red/green/blue/%2Ffoo"},
+		{"{x,hello,y}", "1024,Hello%20World%21,768"},
+		{"{+path}/here", "/foo/bar/here"},
+		{"{+base}index", "http://example.com/home/index"},
+		{"{#path,x}/here", "#/foo/bar,1024/here"},
+		{"X{.list*}", "X.red.green.blue"},
+		{"{;v,empty,who}", ";v=6;empty;who=fred"},
+		{"{;list*}", ";list=red;list=green;list=blue"},
+		{"{?keys*}", "?semi=%3B&dot=.&comma=%2C"},
+		{"{/keys*}", "/semi=%3B/dot=./comma=%2C"},
+		{"{?x,y,empty}", "?x=1024&y=768&empty="},
+		{"O{empty}X", "OX"}
+	};
+	char mismatches[][2][100] = {
+		{"/users/{id}.json", "/posts/42.json"},
+		{"/users/{id}", "/users/42/posts"},
+		{"{/who}", "/fred/fred"},
+		{"{?x}", "?y=1"}
+	};
+	bool success = true;
+
+	for (int i = 0; i < sizeof(templates) / sizeof(templates[0]); i++) {
+		UritTemplate *tpl = urit_compile(templates[i][0], NULL);
+		UritVars vars = urit_newvars();
+		UritStatus st = urit_match(tpl, templates[i][1], &vars);
+		char *expanded = urit_expand(tpl, &vars);
+
+		if (st != URIT_OK || strcmp(expanded, templates[i][1]) != 0) {
+			success = false;
+			printf("Matching '%s' against '%s' failed, expands back to %s\n", templates[i][1], templates[i][0], expanded);
+		}
+		free(expanded);
+		urit_freetemplate(tpl);
+	}
+	for (int i = 0; i < sizeof(mismatches) / sizeof(mismatches[0]); i++) {
+		UritTemplate *tpl = urit_compile(mismatches[i][0], NULL);
+		UritVars vars = urit_newvars();
+
+		if (urit_match(tpl, mismatches[i][1], &vars) != URIT_FAILURE) {
+			success = false;
+			printf("'%s' should not match '%s'\n", mismatches[i][1], mismatches[i][0]);
+		}
+		urit_freetemplate(tpl);
+	}
+
+	UritTemplate *tpl = urit_compile("/search{?q,tags}", NULL);
+	UritVars vars = urit_newvars();
+	urit_match(tpl, "/search?q=caf%C3%A9%20au%20lait&tags=a,b", &vars);
+	UritVar *q = urit_getvar(&vars, "q", 1);
+	UritVar *tags = urit_getvar(&vars, "tags", 4);
+	size_t len;
+	if (!q || q->type != URIT_STRING || strcmp(q->val_string, "caf\xC3\xA9 au lait") != 0 ||
+		!tags || tags->type != URIT_LIST || tags->val_list->count != 2 || strcmp(urit_listitem(tags->val_list, 1, &len), "b") != 0) {
+		success = false;
+		puts("Matched values were not decoded");
+	}
+	urit_freetemplate(tpl);
+	return success;
+}
+
+bool
+test_router(void)
+{
+	char *routes[] = {
+		"/users/{id}",
+		"/users/{id}.json",
+		"/users/me",
+		"/users/{id}/posts{?page}",
+		"/usage{/period}",
+		"/files{/path*}",
+		"/search{?q,tags}",
+		"/users/{uid}/likes",
+		"/orgs/{org}/members",
+		"/orgs/{team}/teams"
+	};
+	struct {
+		char *uri;
+		int id;
+	} uris[] = {
+		{"/users/42", 0},
+		{"/users/42.json", 1},
+		{"/users/me", 2},
+		{"/users/mel", 0},
+		{"/users/42/posts?page=3", 3},
+		{"/users/42/posts", 3},
+		{"/usage/2024", 4},
+		{"/files/a/b/c.txt", 5},
+		{"/search?q=urit&tags=a,b", 6},
+		{"/posts/1", -1},
+		{"/users/42/comments", -1},
+		{"/users/42/likes", 7},
+		{"/orgs/acme/members", 8},
+		{"/orgs/core/teams", 9}
+	};
+	bool success = true;
+	UritRouter *router = urit_newrouter();
+
+	for (int i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+		urit_addroute(router, routes[i], NULL);
+	}
+	for (int i = 0; i < sizeof(uris) / sizeof(uris[0]); i++) {
+		size_t id;
+		UritVars vars = urit_newvars();
+		UritStatus st = urit_route(router, uris[i].uri, &id, &vars);
+
+		if (uris[i].id < 0 ? st != URIT_FAILURE : st != URIT_OK || id != (size_t) uris[i].id) {
+			success = false;
+			printf("Routing '%s' failed, should be route %d\n", uris[i].uri, uris[i].id);
+		} else if (st == URIT_OK) {
+			char *expanded = urit_expand(router->templates[id], &vars);
+
+			if (strcmp(expanded, uris[i].uri) != 0) {
+				success = false;
+				printf("Routing '%s' extracted variables expanding to %s\n", uris[i].uri, expanded);
+			}
+			free(expanded);
+		}
+	}
+	if (urit_insertliteral(router->root, "/orgs/", 6)->exprcount != 1) {
+		success = false;
+		puts("Differently named expressions of the same shape did not share an edge");
+	}
+	urit_freerouter(router);
+	return success;
+}
+
+bool
+test_cache(void)
+{
+	bool success = true;
+	UritVars vars = urit_newvars();
+	UritCacheStats stats;
+
+	urit_setcache(8);
+	if (!test_add_strings() || !test_add_maps()) {
+		success = false;
+		puts("Expanding through the cache failed");
+	}
+	stats = urit_cachestats();
+	if (stats.count != 8 || stats.misses == 0 || stats.evictions != stats.misses - 8) {
+		success = false;
+		printf("Cache holds %zu templates after %zu misses and %zu evictions\n", stats.count, stats.misses, stats.evictions);
+	}
+
+	urit_addstringvar(&vars, "var", "value");
+	for (int i = 0; i < 3; i++) {
+		UritResult res = urit_parsetemplate("{var}/{}", vars);
+
+		if (res.status != URIT_FAILURE || res.error == NULL || strcmp(res.uri, "value/{}") != 0) {
+			success = false;
+			puts("Errors of a cached template were lost");
+		}
+		urit_freeresult(&res);
+	}
+	if (urit_cachestats().hits != stats.hits + 2) {
+		success = false;
+		puts("Repeated template missed the cache");
+	}
+
+	urit_setcache(0);
+	if (urit_cachestats().count != 0) {
+		success = false;
+		puts("Turning the cache off left templates in it");
+	}
+	return success;
+}
+
+void *
+test_alloc(size_t size, void *ctx)
+{
+	((size_t *) ctx)[0]++;
+	return malloc(size);
+}
+
+void *
+test_realloc(void *ptr, size_t size, void *ctx)
+{
+	((size_t *) ctx)[1]++;
+	return realloc(ptr, size);
+}
+
+void
+test_free(void *ptr, void *ctx)
+{
+	((size_t *) ctx)[2]++;
+	free(ptr);
+}
+
+bool
+test_allocator(void)
+{
+	size_t calls[3] = {0, 0, 0};
+	UritAllocCount counts[URIT_ALLOC_SITES];
+	bool success = true;
+	bool arena = false;
+
+	urit_setallocator(test_alloc, test_realloc, test_free, calls);
+	UritVars vars = urit_newvars();
+	urit_addvariable(&vars, "list", "(\"red\",\"green\",\"blue\")");
+	UritTemplate *tpl = urit_compile("/colors{/list*}", NULL);
+	char *uri = urit_expand(tpl, &vars);
+	urit_free(uri);
+	urit_freetemplate(tpl);
+	if (calls[0] == 0 || calls[2] == 0) {
+		success = false;
+		puts("The library bypassed the allocator");
+	}
+	urit_setallocator(NULL, NULL, NULL, NULL);
+
+	urit_countallocations(true);
+	UritResult res = urit_parsetemplate("/colors{/list*}", vars);
+	urit_freeresult(&res);
+	size_t sites = urit_allocationcounts(counts, URIT_ALLOC_SITES);
+	urit_countallocations(false);
+
+	for (size_t i = 0; i < sites; i++) {
+		if (strcmp(counts[i].function, "urit_newblock") == 0 && counts[i].calls == 1 && counts[i].bytes > URIT_BLOCK_SIZE) {
+			arena = true;
+		}
+	}
+	if (sites != 2 || !arena) {
+		success = false;
+		printf("Counted allocations in %zu functions\n", sites);
+	}
+	return success;
+}
+
+bool
+test_slots(void)
+{
+	enum { SLOT_ID, SLOT_LIST, SLOT_KEYS, SLOT_PAGE, SLOT_COUNT };
+	const char *schema[SLOT_COUNT] = {"id", "list", "keys", "page"};
+	char *var_list[3] = {"red", "green", "blue"};
+	char *var_keys[3][2] = {{"semi", ";"}, {"dot", "."}, {"comma", ","}};
+	char *tpl = "/items/{id}{/list*}{?keys*,page}";
+	bool success = true;
+	UritTemplate *t = urit_compile(tpl, NULL);
+	UritSlots *slots = urit_newslots(SLOT_COUNT);
+	UritVars vars = urit_newvars();
+	UritList *list = urit_newlist();
+	UritMap *map = urit_newmap();
+	char expected[100];
+
+	for (int i = 0; i < 3; i++) {
+		urit_listadditem(var_list[i], list);
+		urit_mapaddkeyval(var_keys[i][0], var_keys[i][1], map);
+	}
+	if (urit_bindtemplate(t, schema, SLOT_COUNT) != URIT_OK || urit_bindtemplate(t, schema, 2) != URIT_FAILURE) {
+		success = false;
+		puts("Binding a template to a schema failed");
+	}
+	urit_bindtemplate(t, schema, SLOT_COUNT);
+
+	for (int round = 0; round < 2; round++) {
+		urit_clearslots(slots);
+		vars = urit_newvars();
+		urit_setslotstring(slots, SLOT_ID, round ? "7" : "42");
+		urit_addstringvar(&vars, "id", round ? "7" : "42");
+		if (!round) {
+			urit_setslotlist(slots, SLOT_LIST, list);
+			urit_varsaddlist(&vars, "list", list);
+			urit_setslotmap(slots, SLOT_KEYS, map);
+			urit_varsaddmap(&vars, "keys", map);
+		} else {
+			urit_setslotstring(slots, SLOT_PAGE, "2");
+			urit_addstringvar(&vars, "page", "2");
+		}
+		urit_expandto(expected, sizeof(expected), tpl, &vars, NULL);
+
+		char *uri = urit_expandslots(t, slots);
+		if (strcmp(uri, expected) != 0) {
+			success = false;
+			printf("Expanding slots gave %s, should be %s\n", uri, expected);
+		}
+		free(uri);
+	}
+	urit_freeslots(slots);
+	urit_freetemplate(t);
+	return success;
+}
+
+bool
+test_borrow(void)
+{
+	const char *request = "GET /u/mark?x=1 HTTP/1.1";
+	const char *items[3] = {"red", "green", "blue"};
+	size_t lens[3] = {3, 5, 4};
+	UritPair pairs[2] = {{"x", "1", 1, 1}, {"y", "2;", 1, 2}};
+	size_t calls[3] = {0, 0, 0};
+	bool success = true;
+	UritTemplate *tpl = urit_compile("/~{user}{/list*}{?keys*}", NULL);
+	UritVars vars = urit_newvars();
+	char *uri;
+
+	urit_borrowstringvar(&vars, "user", request + 7, 4);
+	urit_borrowlistvar(&vars, "list", 3, items, lens);
+	urit_borrowmapvar(&vars, "keys", 2, pairs);
+	uri = urit_expand(tpl, &vars);
+	if (strcmp(uri, "/~mark/red/green/blue?x=1&y=2%3B") != 0) {
+		success = false;
+		printf("Expanding borrowed values gave %s\n", uri);
+	}
+	free(uri);
+
+	urit_setallocator(test_alloc, test_realloc, test_free, calls);
+	urit_borrowstringvar(&vars, "user", request + 7, 2);
+	urit_setallocator(NULL, NULL, NULL, NULL);
+	if (calls[0] != 0) {
+		success = false;
+		printf("Borrowing into an existing variable made %zu allocations\n", calls[0]);
+	}
+	urit_addstringvar(&vars, "list", "owned");
+	urit_addvariable(&vars, "many", "(\"a\",\"b\",\"c\",\"d\",\"e\")");
+	uri = urit_expand(tpl, &vars);
+	if (strcmp(uri, "/~ma/owned?x=1&y=2%3B") != 0) {
+		success = false;
+		printf("Replacing borrowed values gave %s\n", uri);
+	}
+	free(uri);
+	if (urit_getvar(&vars, "many", 4)->val_list->lens[4] != 1 || urit_getvar(&vars, "many", 4)->val_list->poollen != 10) {
+		success = false;
+		puts("A list literal lost its lengths");
+	}
+	urit_freevars(&vars);
+	if (vars.count != 0 || strcmp(items[2], "blue") != 0 || strcmp(pairs[1].val, "2;") != 0) {
+		success = false;
+		puts("Freeing variables touched borrowed values");
+	}
+	urit_freetemplate(tpl);
+	return success;
+}
+
+bool
+test_literals(void)
+{
+	char literals[][2][100] = {
+		{"( \"a\" , \"b\\\"c\" ,\"\\\\\")", "{/list*}=/a/b%22c/%5C"},
+		{"(\"a long item past sixteen bytes\")", "{list}=a%20long%20item%20past%20sixteen%20bytes"},
+		{"[ (\"k\", \"v\"),(\"\\\"q\", \"\")]", "{?map*}=?k=v&%22q="},
+		{"[]", "{?map*}="},
+	};
+	char malformed[][100] = {
+		"()", "(\"a\"", "(\"a\",)", "(\"a\" \"b\")", "(\"a)", "(\"a\\\")", "(\"a\")x",
+		"[(\"k\")]", "[(\"k\",\"v\"),]", "[(\"k\",\"v\")", "[()]", "[(\"k\",\"v\" \"w\")]",
+	};
+	bool success = true;
+	char uri[100];
+
+	for (int i = 0; i < sizeof(literals) / sizeof(literals[0]); i++) {
+		UritVars vars = urit_newvars();
+		char *eq = strchr(literals[i][1], '=');
+
+		*eq = '\0';
+		urit_addvariable(&vars, literals[i][0][0] == '(' ? "list" : "map", literals[i][0]);
+		urit_expandto(uri, sizeof(uri), literals[i][1], &vars, NULL);
+		if (strcmp(uri, eq + 1) != 0) {
+			success = false;
+			printf("Loading %s gave %s, should be %s\n", literals[i][0], uri, eq + 1);
+		}
+		urit_freevars(&vars);
+	}
+	for (int i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+		UritVars vars = urit_newvars();
+		UritStatus st = urit_addvariable(&vars, "v", malformed[i]);
+
+		if (st != (malformed[i][0] == '(' ? URIT_MALFORMED_LIST : URIT_MALFORMED_MAP) || vars.count != 0) {
+			success = false;
+			printf("%s should be malformed\n", malformed[i]);
+		}
+		urit_freevars(&vars);
+	}
+	return success;
+}
+
+bool
+test_json(void)
+{
+	const char *json =
+		"{ \"var\": \"value\", \"hello\" : \"Hello World!\",\n"
+		"  \"list\": [\"red\", \"gr\\\"een\", null, \"blue\"],\n"
+		"  \"keys\": {\"semi\": \";\", \"dot\": \".\", \"none\": null, \"comma\": \",\"},\n"
+		"  \"n\": -1.5e3, \"t\": true, \"undef\": null, \"empty\": [], \"nomap\": {},\n"
+		"  \"caf\\u00e9\": \"\\u00e9\\ud83d\\ude00\\/\\n\" }";
+	char templates[][2][100] = {
+		{"{var}/{hello}", "value/Hello%20World%21"},
+		{"{/list*}", "/red/gr%22een/blue"},
+		{"{?keys*}", "?semi=%3B&dot=.&comma=%2C"},
+		{"{n}{&t}", "-1.5e3&t=true"},
+		{"x{undef}{empty}{nomap}", "x"},
+		{"{caf%C3%A9}", ""},
+	};
+	char malformed[][50] = {
+		"", "[]", "{", "{\"a\"}", "{\"a\":}", "{\"a\":\"b\",}", "{\"a\":\"b\"} x", "{\"a\":\"b}",
+		"{\"a\":[\"b\",[\"c\"]]}", "{\"a\":{\"b\":{}}}", "{\"a\":tru}", "{\"a\":\"\\x\"}", "{\"a\":\"\\ud83d\"}",
+	};
+	bool success = true;
+	UritVars vars = urit_newvars();
+	char uri[100];
+
+	if (urit_varsfromjson(json, strlen(json), &vars) != URIT_OK) {
+		success = false;
+		puts("Reading a JSON document failed");
+	}
+	for (int i = 0; i < sizeof(templates) / sizeof(templates[0]); i++) {
+		urit_expandto(uri, sizeof(uri), templates[i][0], &vars, NULL);
+		if (strcmp(uri, templates[i][1]) != 0) {
+			success = false;
+			printf("Expanding %s from JSON gave %s, should be %s\n", templates[i][0], uri, templates[i][1]);
+		}
+	}
+	UritVar *var = urit_getvar(&vars, "caf\xC3\xA9", 5);
+	if (!var || !urit_getvar(&vars, "var", 3)->borrowed || var->len != 8 || memcmp(var->val_string, "\xC3\xA9\xF0\x9F\x98\x80/\n", 8) != 0) {
+		success = false;
+		puts("JSON escapes were not decoded");
+	}
+	urit_freevars(&vars);
+	for (int i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+		vars = urit_newvars();
+		if (urit_varsfromjson(malformed[i], strlen(malformed[i]), &vars) != URIT_MALFORMED_JSON) {
+			success = false;
+			printf("%s should be malformed JSON\n", malformed[i]);
+		}
+		urit_freevars(&vars);
+	}
+	return success;
+}
+
+bool
+test_reexpand(void)
+{
+	char *pages[] = {"2", "10", "", "100 200", "1"};
+	char *cursor = "abc;def";
+	bool success = true;
+	UritTemplate *tpl = urit_compile("https://{host}/v1/{tenant}/orders{?status,page}{;page}/x{#cursor}", NULL);
+	UritVars vars = urit_newvars();
+
+	urit_addstringvar(&vars, "host", "api.example.com");
+	urit_addstringvar(&vars, "tenant", "acme");
+	urit_addstringvar(&vars, "status", "open");
+	UritExpansion *exp = urit_newexpansion(tpl, &vars);
+
+	for (int i = 0; i < sizeof(pages) / sizeof(pages[0]) + 1; i++) {
+		const char *uri;
+
+		if (i < sizeof(pages) / sizeof(pages[0])) {
+			urit_addstringvar(&vars, "page", pages[i]);
+			uri = urit_reexpand(exp, "page");
+		} else {
+			urit_borrowstringvar(&vars, "cursor", cursor, 3);
+			uri = urit_reexpand(exp, "cursor");
+		}
+		char *expected = urit_expand(tpl, &vars);
+
+		if (strcmp(uri, expected) != 0 || exp->uri->len != strlen(expected)) {
+			success = false;
+			printf("Re-expanding gave %s, should be %s\n", uri, expected);
+		}
+		free(expected);
+	}
+	if (strcmp(urit_reexpand(exp, "unused"), exp->uri->str) != 0) {
+		success = false;
+		puts("Re-expanding for an unused variable changed the URI");
+	}
+	urit_freeexpansion(exp);
+	urit_freevars(&vars);
+	urit_freetemplate(tpl);
+	return success;
+}
+
+bool
+test_partial(void)
+{
+	char templates[][100] = {
+		"https://{host}/{apiVersion}/{tenant}/users/{id}",
+		"{+host}{/apiVersion,tenant}/a%20b{?id,fields}",
+		"/{tenant}{?tenant,id}{&keys*}{#frag}",
+		"{;list*}/{id}/{+pct}{?keys}",
+		"{/tenant,id:2}{.host,list,id}{?apiVersion,id,tenant}",
+		"{tenant,id}{#host,id}",
+	};
+	size_t parts[] = {2, 2, 4, 3, 6, 2};
+	bool mixed[] = {false, false, false, false, true, true};
+	char *list[2] = {"x y", "z"};
+	char *keys[2][2] = {{"k", "v w"}, {"semi", ";"}};
+	bool success = true;
+	UritVars constants = urit_newvars();
+	UritVars request = urit_newvars();
+	UritVars all = urit_newvars();
+
+	for (int v = 0; v < 2; v++) {
+		UritVars *vars = v ? &all : &constants;
+
+		urit_addstringvar(vars, "host", "api.example.com");
+		urit_addstringvar(vars, "apiVersion", "v1");
+		urit_addstringvar(vars, "tenant", "acme corp");
+		urit_addstringvar(vars, "pct", "50%/{x}");
+		urit_addlistvar(vars, "list", 2, list);
+		urit_addmapvar(vars, "keys", 2, keys);
+	}
+	for (int v = 0; v < 2; v++) {
+		UritVars *vars = v ? &all : &request;
+
+		urit_addstringvar(vars, "id", "42");
+		urit_addstringvar(vars, "fields", "name,email");
+	}
+	for (int i = 0; i < sizeof(templates) / sizeof(templates[0]); i++) {
+		UritTemplate *tpl = urit_compile(templates[i], NULL);
+		UritTemplate *partial = urit_partial(tpl, &constants);
+		char *expected = urit_expand(tpl, &all);
+		char *uri = urit_expand(partial, mixed[i] ? &all : &request);
+
+		if (strcmp(uri, expected) != 0 || partial->count != parts[i]) {
+			success = false;
+			printf("Specializing %s gave %s in %zu parts, should be %s\n", templates[i], uri, partial->count, expected);
+		}
+		free(expected);
+		free(uri);
+		urit_freetemplate(partial);
+		urit_freetemplate(tpl);
+	}
+	urit_freevars(&constants);
+	urit_freevars(&request);
+	urit_freevars(&all);
+	return success;
+}
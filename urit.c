@@ -1,15 +1,69 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "uritlib.h"
 #include "uritlib.c"
 
+#define BATCH_CHUNK		(1 << 20)
+#define BATCH_THREADS	64
+#define SERVE_BUFFER	(64 * 1024)
+#define SERVE_CACHE		1024
+
+typedef struct {
+	const char *start;
+	const char *end;
+	UritString *out;
+	size_t lines;
+	size_t errors;
+	bool done;
+} BatchChunk;
+
+typedef struct {
+	const UritTemplate *tpl;
+	const char *next;
+	const char *end;
+	size_t claimed;
+	size_t written;
+	size_t slotcount;
+	BatchChunk *slots;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_cond_t freed;
+} BatchQueue;
+
+void printusageandexit(void);
+int runbatch(const char *path, const char *tpl, size_t threads);
+void *batchworker(void *arg);
+BatchChunk *batchclaim(BatchQueue *q);
+void batchexpand(const UritTemplate *tpl, BatchChunk *c);
+int runserver(const char *path);
+void *serveconnection(void *arg);
+bool serve(int in, int out);
+void serverequest(char *line, size_t len, UritString *resp, UritContext *ctx);
+const char *errormessage(UritCode code);
+int emitc(const char *name, const char *tpl, const UritVars *types);
+bool writeall(int fd, const char *buf, size_t len);
+double now(void);
+
 void
 printusageandexit(void)
 {
 	puts("Usage: urit http://example.com/{foo}/ --foo=\"bar\"");
+	puts("       urit --batch vars.ndjson http://example.com/{foo}/ [--threads=N]");
+	puts("       urit --serve[=/path/to/socket]");
+	puts("       urit --emit-c NAME http://example.com/{foo}/ [--foo=(\"list\")]");
 	exit(EXIT_FAILURE);
 }
 
@@ -22,14 +76,33 @@ main(int argc, char **argv)
 {
 	char *varname = NULL;
 	char *varvalue = NULL;
+	bool emit = argc >= 4 && strcmp(argv[1], "--emit-c") == 0;
 
 	UritVars vars = urit_newvars();
 
+	if (argc >= 2 && strcmp(argv[1], "--batch") == 0) {
+		long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+		if (argc < 4 || argc > 5) {
+			printusageandexit();
+		}
+		if (argc == 5 && (strncmp(argv[4], "--threads=", 10) != 0 || (threads = atol(argv[4] + 10)) < 1)) {
+			printusageandexit();
+		}
+		return runbatch(argv[2], argv[3], threads < 1 ? 1 : threads > BATCH_THREADS ? BATCH_THREADS : threads);
+	}
+	if (argc == 2 && strcmp(argv[1], "--serve") == 0) {
+		urit_setcache(SERVE_CACHE);
+		return serve(STDIN_FILENO, STDOUT_FILENO) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	if (argc == 2 && strncmp(argv[1], "--serve=", 8) == 0 && argv[1][8]) {
+		return runserver(argv[1] + 8);
+	}
 	if (argc < 3) {
 		printusageandexit();
 	}
 
-	for (int i = 2; i < argc; i++) {
+	for (int i = emit ? 4 : 2; i < argc; i++) {
 		varname = argv[i];
 
 		if (strncmp("--", varname, 2) != 0) {
@@ -71,6 +144,9 @@ main(int argc, char **argv)
 		}
 	}
 
+	if (emit) {
+		return emitc(argv[2], argv[3], &vars);
+	}
 	urit_printvars(vars);
 
 	UritResult res = urit_parsetemplate(argv[1], vars);
@@ -81,6 +157,424 @@ main(int argc, char **argv)
 	if (res.uri) {
 		puts(res.uri);
 	}
+	urit_freeresult(&res);
 
 	return EXIT_SUCCESS;
 }
+
+/**
+ * Expands tpl once for every line of the NDJSON file at path, each line
+ * being a JSON object of variables, and writes one URI per line to stdout.
+ * The mapped file is cut into chunks ending on line boundaries, which a pool
+ * of threads claims one at a time from a shared counter and expands into a
+ * ring of buffers. The calling thread writes the finished chunks out in
+ * order so the output lines up with the input, and a thread only waits when
+ * it gets a whole ring ahead of the writer.
+ */
+int
+runbatch(const char *path, const char *tpl, size_t threads)
+{
+	pthread_t ids[BATCH_THREADS];
+	BatchChunk slots[BATCH_THREADS * 2];
+	BatchQueue q;
+	UritResult errors;
+	struct stat st;
+	size_t started = 0;
+	size_t lines = 0;
+	size_t malformed = 0;
+	size_t written = 0;
+	bool failed = false;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "urit: cannot read %s\n", path);
+		return EXIT_FAILURE;
+	}
+	UritTemplate *t = urit_compile(tpl, &errors);
+
+	if (errors.status != URIT_OK) {
+		urit_printerrors(&errors);
+		urit_freeresult(&errors);
+		return EXIT_FAILURE;
+	}
+	const char *data = NULL;
+
+	if (st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			fprintf(stderr, "urit: cannot map %s\n", path);
+			return EXIT_FAILURE;
+		}
+		posix_madvise((void *) data, st.st_size, POSIX_MADV_SEQUENTIAL);
+	}
+	double start = now();
+	double reported = start;
+
+	q.tpl = t;
+	q.next = data;
+	q.end = data + st.st_size;
+	q.claimed = 0;
+	q.written = 0;
+	q.slotcount = threads * 2;
+	q.slots = slots;
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.ready, NULL);
+	pthread_cond_init(&q.freed, NULL);
+	for (size_t i = 0; i < q.slotcount; i++) {
+		slots[i].out = urit_newstring();
+		urit_reservestring(slots[i].out, BATCH_CHUNK);
+	}
+	for (size_t i = 0; i < threads; i++) {
+		if (pthread_create(&ids[started], NULL, batchworker, &q) == 0) {
+			started++;
+		}
+	}
+
+	pthread_mutex_lock(&q.lock);
+	while (q.written < q.claimed || q.next < q.end) {
+		BatchChunk *c = &slots[q.written % q.slotcount];
+
+		if (q.written < q.claimed && c->done) {
+			pthread_mutex_unlock(&q.lock);
+			failed = failed || !writeall(STDOUT_FILENO, c->out->str, c->out->len);
+			lines += c->lines;
+			malformed += c->errors;
+			written += c->out->len;
+			if (now() - reported >= 1.0) {
+				reported = now();
+				fprintf(stderr, "urit: %zu lines, %.1f%%, %.1f MB/s\n", lines,
+					100.0 * (c->end - data) / st.st_size, (c->end - data) / (reported - start) / 1e6);
+			}
+			pthread_mutex_lock(&q.lock);
+			q.written++;
+			if (failed) {
+				q.next = q.end;
+			}
+			pthread_cond_broadcast(&q.freed);
+		} else if (!started && (c = batchclaim(&q))) {
+			/* no thread could be started, so chunks are expanded here */
+			pthread_mutex_unlock(&q.lock);
+			batchexpand(t, c);
+			pthread_mutex_lock(&q.lock);
+			c->done = true;
+		} else {
+			pthread_cond_wait(&q.ready, &q.lock);
+		}
+	}
+	pthread_mutex_unlock(&q.lock);
+	for (size_t i = 0; i < started; i++) {
+		pthread_join(ids[i], NULL);
+	}
+	double elapsed = now() - start;
+
+	if (failed) {
+		fprintf(stderr, "urit: write failed\n");
+	} else {
+		fprintf(stderr, "urit: %zu lines (%zu malformed) in %.3f s, %.0f lines/s, %.1f MB/s in, %.1f MB/s out, %zu threads\n",
+			lines, malformed, elapsed, lines / elapsed, st.st_size / elapsed / 1e6, written / elapsed / 1e6, threads);
+	}
+	for (size_t i = 0; i < q.slotcount; i++) {
+		urit_freestring(slots[i].out);
+	}
+	pthread_cond_destroy(&q.freed);
+	pthread_cond_destroy(&q.ready);
+	pthread_mutex_destroy(&q.lock);
+	if (data) {
+		munmap((void *) data, st.st_size);
+	}
+	close(fd);
+	urit_freetemplate(t);
+	return failed || malformed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Keeps claiming chunks of the queue and expanding them until the input
+ * runs out
+ */
+void *
+batchworker(void *arg)
+{
+	BatchQueue *q = arg;
+	BatchChunk *c;
+
+	pthread_mutex_lock(&q->lock);
+	while ((c = batchclaim(q))) {
+		pthread_mutex_unlock(&q->lock);
+		batchexpand(q->tpl, c);
+		pthread_mutex_lock(&q->lock);
+		c->done = true;
+		pthread_cond_signal(&q->ready);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return NULL;
+}
+
+/**
+ * Cuts the next chunk of the input into a free slot of the ring, waiting
+ * for the writer to free one if needed. Called with the lock held. Returns
+ * NULL once the input is used up.
+ */
+BatchChunk *
+batchclaim(BatchQueue *q)
+{
+	while (q->next < q->end && q->claimed - q->written >= q->slotcount) {
+		pthread_cond_wait(&q->freed, &q->lock);
+	}
+	if (q->next >= q->end) {
+		return NULL;
+	}
+	BatchChunk *c = &q->slots[q->claimed++ % q->slotcount];
+	const char *stop = q->end - q->next > BATCH_CHUNK ? q->next + BATCH_CHUNK : q->end;
+	const char *nl = stop < q->end ? memchr(stop, '\n', q->end - stop) : NULL;
+
+	c->start = q->next;
+	c->end = nl ? nl + 1 : q->end;
+	c->done = false;
+	q->next = c->end;
+	return c;
+}
+
+/**
+ * Expands every line of a chunk into its buffer. A malformed line gives an
+ * empty line so the output still lines up with the input, and blank lines
+ * are skipped.
+ */
+void
+batchexpand(const UritTemplate *tpl, BatchChunk *c)
+{
+	const char *line = c->start;
+
+	c->lines = 0;
+	c->errors = 0;
+	urit_resetstring(c->out);
+	while (line < c->end) {
+		const char *nl = memchr(line, '\n', c->end - line);
+		const char *stop = nl ? nl : c->end;
+		size_t len = stop - line;
+
+		if (len && line[len - 1] == '\r') {
+			len--;
+		}
+		size_t blank = 0;
+
+		while (blank < len && (line[blank] == ' ' || line[blank] == '\t')) {
+			blank++;
+		}
+		if (blank < len) {
+			UritVars vars = urit_newvars();
+
+			if (urit_varsfromjson(line, len, &vars) == URIT_OK) {
+				urit_expandinto(c->out, tpl, &vars);
+			} else {
+				c->errors++;
+			}
+			urit_appendchar(c->out, '\n');
+			urit_freevars(&vars);
+			c->lines++;
+		}
+		line = stop + 1;
+	}
+}
+
+/**
+ * Listens on a Unix domain socket at path and serves every connection on
+ * its own thread. The template cache is shared by all of them.
+ */
+int
+runserver(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd < 0 || strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "urit: cannot listen on %s\n", path);
+		return EXIT_FAILURE;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+		fprintf(stderr, "urit: cannot listen on %s\n", path);
+		return EXIT_FAILURE;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	urit_setcache(SERVE_CACHE);
+	fprintf(stderr, "urit: serving on %s\n", path);
+
+	for (;;) {
+		int conn = accept(fd, NULL, NULL);
+		pthread_t id;
+
+		if (conn < 0) {
+			continue;
+		}
+		if (pthread_create(&id, NULL, serveconnection, (void *) (intptr_t) conn) != 0) {
+			close(conn);
+			continue;
+		}
+		pthread_detach(id);
+	}
+	return EXIT_SUCCESS;
+}
+
+void *
+serveconnection(void *arg)
+{
+	int fd = (int) (intptr_t) arg;
+
+	serve(fd, fd);
+	close(fd);
+	return NULL;
+}
+
+/**
+ * Answers requests read from in until it is closed. A request is a template
+ * and a JSON object of variables separated by a tab on one line, the
+ * variables being optional. Each gets one line back, "+" and the URI or "-"
+ * and an error. Every request already read is answered before the responses
+ * are written out together, so a client can pipeline requests without
+ * waiting for each response.
+ */
+bool
+serve(int in, int out)
+{
+	size_t size = SERVE_BUFFER;
+	size_t len = 0;
+	char *buf = malloc(size);
+	UritString *resp = urit_newstring();
+	UritContext *ctx = urit_newcontext();
+	bool ok = true;
+	ssize_t n;
+
+	urit_reservestring(resp, SERVE_BUFFER);
+	while ((n = read(in, buf + len, size - len)) > 0) {
+		char *line = buf;
+		char *nl;
+
+		len += n;
+		while ((nl = memchr(line, '\n', buf + len - line))) {
+			serverequest(line, nl - line, resp, ctx);
+			line = nl + 1;
+		}
+		len = buf + len - line;
+		memmove(buf, line, len);
+		if (len == size) {
+			size *= 2;
+			buf = realloc(buf, size);
+		}
+		if (!writeall(out, resp->str, resp->len)) {
+			ok = false;
+			break;
+		}
+		urit_resetstring(resp);
+	}
+	if (ok && n == 0 && len) {
+		serverequest(buf, len, resp, ctx);
+		ok = writeall(out, resp->str, resp->len);
+	}
+	free(buf);
+	urit_freestring(resp);
+	urit_freecontext(ctx);
+	return ok;
+}
+
+void
+serverequest(char *line, size_t len, UritString *resp, UritContext *ctx)
+{
+	UritVars vars = urit_newvars();
+	char *tab = memchr(line, '\t', len);
+
+	if (len && line[len - 1] == '\r') {
+		len--;
+	}
+	line[len] = '\0';
+	if (tab) {
+		*tab++ = '\0';
+	}
+	if (tab && urit_varsfromjson(tab, line + len - tab, &vars) != URIT_OK) {
+		urit_appendbytes(resp, "-Malformed JSON\n", 16);
+	} else {
+		UritResult res = urit_parsetemplatein(ctx, line, vars);
+
+		if (res.status != URIT_OK) {
+			const char *msg = errormessage(res.error->code);
+
+			urit_appendchar(resp, '-');
+			urit_appendbytes(resp, msg, strlen(msg));
+		} else {
+			urit_appendchar(resp, '+');
+			urit_appendbytes(resp, res.uri, res.uriref->len);
+		}
+		urit_appendchar(resp, '\n');
+		urit_resetcontext(ctx);
+	}
+	urit_freevars(&vars);
+}
+
+const char *
+errormessage(UritCode code)
+{
+	switch (code) {
+		case URIT_MALFORMED_EXPRESSION:		return "Malformed expression";
+		case URIT_EMPTY_EXPRESSION:			return "Empty expression";
+		case URIT_UNIMPLEMENTED_OPERATOR:	return "Unimplemented operator";
+		case URIT_NONLITERAL_FOUND:			return "Non-literal character found";
+		case URIT_INVALID_VARNAME:			return "Invalid variable name";
+	}
+	return "Unknown error";
+}
+
+/**
+ * Prints a C function called name that expands tpl, taking the type of
+ * each variable from types
+ */
+int
+emitc(const char *name, const char *tpl, const UritVars *types)
+{
+	UritResult errors;
+	UritTemplate *t = urit_compile(tpl, &errors);
+	UritString *out = urit_newstring();
+	int status = EXIT_SUCCESS;
+
+	if (errors.status != URIT_OK || t == NULL) {
+		urit_printerrors(&errors);
+		status = EXIT_FAILURE;
+	} else if (urit_emitc(out, t, name, types) != URIT_OK) {
+		fprintf(stderr, "urit: %s is not a C identifier\n", name);
+		status = EXIT_FAILURE;
+	} else {
+		printf("#include \"uritrt.h\"\n\n%s", out->str);
+	}
+	urit_freeresult(&errors);
+	urit_freestring(out);
+	urit_freetemplate(t);
+	return status;
+}
+
+/**
+ * Writes all len bytes of buf to fd, retrying short writes
+ */
+bool
+writeall(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = write(fd, buf, len);
+
+		if (n < 0) {
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
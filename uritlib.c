@@ -1,60 +1,337 @@
 #include <stdint.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include "uritlib.h"
+#include "uritrt.c"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define URIT_BLOCKHEADER	((sizeof(UritBlock) + URIT_ALIGN - 1) & ~((size_t) URIT_ALIGN - 1))
+
+#define URIT_MIN_STRING			32
+
+#define URIT_MALLOC(size)		urit_allocate(NULL, (size), __func__)
+#define URIT_CALLOC(n, size)	urit_zeroalloc((n) * (size), __func__)
+#define URIT_REALLOC(ptr, size)	urit_allocate((ptr), (size), __func__)
+
+#if defined(__GNUC__) && !defined(URIT_NO_COMPUTED_GOTO)
+#define URIT_COMPUTED_GOTO
+#define URIT_TARGET(op)			op
+#define URIT_DISPATCH(op)		goto *urit_labels[op]
+#else
+#define URIT_TARGET(op)			case op
+#define URIT_DISPATCH(op)		do { opcode = (op); goto dispatch; } while (0)
+#endif
+
+static void *urit_stdalloc(size_t size, void *ctx);
+static void *urit_stdrealloc(void *ptr, size_t size, void *ctx);
+static void urit_stdfree(void *ptr, void *ctx);
+static void *urit_allocate(void *ptr, size_t size, const char *site);
+static void *urit_zeroalloc(size_t size, const char *site);
+static void urit_countallocation(const char *site, size_t size);
 static void urit_addvar(UritVars *vars, UritVar *var);
+static UritVar *urit_setvar(UritVars *vars, const char *name, size_t len, UritValueType type);
+static void urit_freevalue(UritVar *var);
+static void urit_growlist(UritList *list, size_t items, size_t bytes);
+static char *urit_listpush(UritList *list, size_t len);
+static void urit_growmap(UritMap *map, size_t pairs, size_t bytes);
+static size_t urit_mappush(UritMap *map, size_t keylen, size_t vallen);
+static void urit_growpool(char **pool, size_t *size, size_t min);
+static void urit_expandrows(const UritTemplate *tpl, const UritVars *sets, size_t first, size_t last, char sep, UritString *des, size_t *offsets);
+static void *urit_batchworker(void *arg);
+static void urit_expandparallel(UritBatch *batch, const UritTemplate *tpl, const UritVars *sets, size_t count, char sep, size_t threads);
+static void urit_growtable(UritVars *vars);
+static void urit_indexvar(UritVars *vars, UritVar *var);
+static size_t urit_hash(const char *name, size_t len);
 static void urit_adderror(UritResult *res, size_t pos, UritCode code);
-static bool urit_isreserved(const char c);
-static bool urit_isunreserved(const char c);
-static size_t urit_numbytes(unsigned char c);
-static unsigned urit_getcodepoint(const char *str);
-static bool urit_isucschar(const char *str);
-static bool urit_isiprivate(const char *str);
-static bool urit_ispct(const char *str);
-static bool urit_isliteral(const char *str);
+static UritBlock *urit_newblock(size_t size);
+static void *urit_arenaalloc(UritContext *ctx, size_t size);
+static void *urit_arenarealloc(UritContext *ctx, void *ptr, size_t oldsize, size_t size);
+static UritString *urit_newstringin(UritContext *ctx);
 static bool urit_isvarchar(const char *str);
-static char *urit_pctencodechar(const unsigned char c);
 static UritList *urit_compilelistvar(char *varvalue);
 static UritMap *urit_compilemapvar(char *varvalue);
-static UritString *urit_appendstring(UritString *des, char *src);
+static bool urit_skipto(const char **str, const char *end, char c);
+static const char *urit_scanquoted(const char *str, const char *end, char *dst, size_t *len);
+static size_t urit_countquotes(const char *str, const char *end);
+static const char *urit_findquote(const char *str, const char *end);
+static const char *urit_jsonspace(const char *str, const char *end);
+static const char *urit_jsonstring(const char *str, const char *end, const char **raw, size_t *len, bool *escaped);
+static const char *urit_jsonscalar(const char *str, const char *end, const char **raw, size_t *len, bool *escaped);
+static bool urit_jsonunescape(char *dst, const char *raw, size_t len, size_t *declen);
+static const char *urit_jsonvalue(UritVars *out, const char *name, size_t namelen, const char *str, const char *end);
+static const char *urit_jsonlist(UritList *list, const char *str, const char *end);
+static const char *urit_jsonmap(UritMap *map, const char *str, const char *end);
+static char *urit_jsoncopy(char *dst, const char *raw, size_t len, bool escaped, size_t *declen);
+static UritString *urit_appendbytes(UritString *des, const char *src, size_t len);
 static UritString *urit_appendchar(UritString *des, char src);
-static char *urit_encode(char *str, bool allowreserved, size_t max);
+static void urit_growstring(UritString *des, size_t size);
+static UritString *urit_appendtruncated(UritString *des, const char *src, size_t len);
+static UritString *urit_appendpct(UritString *des, const unsigned char c);
+static void urit_encode(UritString *des, const char *str, size_t len, bool allowreserved, size_t max);
 static UritOpRule urit_getoprule(char c);
-static UritVar *urit_getvar(UritVars *vars, char *name);
-static void urit_processexpression(char *expr, UritOpRule oprule, UritVars vars, UritResult *res, size_t pos);
+static UritVar *urit_getvar(const UritVars *vars, const char *name, size_t len);
+static UritVar *urit_findvar(const UritVars *vars, const char *name, size_t len, size_t hash);
+static bool urit_isfatal(UritCode code);
+static UritCode urit_scanliteral(const char *tpl, size_t tpllen, size_t *i, size_t *j, UritString *lit, const char **expr, size_t *exprlen, size_t *pos);
+static UritCode urit_nextvarspec(const char **expr, const char *end, UritVarSpec *spec, size_t *pos);
+static UritPart *urit_addpart(UritTemplate *tpl, UritPartType type, size_t pos);
+static void urit_flushliteral(UritTemplate *tpl, UritString *lit, size_t pos);
+static void urit_expandtemplate(const UritTemplate *tpl, const UritVars *vars, UritString *des);
+static void urit_expandpart(const UritPart *part, const UritVars *vars, UritString *des);
+static void urit_assemble(UritTemplate *tpl);
+static void urit_run(const struct UritInstr *ip, const UritVars *vars, UritString *des);
+static size_t urit_emitparams(const UritTemplate *tpl, const UritVarSpec **params);
+static size_t urit_findparam(const UritVarSpec **params, size_t count, const UritVarSpec *spec);
+static bool urit_isident(const char *name, size_t len);
+static char *urit_emitident(const UritVarSpec **params, size_t count, size_t i);
+static void urit_emitvarspec(UritString *des, const UritOpRule *oprule, const UritVarSpec *spec, UritValueType type, const char *ident, size_t k, bool more);
+static bool urit_emittracks(const UritPart *part);
+static void urit_emitprefix(UritString *des, const UritOpRule *oprule, size_t k, const char *tail, size_t taillen, const char *indent);
+static void urit_emitput(UritString *des, const char *str, size_t len, const char *indent);
+static void urit_emitencode(UritString *des, const char *ident, const char *item, const char *len, const UritOpRule *oprule, size_t prefix, const char *indent);
+static void urit_appendformat(UritString *des, const char *fmt, ...);
+static void urit_appendcstring(UritString *des, const char *str, size_t len, char quote);
+static void urit_splice(UritExpansion *exp, size_t i, const char *str, size_t len);
+static bool urit_expandstream(const char *tpl, const UritVars *vars, UritString *des, UritResult *res, UritCode *first);
+static UritCode urit_expandbody(const char *expr, size_t len, size_t *pos, const UritVars *vars, UritString *des);
+static void urit_appendnamedvalue(UritString *des, const char *val, size_t len, const UritOpRule *oprule, size_t prefix);
+static void urit_expandvarspec(const UritOpRule *oprule, const UritVarSpec *spec, const UritVars *vars, UritString *des, bool *firstappend);
+static void urit_expandvar(const UritOpRule *oprule, const UritVarSpec *spec, const UritVar *var, UritString *des, bool *firstappend);
+static void urit_expandbound(const UritTemplate *tpl, const UritSlots *slots, UritString *des);
+static const char *urit_findliteral(const char *str, const char *end, const char *lit, size_t len);
+static const char *urit_matchrun(const UritOpRule *oprule, const char *str, const char *end);
+static const char *urit_matchextent(const UritPart *part, const UritPart *next, bool nextlast, const char *str, const char *end);
+static const char *urit_matchexpression(const UritPart *part, const char *str, const char *stop, UritVars *out);
+static size_t urit_findvarspec(const UritPart *part, const char *name, size_t len);
+static void urit_matchvalue(const UritVarSpec *spec, const char *val, const char *end, bool split, UritVars *out);
+static void urit_addmatchvar(UritVars *out, const UritVarSpec *spec, UritList *list, UritMap *map);
+static void urit_addmatchitem(UritList *list, const char *item, const char *end);
+static void urit_addmatchpair(UritMap *map, const char *item, const char *end);
+static char *urit_copybytes(const char *str, size_t len);
+static size_t urit_decode(char *dec, const char *str, size_t len);
+static UritRouteNode *urit_newroutenode(const UritPart *part);
+static size_t urit_findedge(const UritRouteNode *node, char c);
+static UritRouteNode *urit_insertliteral(UritRouteNode *node, const char *str, size_t len);
+static UritRouteNode *urit_insertexpression(UritRouteNode *node, const UritPart *part);
+static bool urit_samepart(const UritPart *a, const UritPart *b);
+static bool urit_routefrom(const UritRouteNode *node, const char *str, const char *end, size_t *id);
+static bool urit_routeexpression(const UritRouteNode *node, const char *str, const char *end, size_t *id);
+static void urit_freeroutenode(UritRouteNode *node);
+static struct UritCacheEntry *urit_cacheget(const char *tpl);
+static struct UritCacheEntry *urit_cachefind(const char *tpl, size_t hash);
+static void urit_cacherelease(struct UritCacheEntry *entry);
+static void urit_cacheinsert(struct UritCacheEntry *entry);
+static void urit_cacheevict(struct UritCacheEntry *entry);
+static void urit_freecacheentry(struct UritCacheEntry *entry);
+
+typedef struct {
+	pthread_t thread;
+	bool started;
+	const UritTemplate *tpl;
+	const UritVars *sets;
+	size_t first;
+	size_t last;
+	char sep;
+	size_t *offsets;
+	UritString *uris;
+} UritBatchWorker;
+
+typedef struct UritCacheEntry {
+	char *key;
+	size_t hash;
+	UritTemplate *tpl;
+	size_t refs;
+	bool evicted;
+	struct UritCacheEntry *chain;
+	struct UritCacheEntry *prev;
+	struct UritCacheEntry *next;
+} UritCacheEntry;
+
+/**
+ * Opcodes of the bytecode a compiled template is expanded with. Every
+ * varspec becomes one URIT_OP_VAR, which looks up its variable and goes on
+ * to the opcode for the type of value it finds.
+ */
+typedef enum {
+	URIT_OP_END,
+	URIT_OP_LITERAL,
+	URIT_OP_BEGIN,
+	URIT_OP_VAR,
+	URIT_OP_STRING,
+	URIT_OP_STRING_NAMED,
+	URIT_OP_LIST,
+	URIT_OP_LIST_NAMED,
+	URIT_OP_LIST_EXPLODED,
+	URIT_OP_LIST_EXPLODED_NAMED,
+	URIT_OP_MAP,
+	URIT_OP_MAP_NAMED,
+	URIT_OP_MAP_KV,
+	URIT_OP_MAP_KV_NAMED
+} UritOpcode;
+
+/**
+ * One instruction. str and len hold the text of a literal or the name of a
+ * variable, and handlers the opcode to go on with for each UritValueType.
+ */
+typedef struct UritInstr {
+	uint8_t opcode;
+	uint8_t handlers[3];
+	UritOpRule oprule;
+	size_t prefix;
+	size_t hash;
+	const char *str;
+	size_t len;
+} UritInstr;
+
+/**
+ * The template cache shared by urit_parsetemplate and urit_parsetemplatein.
+ * Entries are chained in buckets by hash and kept on a list from most to
+ * least recently used, all under lock.
+ */
+static struct {
+	pthread_mutex_t lock;
+	size_t mask;
+	UritCacheEntry **buckets;
+	UritCacheEntry *head;
+	UritCacheEntry *tail;
+	UritCacheStats stats;
+} urit_cache = {PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * Where the library gets its memory, along with the per-function counts kept
+ * while counting is on
+ */
+static struct {
+	UritAllocFn alloc;
+	UritReallocFn realloc;
+	UritFreeFn free;
+	void *ctx;
+	bool counting;
+	pthread_mutex_t lock;
+	size_t sites;
+	UritAllocCount counts[URIT_ALLOC_SITES];
+} urit_allocator = {urit_stdalloc, urit_stdrealloc, urit_stdfree, NULL, false, PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * Routes every allocation the library makes through allocfn, reallocfn and
+ * freefn, each called with ctx. Passing NULL functions goes back to the
+ * standard allocator. Memory is freed with the allocator it came from, so
+ * this should be called before anything is allocated, and URIs handed out
+ * by urit_expand released with urit_free.
+ */
+void
+urit_setallocator(UritAllocFn allocfn, UritReallocFn reallocfn, UritFreeFn freefn, void *ctx)
+{
+	if (allocfn && reallocfn && freefn) {
+		urit_allocator.alloc = allocfn;
+		urit_allocator.realloc = reallocfn;
+		urit_allocator.free = freefn;
+		urit_allocator.ctx = ctx;
+	} else {
+		urit_allocator.alloc = urit_stdalloc;
+		urit_allocator.realloc = urit_stdrealloc;
+		urit_allocator.free = urit_stdfree;
+		urit_allocator.ctx = NULL;
+	}
+}
+
+void
+urit_free(void *ptr)
+{
+	if (ptr) {
+		urit_allocator.free(ptr, urit_allocator.ctx);
+	}
+}
+
+/**
+ * Starts counting the allocations and reallocations made by each function
+ * of the library from zero, or stops counting. Counting takes a lock on
+ * every allocation, so it is meant for finding hot spots rather than for
+ * production.
+ */
+void
+urit_countallocations(bool enable)
+{
+	pthread_mutex_lock(&urit_allocator.lock);
+	urit_allocator.sites = 0;
+	__atomic_store_n(&urit_allocator.counting, enable, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&urit_allocator.lock);
+}
+
+/**
+ * Copies the counts of up to cap functions into counts, busiest first, and
+ * returns how many functions allocated
+ */
+size_t
+urit_allocationcounts(UritAllocCount *counts, size_t cap)
+{
+	size_t sites;
+
+	pthread_mutex_lock(&urit_allocator.lock);
+	sites = urit_allocator.sites;
+	for (size_t i = 0; i < sites && i < cap; i++) {
+		counts[i] = urit_allocator.counts[i];
+	}
+	pthread_mutex_unlock(&urit_allocator.lock);
+
+	for (size_t i = 1; i < sites && i < cap; i++) {
+		UritAllocCount c = counts[i];
+		size_t j = i;
+
+		while (j > 0 && counts[j - 1].calls < c.calls) {
+			counts[j] = counts[j - 1];
+			j--;
+		}
+		counts[j] = c;
+	}
+	return sites;
+}
 
 UritVars
 urit_newvars(void)
 {
-	UritVars *vars = malloc(sizeof(UritVars));
-	vars->count = 0;
-	vars->vars = malloc(sizeof(UritVar *));
-	return *vars;
+	UritVars vars;
+	vars.count = 0;
+	vars.size = 0;
+	vars.vars = NULL;
+	vars.mask = 0;
+	vars.table = NULL;
+	return vars;
 }
 
 void
 urit_printvars(UritVars vars)
 {
 	for (int i = 0; i < vars.count; i++) {
-		switch(vars.vars[i]->type) {
+		UritVar *var = vars.vars[i];
+
+		switch(var->type) {
 			case URIT_STRING:
-				printf("%s: %s\n", vars.vars[i]->name, vars.vars[i]->val_string);
+				printf("%s: %.*s\n", var->name, (int) var->len, var->val_string);
 				break;
 			case URIT_LIST:
-				printf("%s: ", vars.vars[i]->name);
-				for (int j = 0; j < vars.vars[i]->val_list->count; j++) {
-					printf("%s", vars.vars[i]->val_list->values[j]);
-					if (j + 1 < vars.vars[i]->val_list->count) {
+				printf("%s: ", var->name);
+				for (int j = 0; j < var->val_list->count; j++) {
+					size_t len;
+					const char *item = urit_listitem(var->val_list, j, &len);
+
+					printf("%.*s", (int) len, item);
+					if (j + 1 < var->val_list->count) {
 						printf(", ");
 					}
 				}
 				puts("");
 				break;
 			case URIT_MAP:
-				printf("%s: ", vars.vars[i]->name);
-				for (int j = 0; j < vars.vars[i]->val_map->count; j++) {
-					printf("%s=%s", vars.vars[i]->val_map->pairs[j]->key, vars.vars[i]->val_map->pairs[j]->val);
-					if (j + 1 < vars.vars[i]->val_map->count) {
+				printf("%s: ", var->name);
+				for (int j = 0; j < var->val_map->count; j++) {
+					UritPair pair = urit_mapitem(var->val_map, j);
+
+					printf("%.*s=%.*s", (int) pair.keylen, pair.key, (int) pair.vallen, pair.val);
+					if (j + 1 < var->val_map->count) {
 						printf(", ");
 					}
 				}
@@ -84,949 +361,3927 @@ urit_printerrors(UritResult *r)
 	}
 }
 
+/**
+ * Parses varvalue as a string, a list literal such as ("a","b") or a map
+ * literal such as [("k","v")] and adds it to vars. The name and value are
+ * copied.
+ */
 UritStatus
 urit_addvariable(UritVars *vars, char *varname, char *varvalue)
 {
-	UritVar *var = malloc(sizeof(UritVar));
-	var->name = malloc(sizeof(char) * (strlen(varname) + 1));
-	strcpy(var->name, varname);
-
+	if (urit_getvar(vars, varname, strlen(varname))) {
+		return URIT_DUPLICATE_VARIABLE;
+	}
 	if (*varvalue == '(') {
-		var->type = URIT_LIST;
 		UritList *list = urit_compilelistvar(varvalue);
 
 		if (!list) {
 			return URIT_MALFORMED_LIST;
 		}
 		if (list->count) {
-			var->val_list = list;
-			urit_addvar(vars, var);
+			urit_setvar(vars, varname, strlen(varname), URIT_LIST)->val_list = list;
+		} else {
+			urit_freelist(list);
 		}
 	} else if (*varvalue == '[') {
-		var->type = URIT_MAP;
 		UritMap *map = urit_compilemapvar(varvalue);
 
 		if (!map) {
 			return URIT_MALFORMED_MAP;
 		}
 		if (map->count) {
-			var->val_map = map;
-			urit_addvar(vars, var);
+			urit_setvar(vars, varname, strlen(varname), URIT_MAP)->val_map = map;
+		} else {
+			urit_freemap(map);
 		}
 	} else {
-		char *string = malloc(sizeof(char) * (strlen(varvalue) + 1));
-		strcpy(string, varvalue);
-		var->val_string = string;
-		var->type = URIT_STRING;
-		urit_addvar(vars, var);
+		urit_addstringvar(vars, varname, varvalue);
 	}
 	return URIT_OK;
 }
 
+/**
+ * Sets varname to a copy of varvalue, replacing any value it had
+ */
 void
 urit_addstringvar(UritVars *vars, char *varname, char *varvalue)
 {
-	UritVar *var = urit_getvar(vars, varname);
+	UritVar *var = urit_setvar(vars, varname, strlen(varname), URIT_STRING);
 
-	if (var == NULL) {
-		var = malloc(sizeof(UritVar));
-		var->name = NULL;
-		var->val_string = NULL;
-	}
-	var->name = realloc(var->name, sizeof(char) * (strlen(varname) + 1));
-	strcpy(var->name, varname);
+	var->len = strlen(varvalue);
+	var->val_string = urit_copybytes(varvalue, var->len);
+	var->borrowed = false;
+}
 
-	var->val_string = realloc(var->val_string, sizeof(char) * (strlen(varvalue) + 1));
-	strcpy(var->val_string, varvalue);
-	var->type = URIT_STRING;
-	urit_addvar(vars, var);
+/**
+ * Sets name to the len bytes at val without copying them. They need not be
+ * terminated and must stay valid for as long as vars is expanded against.
+ */
+void
+urit_borrowstringvar(UritVars *vars, char *name, const char *val, size_t len)
+{
+	UritVar *var = urit_setvar(vars, name, strlen(name), URIT_STRING);
+
+	var->len = len;
+	var->val_string = (char *) val;
+	var->borrowed = true;
 }
 
 UritList *
 urit_newlist(void)
 {
-	UritList *list = malloc(sizeof(UritList));
+	UritList *list = URIT_MALLOC(sizeof(UritList));
 	list->count = 0;
-	list->values = malloc(sizeof(char *));
+	list->size = 0;
+	list->offsets = NULL;
+	list->lens = NULL;
+	list->pool = NULL;
+	list->poollen = 0;
+	list->poolsize = 0;
+	list->items = NULL;
+	list->borrowed = false;
 	return list;
 }
 
+/**
+ * Sets name to a list of copies of the count strings in listitems, packed
+ * into storage sized for them up front
+ */
 void
 urit_addlistvar(UritVars *vars, char *name, size_t count, char **listitems)
 {
 	UritList *l = urit_newlist();
+	size_t bytes = 0;
 
+	for (size_t i = 0; i < count; i++) {
+		bytes += strlen(listitems[i]) + 1;
+	}
+	urit_growlist(l, count, bytes);
 	for (size_t i = 0; i < count; i++) {
 		urit_listadditem(listitems[i], l);
 	}
-	UritVar *v = urit_getvar(vars, name);
-	if (v == NULL) {
-		v = malloc(sizeof(UritVar));
-		v->type = URIT_LIST;
-		v->name = malloc(sizeof(char) * (strlen(name) + 1));
-		strcpy(v->name, name);
-		v->val_list = l;
+	urit_setvar(vars, name, strlen(name), URIT_LIST)->val_list = l;
+}
 
-		urit_addvar(vars, v);
-	} else {
-		v->name = malloc(sizeof(char) * (strlen(name) + 1));
-		strcpy(v->name, name);
-		v->val_list = l;
-	}
+/**
+ * Sets name to a list over the caller's arrays of count items and their
+ * lengths, neither of which is copied
+ */
+void
+urit_borrowlistvar(UritVars *vars, char *name, size_t count, const char **items, const size_t *lens)
+{
+	UritList *l = urit_newlist();
+
+	l->count = count;
+	l->items = items;
+	l->lens = (size_t *) lens;
+	l->borrowed = true;
+	urit_setvar(vars, name, strlen(name), URIT_LIST)->val_list = l;
 }
 
+/**
+ * Appends a copy of str to list
+ */
 void
 urit_listadditem(char *str, UritList *list)
 {
-	list->values = realloc(list->values, sizeof(char *) * ++list->count);
-	list->values[list->count - 1] = str;
+	size_t len = strlen(str);
+
+	memcpy(urit_listpush(list, len), str, len);
+}
+
+/**
+ * Returns item i of list and stores its length in len
+ */
+const char *
+urit_listitem(const UritList *list, size_t i, size_t *len)
+{
+	*len = list->lens[i];
+	return list->borrowed ? list->items[i] : list->pool + list->offsets[i];
 }
 
+/**
+ * Sets name to list, which vars takes ownership of
+ */
 void
 urit_varsaddlist(UritVars *vars, char *name, UritList *list)
 {
-	UritVar *v = urit_getvar(vars, name);
-	if (v == NULL) {
-		v = malloc(sizeof(UritVar));
-		v->type = URIT_LIST;
-		v->name = malloc(sizeof(char) * (strlen(name) + 1));
-		strcpy(v->name, name);
-		v->val_list = list;
+	urit_setvar(vars, name, strlen(name), URIT_LIST)->val_list = list;
+}
 
-		urit_addvar(vars, v);
-	} else {
-		v->name = malloc(sizeof(char) * (strlen(name) + 1));
-		strcpy(v->name, name);
-		v->val_list = list;
+/**
+ * Frees a list that was not handed to a variable set, along with the items
+ * it copied
+ */
+void
+urit_freelist(UritList *list)
+{
+	if (list == NULL) {
+		return;
 	}
+	if (!list->borrowed) {
+		urit_free(list->offsets);
+		urit_free(list->pool);
+	}
+	urit_free(list);
 }
 
 UritMap *
 urit_newmap(void)
 {
-	UritMap *map = malloc(sizeof(UritMap));
+	UritMap *map = URIT_MALLOC(sizeof(UritMap));
 	map->count = 0;
-	map->pairs = malloc(sizeof(UritPair *));
+	map->size = 0;
+	map->keyoffsets = NULL;
+	map->keylens = NULL;
+	map->valoffsets = NULL;
+	map->vallens = NULL;
+	map->pool = NULL;
+	map->poollen = 0;
+	map->poolsize = 0;
+	map->pairs = NULL;
+	map->borrowed = false;
 	return map;
 }
 
+/**
+ * Appends copies of key and val to map
+ */
 void
 urit_mapaddkeyval(char *key, char *val, UritMap *map)
 {
-	UritPair *p = malloc(sizeof(UritPair));
-	p->key = malloc(sizeof(char) * (strlen(key) + 1));
-	p->val = malloc(sizeof(char) * (strlen(val) + 1));
-	strcpy(p->key, key);
-	strcpy(p->val, val);
-	
-	map->pairs = realloc(map->pairs, sizeof(UritPair *) * ++map->count);
-	map->pairs[map->count - 1] = p;
+	size_t keylen = strlen(key);
+	size_t vallen = strlen(val);
+	size_t i = urit_mappush(map, keylen, vallen);
+
+	memcpy(map->pool + map->keyoffsets[i], key, keylen);
+	memcpy(map->pool + map->valoffsets[i], val, vallen);
+}
+
+/**
+ * Returns pair i of map. The pair points into the map and is not to be
+ * freed.
+ */
+UritPair
+urit_mapitem(const UritMap *map, size_t i)
+{
+	if (map->borrowed) {
+		return map->pairs[i];
+	}
+	UritPair pair = {
+		map->pool + map->keyoffsets[i], map->pool + map->valoffsets[i],
+		map->keylens[i], map->vallens[i]
+	};
+	return pair;
 }
 
+/**
+ * Sets name to a map of copies of the count key/value pairs in map, packed
+ * into storage sized for them up front
+ */
 void
 urit_addmapvar(UritVars *vars, char *name, size_t count, char *map[][2])
 {
 	UritMap *m = urit_newmap();
+	size_t bytes = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		bytes += strlen(map[i][0]) + strlen(map[i][1]) + 2;
+	}
+	urit_growmap(m, count, bytes);
 	for(size_t i = 0; i < count; i++) {
 		urit_mapaddkeyval(map[i][0], map[i][1], m);
 	}
-	UritVar *v = urit_getvar(vars, name);
-	if (v == NULL) {
-		v = malloc(sizeof(UritVar));
-		v->type = URIT_MAP;
-		v->name = malloc(sizeof(char) * (strlen(name) + 1));
-		strcpy(v->name, name);
-		v->val_map = m;
-		urit_addvar(vars, v);
-	} else {
-		v->name = malloc(sizeof(char) * (strlen(name) + 1));
-		strcpy(v->name, name);
-		v->val_map = m;
-	}
+	urit_setvar(vars, name, strlen(name), URIT_MAP)->val_map = m;
+}
+
+/**
+ * Sets name to a map over the caller's array of count pairs, whose keys and
+ * values are taken by their keylen and vallen and are not copied
+ */
+void
+urit_borrowmapvar(UritVars *vars, char *name, size_t count, const UritPair *pairs)
+{
+	UritMap *m = urit_newmap();
+
+	m->count = count;
+	m->pairs = pairs;
+	m->borrowed = true;
+	urit_setvar(vars, name, strlen(name), URIT_MAP)->val_map = m;
 }
 
+/**
+ * Sets name to map, which vars takes ownership of
+ */
 void
 urit_varsaddmap(UritVars *vars, char *name, UritMap *map)
 {
-	UritVar *v = urit_getvar(vars, name);
-	if (v == NULL) {
-		v = malloc(sizeof(UritVar));
-		v->type = URIT_MAP;
-		v->name = malloc(sizeof(char) * (strlen(name) + 1));
-		strcpy(v->name, name);
-		v->val_map = map;
-		urit_addvar(vars, v);
-	} else {
-		v->name = malloc(sizeof(char) * (strlen(name) + 1));
-		strcpy(v->name, name);
-		v->val_map = map;
-	}
+	urit_setvar(vars, name, strlen(name), URIT_MAP)->val_map = map;
 }
 
-UritString *
-urit_newstring(void)
+/**
+ * Frees a map that was not handed to a variable set, along with the pairs
+ * it copied
+ */
+void
+urit_freemap(UritMap *map)
 {
-	UritString *str = malloc(sizeof(UritString));
-	str->len = 0;
-	str->size = 0;
-	str->str = calloc(1, sizeof(char));
+	if (map == NULL) {
+		return;
+	}
+	if (!map->borrowed) {
+		urit_free(map->keyoffsets);
+		urit_free(map->pool);
+	}
+	urit_free(map);
+}
 
-	return str;
+/**
+ * Frees every variable in vars along with the values it owns. Borrowed
+ * values are left to the caller.
+ */
+void
+urit_freevars(UritVars *vars)
+{
+	for (size_t i = 0; i < vars->count; i++) {
+		urit_freevalue(vars->vars[i]);
+		urit_free(vars->vars[i]->name);
+		urit_free(vars->vars[i]);
+	}
+	urit_free(vars->vars);
+	urit_free(vars->table);
+	*vars = urit_newvars();
 }
 
-UritResult
-urit_parsetemplate(char *tpl, UritVars vars)
+/**
+ * Reads a JSON object of variables from the len bytes at buf into out.
+ * Strings, numbers and booleans become strings, arrays lists and objects
+ * maps, while nulls and empty arrays and objects are left undefined.
+ * Strings without escapes are borrowed from buf, which must outlive out;
+ * the rest are decoded into storage out owns. On a malformed document the
+ * variables read before the error stay in out.
+ */
+UritStatus
+urit_varsfromjson(const char *buf, size_t len, UritVars *out)
 {
-	UritResult res;
-	res.uriref = urit_newstring();
-	res.error = NULL;
-	res.status = URIT_OK;
-	res.tpl = tpl;
-	char *exprend = NULL;
-	char *pctenc = NULL;
-	char *exprstr = NULL;
-	size_t exprlen = 0;
-	bool expr = false;
-	uint8_t numbytes;
-	unsigned char c;
-	char curr;
+	const char *end = buf + len;
+	const char *str = urit_jsonspace(buf, end);
 
-	for (size_t i = 0, j = 0; (curr = tpl[i]); i++, j++) {
-		if (!expr) {
-			if (curr == '{') {
-				expr = true;
-				exprend = strchr(&tpl[i], '}');
-				if (exprend == NULL) {
-					urit_appendstring(res.uriref, tpl + i);
-					urit_adderror(&res, j, URIT_MALFORMED_EXPRESSION);
-					return res;
-				} else {
-					exprlen = exprend - (tpl + i) - 1;
-					if (exprlen == 0) {
-						urit_appendstring(res.uriref, "{}");
-						urit_adderror(&res, j, URIT_EMPTY_EXPRESSION);
-						expr = false;
-						i++;
-						j++;
-					} else {
-						exprstr = malloc(sizeof(char) * (exprlen + 1));
-						snprintf(exprstr, exprlen + 1, "%s", &tpl[i] + 1);
-						UritOpRule oprule = urit_getoprule(exprstr[0]);
-
-						if (!oprule.op && !urit_isvarchar(exprstr)) {
-							urit_appendchar(res.uriref, '{');
-							urit_appendstring(res.uriref, exprstr);
-							urit_appendchar(res.uriref, '}');
-							urit_adderror(&res, ++j, URIT_UNIMPLEMENTED_OPERATOR);
-							i += exprlen + 1;
-							j += exprlen;
-							expr = false;
-						} else {
-							if (oprule.op) {
-								exprstr++;
-							}
-							urit_processexpression(exprstr, oprule, vars, &res, j);
-						}
-					}
-				}
-			} else if (urit_isreserved(curr) || urit_isunreserved(curr)) {
-				urit_appendchar(res.uriref, curr);
+	if (str == end || *str++ != '{') {
+		return URIT_MALFORMED_JSON;
+	}
+	str = urit_jsonspace(str, end);
+	if (str < end && *str == '}') {
+		return urit_jsonspace(str + 1, end) == end ? URIT_OK : URIT_MALFORMED_JSON;
+	}
+	while (str < end && *str == '"') {
+		const char *name;
+		size_t namelen;
+		bool escaped;
 
-			} else if (urit_isliteral(tpl)) {
-				numbytes = urit_numbytes(curr);
+		if (!(str = urit_jsonstring(str, end, &name, &namelen, &escaped))) {
+			return URIT_MALFORMED_JSON;
+		}
+		str = urit_jsonspace(str, end);
+		if (str == end || *str++ != ':') {
+			return URIT_MALFORMED_JSON;
+		}
+		str = urit_jsonspace(str, end);
 
-				for (size_t k = 0; k < numbytes; k++, i++) {
-					c = tpl[i];
-					pctenc = urit_pctencodechar(c);
-					urit_appendstring(res.uriref, pctenc);
-				}
+		if (escaped) {
+			char *decoded = URIT_MALLOC(namelen + 1);
+
+			if (urit_jsonunescape(decoded, name, namelen, &namelen)) {
+				str = urit_jsonvalue(out, decoded, namelen, str, end);
 			} else {
-				urit_adderror(&res, j, URIT_NONLITERAL_FOUND);
-				return res;
+				str = NULL;
 			}
+			urit_free(decoded);
 		} else {
-			if (curr == '}') {
-				expr = false;
-			}
+			str = urit_jsonvalue(out, name, namelen, str, end);
+		}
+		if (str == NULL) {
+			return URIT_MALFORMED_JSON;
+		}
+		str = urit_jsonspace(str, end);
+		if (str < end && *str == ',') {
+			str = urit_jsonspace(str + 1, end);
+		} else if (str < end && *str == '}') {
+			return urit_jsonspace(str + 1, end) == end ? URIT_OK : URIT_MALFORMED_JSON;
+		} else {
+			return URIT_MALFORMED_JSON;
 		}
 	}
-	res.uri = malloc(sizeof(char) * (strlen(res.uriref->str) + 1));
-	strcpy(res.uri, res.uriref->str);
-	return res;
+	return URIT_MALFORMED_JSON;
 }
 
-static void
-urit_addvar(UritVars *vars, UritVar *var)
+UritString *
+urit_newstring(void)
 {
-	vars->vars = realloc(vars->vars, sizeof(UritVar *) * ++vars->count);
-	vars->vars[vars->count - 1] = var;
+	UritString *str = URIT_MALLOC(sizeof(UritString));
+	str->len = 0;
+	str->size = sizeof(char);
+	str->str = URIT_CALLOC(1, sizeof(char));
+	str->fixed = false;
+	str->ctx = NULL;
+
+	return str;
 }
 
-static void
-urit_adderror(UritResult *res, size_t pos, UritCode code)
+/**
+ * Makes sure str can hold len characters without reallocating. Strings over
+ * a fixed buffer are left as they are.
+ */
+void
+urit_reservestring(UritString *str, size_t len)
 {
-	UritError *e = malloc(sizeof(UritError));
-	e->pos = pos;
-	e->code = code;
-	e->next = NULL;
-
-	if (res->error == NULL) {
-		res->error = e;
-	} else {
-		UritError *err = res->error;
-		while (err->next != NULL) {
-			err = (UritError *) err->next;
-		}
-		err->next = (struct UritError *) e;
+	if (!str->fixed && str->size < len + 1) {
+		urit_growstring(str, len + 1);
 	}
-	res->status = URIT_FAILURE;
 }
 
-static bool
-urit_isreserved(const char c)
+/**
+ * Empties str but keeps its buffer, so it can be reused for the next
+ * expansion without going back to the allocator
+ */
+void
+urit_resetstring(UritString *str)
 {
-	switch (c) {
-		case ':':
-		case '/':
-		case '?':
-		case '#':
-		case '[':
-		case ']':
-		case '@':
-		case '!':
-		case '$':
-		case '&':
-		case '\'':
-		case '(':
-		case ')':
-		case '*':
-		case '+':
-		case ',':
-		case ';':
-		case '=':
-		case '|':
-			return true;
+	str->len = 0;
+	if (str->size) {
+		str->str[0] = '\0';
 	}
-	return false;
 }
 
-static bool
-urit_isunreserved(const char c)
+/**
+ * Frees a string made by urit_newstring along with its buffer
+ */
+void
+urit_freestring(UritString *str)
 {
-	if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') {
-		return true;
+	if (str == NULL) {
+		return;
 	}
-	return false;
+	urit_free(str->str);
+	urit_free(str);
 }
 
-static size_t
-urit_numbytes(unsigned char c)
+/**
+ * Expands tpl against vars. Expansion only reads vars and the template
+ * cache is locked, so any number of threads may expand against the same
+ * variables as long as none of them adds to them. Everything the result
+ * holds is released by urit_freeresult.
+ */
+UritResult
+urit_parsetemplate(char *tpl, UritVars vars)
 {
-	if (c < 0xC0) {
-		return 1;
-	} else if (c < 0xE0) {
-		return 2;
-	} else if (c < 0xF0) {
-		return 3;
-	} else if (c < 0xF8) {
-		return 4;
-	} 
-	return 0;
+	UritContext *ctx = urit_newcontext();
+
+	ctx->shared = false;
+	return urit_parsetemplatein(ctx, tpl, vars);
 }
 
-static unsigned
-urit_getcodepoint(const char *str)
+void
+urit_freeresult(UritResult *res)
 {
-	uint8_t numbytes = urit_numbytes(*str);
-	unsigned mask = (1 << (7 - numbytes)) - 1;
-	unsigned submask = (1 << 6) - 1;
-	unsigned last = *str & mask;
+	if (res->ctx) {
+		if (!res->ctx->shared) {
+			urit_freecontext(res->ctx);
+		}
+	} else {
+		UritError *e = res->error;
 
-	switch (numbytes) {
-		case 1:
-			return *str;
-		case 2:
-			return (last << 6) + (str[1] & submask);
-		case 3:
-			return (last << 12) + ((str[1] & submask) << 6) + (str[2] & submask);
-		case 4:
-			return (last << 18) + ((str[1] & submask) << 12) + ((str[2] & submask) << 6) + (str[3] & submask);
+		while (e) {
+			UritError *next = (UritError *) e->next;
+			urit_free(e);
+			e = next;
+		}
+		if (res->uriref) {
+			urit_free(res->uriref->str);
+			urit_free(res->uriref);
+		}
+		urit_free(res->uri);
 	}
-	return 0;
+	res->uriref = NULL;
+	res->uri = NULL;
+	res->error = NULL;
+	res->ctx = NULL;
+}
+
+UritContext *
+urit_newcontext(void)
+{
+	UritContext *ctx = URIT_MALLOC(sizeof(UritContext));
+	ctx->blocks = NULL;
+	ctx->last = NULL;
+	ctx->lastsize = 0;
+	ctx->shared = true;
+	return ctx;
 }
 
 /**
- * From RFC:
- * ucschar	= %xA0-D7FF / %xF900-FDCF / %xFDF0-FFEF
- *			/ %x10000-1FFFD / %x20000-2FFFD / %x30000-3FFFD
- *			/ %x40000-4FFFD / %x50000-5FFFD / %x60000-6FFFD
- *			/ %x70000-7FFFD / %x80000-8FFFD / %x90000-9FFFD
- *			/ %xA0000-AFFFD / %xB0000-BFFFD / %xC0000-CFFFD
- *			/ %xD0000-DFFFD / %xE1000-EFFFD
+ * Expands tpl like urit_parsetemplate, but takes the result's memory from
+ * ctx. Nothing is released until the context is reset, so a worker can keep
+ * one context and reset it after each expansion without touching the heap
+ * once the context has grown large enough.
  */
-
-static bool
-urit_isucschar(const char *str)
+UritResult
+urit_parsetemplatein(UritContext *ctx, char *tpl, UritVars vars)
 {
-	unsigned c = urit_getcodepoint(str);
+	UritResult res = {URIT_OK, NULL, NULL, tpl, NULL, ctx};
+	UritCacheEntry *entry = urit_cacheget(tpl);
 
-	if ((0xA0 <= c && c <= 0xD7FF) || (0xF900 <= c && c <= 0xFDCF) || (0xFDF0 <= c && c <= 0xFFEF) ||
-		(0x10000 <= c && c <= 0x1FFFD) || (0x20000 <= c && c <= 0x2FFFD) || (0x30000 <= c && c <= 0x3FFFD) ||
-		(0x40000 <= c && c <= 0x4FFFD) || (0x50000 <= c && c <= 0x5FFFD) || (0x60000 <= c && c <= 0x6FFFD) ||
-		(0x70000 <= c && c <= 0x7FFFD) || (0x80000 <= c && c <= 0x8FFFD) || (0x90000 <= c && c <= 0x9FFFD) ||
-		(0xA0000 <= c && c <= 0xAFFFD) || (0xB0000 <= c && c <= 0xBFFFD) || (0xC0000 <= c && c <= 0xCFFFD) ||
-		(0xD0000 <= c && c <= 0xDFFFD) || (0xE0000 <= c && c <= 0xEFFFD)) {
-		return true;
+	res.uriref = urit_newstringin(ctx);
+
+	if (entry && entry->tpl) {
+		urit_expandtemplate(entry->tpl, &vars, res.uriref);
+		res.uri = res.uriref->str;
+	} else if (urit_expandstream(tpl, &vars, res.uriref, &res, NULL)) {
+		res.uri = res.uriref->str;
 	}
-	return false;
+	if (entry) {
+		urit_cacherelease(entry);
+	}
+	return res;
 }
 
 /**
- * From RFC:
- * iprivate	= %xE000-F8FF / %xF0000-FFFFD / %x100000-10FFFD
+ * Turns on a cache of compiled templates keyed by the template string, used
+ * by urit_parsetemplate and urit_parsetemplatein so that a template seen
+ * before is not scanned again. At most capacity templates are kept, the
+ * least recently used being evicted first. Templates with errors are cached
+ * as such and keep being expanded the slow way so their errors are still
+ * reported. A capacity of 0 turns the cache off and empties it.
  */
-static bool
-urit_isiprivate(const char *str)
+void
+urit_setcache(size_t capacity)
 {
-	unsigned c = urit_getcodepoint(str);
+	size_t buckets = 16;
 
-	if ((0xE000 <= c && c <= 0xF8FF) || (0xF0000 <= c && c <= 0xFFFFD) || (0x100000 <= c && c <= 0x10FFFD)) {
-		return true;
+	pthread_mutex_lock(&urit_cache.lock);
+	while (urit_cache.stats.count > capacity) {
+		urit_cacheevict(urit_cache.tail);
 	}
-	return false;
+	while (buckets < capacity) {
+		buckets *= 2;
+	}
+	urit_free(urit_cache.buckets);
+	urit_cache.buckets = capacity ? URIT_CALLOC(buckets, sizeof(UritCacheEntry *)) : NULL;
+	urit_cache.mask = capacity ? buckets - 1 : 0;
+	__atomic_store_n(&urit_cache.stats.capacity, capacity, __ATOMIC_RELAXED);
+
+	for (UritCacheEntry *e = urit_cache.head; e; e = e->next) {
+		e->chain = urit_cache.buckets[e->hash & urit_cache.mask];
+		urit_cache.buckets[e->hash & urit_cache.mask] = e;
+	}
+	pthread_mutex_unlock(&urit_cache.lock);
 }
 
-static bool
-urit_ispct(const char *str)
+UritCacheStats
+urit_cachestats(void)
 {
-	uint8_t i = 0;
+	UritCacheStats stats;
 
-	if (strlen(str) < 3) {
-		return false;
-	}
-	if (str[i++] != '%') {
-		return false;
-	}
-	if (!isxdigit(str[i++])) {
-		return false;
-	}
-	if (!isxdigit(str[i])) {
-		return false;
-	}
-	return true;
+	pthread_mutex_lock(&urit_cache.lock);
+	stats = urit_cache.stats;
+	pthread_mutex_unlock(&urit_cache.lock);
+	return stats;
 }
 
 /**
- * From RFC:
- * literals	= %x21 / %x23-24 / %x26 / %x28-3B / %x3D / %x3F-5B / %x5D / %x5F
- *			/ %x61-7A / %x7E / ucschar / iprivate / pct-encoded
- *				; any Unicode character except: CTL, SP, DQUOTE, "'",
- *				; "%" (aside from pct-encoded), "<", ">", "/", "^", `", "{"
- *				; "|", "}"
+ * Releases everything allocated from ctx since it was last reset. If the
+ * context had to grow past one block its blocks are merged into one big
+ * enough for next time.
  */
-static bool
-urit_isliteral(const char *str)
+void
+urit_resetcontext(UritContext *ctx)
 {
-	char c = *str;
+	UritBlock *block = ctx->blocks;
 
-	if (c == 0x21 || c == 0x23 || c == 0x24 || c == 0x26 || (0x28 <= c && c <= 0x3B) ||
-		c == 0x3D || (0x3F <= c && c <= 0x5B) || c == 0x5D || c == 0x5F || (0x61 <= c && c <= 0x7A) ||
-		c == 0x7E || urit_ispct(str) || urit_isucschar(str) || urit_isiprivate(str)) {
-		return true;
+	if (block && block->next) {
+		size_t size = 0;
+
+		while (block) {
+			UritBlock *next = block->next;
+			size += block->size;
+			urit_free(block);
+			block = next;
+		}
+		ctx->blocks = urit_newblock(size);
+	} else if (block) {
+		block->used = 0;
 	}
-	return false;
+	ctx->last = NULL;
+	ctx->lastsize = 0;
 }
 
-static bool
+void
+urit_freecontext(UritContext *ctx)
+{
+	UritBlock *block = ctx->blocks;
+
+	while (block) {
+		UritBlock *next = block->next;
+		urit_free(block);
+		block = next;
+	}
+	urit_free(ctx);
+}
+
+/**
+ * Pre-parses a template into literal runs and expressions so that it can be
+ * expanded any number of times without rescanning it. Errors are reported
+ * through errors (which may be NULL) exactly as urit_parsetemplate reports
+ * them. Returns NULL if the template cannot be expanded at all.
+ */
+UritTemplate *
+urit_compile(const char *tpl, UritResult *errors)
+{
+	UritResult res;
+	UritTemplate *t = URIT_MALLOC(sizeof(UritTemplate));
+	UritString *lit = urit_newstring();
+	UritVarSpec spec;
+	const char *expr;
+	const char *end;
+	size_t tpllen = strlen(tpl);
+	size_t exprlen;
+	size_t pos;
+	size_t i = 0;
+	size_t j = 0;
+	UritCode code;
+
+	if (errors == NULL) {
+		errors = &res;
+	}
+	errors->status = URIT_OK;
+	errors->uriref = NULL;
+	errors->uri = NULL;
+	errors->tpl = (char *) tpl;
+	errors->error = NULL;
+	errors->ctx = NULL;
+
+	t->tpl = URIT_MALLOC(sizeof(char) * (tpllen + 1));
+	memcpy(t->tpl, tpl, tpllen + 1);
+	t->count = 0;
+	t->parts = NULL;
+	t->code = NULL;
+
+	while ((code = urit_scanliteral(t->tpl, tpllen, &i, &j, lit, &expr, &exprlen, &pos)) != URIT_OK || expr) {
+		if (code != URIT_OK) {
+			urit_adderror(errors, pos, code);
+
+			if (urit_isfatal(code)) {
+				break;
+			}
+			continue;
+		}
+		urit_flushliteral(t, lit, pos);
+
+		UritPart *part = urit_addpart(t, URIT_EXPRESSION, pos);
+		part->oprule = urit_getoprule(*expr);
+		end = expr + exprlen;
+		pos++;
+
+		if (part->oprule.op) {
+			expr++;
+			pos++;
+		}
+		while ((code = urit_nextvarspec(&expr, end, &spec, &pos)) == URIT_OK && spec.len) {
+			part->varspecs = URIT_REALLOC(part->varspecs, sizeof(UritVarSpec) * ++part->count);
+			part->varspecs[part->count - 1] = spec;
+		}
+		if (code != URIT_OK) {
+			urit_adderror(errors, pos, code);
+		}
+	}
+
+	if (code != URIT_OK) {
+		urit_freetemplate(t);
+		t = NULL;
+	} else {
+		urit_flushliteral(t, lit, j);
+		urit_assemble(t);
+	}
+	urit_freestring(lit);
+
+	return t;
+}
+
+/**
+ * Appends the expansion of a compiled template to uri, which can be reset
+ * and reused across expansions
+ */
+void
+urit_expandinto(UritString *uri, const UritTemplate *tpl, const UritVars *vars)
+{
+	urit_expandtemplate(tpl, vars, uri);
+}
+
+/**
+ * Expands a compiled template against vars, returning a newly allocated URI
+ */
+char *
+urit_expand(const UritTemplate *tpl, const UritVars *vars)
+{
+	UritString *uri = urit_newstring();
+	char *str;
+
+	urit_expandtemplate(tpl, vars, uri);
+	str = uri->str;
+	urit_free(uri);
+
+	return str;
+}
+
+/**
+ * Expands tpl straight into buf without compiling it or touching the heap.
+ * Like snprintf, at most cap - 1 characters are written, buf is always
+ * terminated when cap is non-zero and the full length of the URI is
+ * returned, so a caller can retry once with a buffer of the returned length
+ * plus one. If st is not NULL it receives URIT_OK or the code of the first
+ * error found.
+ */
+size_t
+urit_expandto(char *buf, size_t cap, const char *tpl, const UritVars *vars, UritStatus *st)
+{
+	UritString out = {0, cap, buf, true, NULL};
+
+	if (cap) {
+		buf[0] = '\0';
+	}
+	urit_expandstream(tpl, vars, &out, NULL, st);
+
+	return out.len;
+}
+
+/**
+ * Matches uri against a compiled template, the reverse of expansion, adding
+ * the percent-decoded values it finds to out. Literals must match exactly.
+ * Each expression ends where its operator could no longer have produced the
+ * text, or for + and # where whatever follows it first appears, so uri is
+ * read once without backtracking. Where the expansion lost information,
+ * such as undefined or adjacent values, values are handed out in varspec
+ * order. Returns URIT_FAILURE when uri does not match.
+ */
+UritStatus
+urit_match(const UritTemplate *tpl, const char *uri, UritVars *out)
+{
+	const char *end = uri + strlen(uri);
+	const char *stop;
+
+	for (size_t i = 0; i < tpl->count; i++) {
+		const UritPart *part = &tpl->parts[i];
+
+		if (part->type == URIT_LITERAL) {
+			if ((size_t) (end - uri) < part->len || memcmp(uri, part->str, part->len) != 0) {
+				return URIT_FAILURE;
+			}
+			uri += part->len;
+		} else {
+			stop = urit_matchextent(part, i + 1 < tpl->count ? &tpl->parts[i + 1] : NULL, i + 2 == tpl->count, uri, end);
+			uri = urit_matchexpression(part, uri, stop, out);
+		}
+	}
+	return uri == end ? URIT_OK : URIT_FAILURE;
+}
+
+UritRouter *
+urit_newrouter(void)
+{
+	UritRouter *router = URIT_MALLOC(sizeof(UritRouter));
+	UritPart root = {URIT_LITERAL, 0, 0, NULL};
+
+	router->root = urit_newroutenode(&root);
+	router->count = 0;
+	router->templates = NULL;
+	return router;
+}
+
+/**
+ * Compiles tpl and adds it to the router's tree under the id router->count,
+ * so routes are numbered in the order they were added. Literal parts share
+ * edges byte by byte with every route that starts the same way and
+ * expressions with the same operator, variable count and modifiers share one
+ * edge whatever their variables are called, since names only matter when the
+ * route's own template extracts the values. Of routes that end on the same
+ * node the first added wins. Returns URIT_FAILURE if tpl did not compile.
+ */
+UritStatus
+urit_addroute(UritRouter *router, const char *tpl, UritResult *errors)
+{
+	UritTemplate *t = urit_compile(tpl, errors);
+	UritRouteNode *node = router->root;
+
+	if (t == NULL) {
+		return URIT_FAILURE;
+	}
+	for (size_t i = 0; i < t->count; i++) {
+		if (t->parts[i].type == URIT_LITERAL) {
+			node = urit_insertliteral(node, t->parts[i].str, t->parts[i].len);
+		} else {
+			node = urit_insertexpression(node, &t->parts[i]);
+		}
+	}
+	if (!node->route) {
+		node->route = true;
+		node->id = router->count;
+	}
+	router->templates = URIT_REALLOC(router->templates, sizeof(UritTemplate *) * (router->count + 1));
+	router->templates[router->count++] = t;
+
+	return URIT_OK;
+}
+
+/**
+ * Finds the route uri matches by walking the tree once along the URI, so the
+ * cost depends on the length of uri rather than on the number of routes.
+ * Literal edges are tried before expressions and expressions in the order
+ * they were added. When out is not NULL the route's variables are extracted
+ * by name with its own template. The route's id is stored in id only when
+ * URIT_OK is returned; returns URIT_FAILURE if no route matches.
+ */
+UritStatus
+urit_route(const UritRouter *router, const char *uri, size_t *id, UritVars *out)
+{
+	size_t found;
+
+	if (!urit_routefrom(router->root, uri, uri + strlen(uri), &found)) {
+		return URIT_FAILURE;
+	}
+	if (out && urit_match(router->templates[found], uri, out) != URIT_OK) {
+		return URIT_FAILURE;
+	}
+	if (id) {
+		*id = found;
+	}
+	return URIT_OK;
+}
+
+void
+urit_freerouter(UritRouter *router)
+{
+	if (router == NULL) {
+		return;
+	}
+	urit_freeroutenode(router->root);
+	for (size_t i = 0; i < router->count; i++) {
+		urit_freetemplate(router->templates[i]);
+	}
+	urit_free(router->templates);
+	urit_free(router);
+}
+
+/**
+ * Resolves every variable of tpl to its index in names, the schema of count
+ * variables the template will be expanded against with urit_expandslots.
+ * Names are only compared here, never again at expansion time. Variables
+ * missing from the schema stay undefined and make this return
+ * URIT_FAILURE, though the rest are still bound.
+ */
+UritStatus
+urit_bindtemplate(UritTemplate *tpl, const char **names, size_t count)
+{
+	UritStatus status = URIT_OK;
+
+	for (size_t i = 0; i < tpl->count; i++) {
+		UritPart *part = &tpl->parts[i];
+
+		for (size_t k = 0; part->type == URIT_EXPRESSION && k < part->count; k++) {
+			UritVarSpec *spec = &part->varspecs[k];
+
+			spec->slot = URIT_NOSLOT;
+			for (size_t n = 0; n < count; n++) {
+				if (strncmp(names[n], spec->name, spec->len) == 0 && names[n][spec->len] == '\0') {
+					spec->slot = n;
+					break;
+				}
+			}
+			if (spec->slot == URIT_NOSLOT) {
+				status = URIT_FAILURE;
+			}
+		}
+	}
+	return status;
+}
+
+/**
+ * Makes count empty slots, one for each name of a schema. Values set in
+ * slots are borrowed, not copied, and must outlive the expansions using them.
+ */
+UritSlots *
+urit_newslots(size_t count)
+{
+	UritSlots *slots = URIT_MALLOC(sizeof(UritSlots));
+
+	slots->count = count;
+	slots->values = URIT_CALLOC(count ? count : 1, sizeof(UritVar));
+	return slots;
+}
+
+void
+urit_setslotstring(UritSlots *slots, size_t slot, char *value)
+{
+	urit_setslotbytes(slots, slot, value, strlen(value));
+}
+
+/**
+ * Sets slot to the len bytes at value, which need not be terminated
+ */
+void
+urit_setslotbytes(UritSlots *slots, size_t slot, const char *value, size_t len)
+{
+	slots->values[slot].type = URIT_STRING;
+	slots->values[slot].val_string = (char *) value;
+	slots->values[slot].len = len;
+	slots->values[slot].borrowed = true;
+}
+
+void
+urit_setslotlist(UritSlots *slots, size_t slot, UritList *list)
+{
+	slots->values[slot].type = URIT_LIST;
+	slots->values[slot].val_list = list;
+}
+
+void
+urit_setslotmap(UritSlots *slots, size_t slot, UritMap *map)
+{
+	slots->values[slot].type = URIT_MAP;
+	slots->values[slot].val_map = map;
+}
+
+/**
+ * Leaves every slot undefined so the slots can be filled for the next
+ * request
+ */
+void
+urit_clearslots(UritSlots *slots)
+{
+	memset(slots->values, 0, sizeof(UritVar) * slots->count);
+}
+
+void
+urit_freeslots(UritSlots *slots)
+{
+	if (slots == NULL) {
+		return;
+	}
+	urit_free(slots->values);
+	urit_free(slots);
+}
+
+/**
+ * Expands a template bound with urit_bindtemplate against slots, returning
+ * a newly allocated URI. Variables are found by index, so no name is hashed
+ * or compared.
+ */
+char *
+urit_expandslots(const UritTemplate *tpl, const UritSlots *slots)
+{
+	UritString *uri = urit_newstring();
+	char *str;
+
+	urit_expandbound(tpl, slots, uri);
+	str = uri->str;
+	urit_free(uri);
+
+	return str;
+}
+
+void
+urit_expandslotsinto(UritString *uri, const UritTemplate *tpl, const UritSlots *slots)
+{
+	urit_expandbound(tpl, slots, uri);
+}
+
+UritBatch *
+urit_newbatch(void)
+{
+	UritBatch *batch = URIT_MALLOC(sizeof(UritBatch));
+	batch->uris = urit_newstring();
+	batch->count = 0;
+	batch->size = 0;
+	batch->offsets = NULL;
+	return batch;
+}
+
+/**
+ * Expands tpl once for each of the count variable sets into one contiguous
+ * buffer, replacing what the batch held before. Row i starts at
+ * batch->uris->str + batch->offsets[i], is followed by sep and is
+ * batch->offsets[i + 1] - batch->offsets[i] - 1 characters long. With sep
+ * '\n' the buffer can be written out as it is; with '\0' every row is a C
+ * string. With threads above 1 the rows are split into that many ranges
+ * expanded in parallel and then joined in order.
+ */
+void
+urit_expandbatch(UritBatch *batch, const UritTemplate *tpl, const UritVars *sets, size_t count, char sep, size_t threads)
+{
+	if (batch->size < count + 1) {
+		batch->size = count + 1;
+		batch->offsets = URIT_REALLOC(batch->offsets, sizeof(size_t) * batch->size);
+	}
+	batch->count = count;
+	urit_resetstring(batch->uris);
+
+	if (threads > count) {
+		threads = count;
+	}
+	if (threads <= 1) {
+		urit_expandrows(tpl, sets, 0, count, sep, batch->uris, batch->offsets);
+	} else {
+		urit_expandparallel(batch, tpl, sets, count, sep, threads);
+	}
+	batch->offsets[count] = batch->uris->len;
+}
+
+void
+urit_freebatch(UritBatch *batch)
+{
+	if (batch == NULL) {
+		return;
+	}
+	urit_freestring(batch->uris);
+	urit_free(batch->offsets);
+	urit_free(batch);
+}
+
+/**
+ * Expands tpl against vars and remembers where each part of the template
+ * starts in the URI, so that urit_reexpand can later re-render only the
+ * expressions a changed variable appears in. vars is kept, not copied.
+ */
+UritExpansion *
+urit_newexpansion(const UritTemplate *tpl, const UritVars *vars)
+{
+	UritExpansion *exp = URIT_MALLOC(sizeof(UritExpansion));
+
+	exp->tpl = tpl;
+	exp->vars = vars;
+	exp->uri = urit_newstring();
+	exp->scratch = urit_newstring();
+	exp->offsets = URIT_MALLOC(sizeof(size_t) * (tpl->count + 1));
+	for (size_t i = 0; i < tpl->count; i++) {
+		exp->offsets[i] = exp->uri->len;
+		urit_expandpart(&tpl->parts[i], vars, exp->uri);
+	}
+	exp->offsets[tpl->count] = exp->uri->len;
+	return exp;
+}
+
+/**
+ * Re-renders the expressions that reference the variable called name after
+ * it was set, removed or changed in the expansion's variable set, splicing
+ * each into the URI in place of its old output. Returns the URI.
+ */
+const char *
+urit_reexpand(UritExpansion *exp, const char *name)
+{
+	size_t len = strlen(name);
+
+	for (size_t i = 0; i < exp->tpl->count; i++) {
+		const UritPart *part = &exp->tpl->parts[i];
+
+		if (part->type == URIT_EXPRESSION && urit_findvarspec(part, name, len) < part->count) {
+			urit_resetstring(exp->scratch);
+			urit_expandpart(part, exp->vars, exp->scratch);
+			urit_splice(exp, i, exp->scratch->str, exp->scratch->len);
+		}
+	}
+	return exp->uri->str;
+}
+
+void
+urit_freeexpansion(UritExpansion *exp)
+{
+	if (exp == NULL) {
+		return;
+	}
+	urit_freestring(exp->uri);
+	urit_freestring(exp->scratch);
+	urit_free(exp->offsets);
+	urit_free(exp);
+}
+
+/**
+ * Specializes tpl for the variables in constants. Every expression whose
+ * variables are all defined in constants is expanded once into literal
+ * text, so the template returned only has the expressions that still depend
+ * on other variables. Expanding it against those gives the same URI as
+ * expanding tpl against both sets. An expression that starts with constants
+ * is split when its operator allows it, {?tenant,id} becoming literal text
+ * and {&id}; other expressions that mix constants with other variables are
+ * kept whole and still need the constants when expanded. The new template
+ * is compiled from scratch and has to be bound again to use slots.
+ */
+UritTemplate *
+urit_partial(const UritTemplate *tpl, const UritVars *constants)
+{
+	UritString *text = urit_newstring();
+
+	for (size_t i = 0; i < tpl->count; i++) {
+		const UritPart *part = &tpl->parts[i];
+		UritPart head = *part;
+		char op = part->oprule.op;
+
+		head.count = 0;
+		while (head.count < part->count && urit_getvar(constants, part->varspecs[head.count].name, part->varspecs[head.count].len)) {
+			head.count++;
+		}
+		if (part->type == URIT_LITERAL || head.count == part->count) {
+			urit_expandpart(part, constants, text);
+			continue;
+		}
+		if (head.count && op && strchr("?&;/.", op)) {
+			size_t len = text->len;
+
+			urit_expandpart(&head, constants, text);
+			if (text->len > len && op == '?') {
+				op = '&';
+			}
+		} else {
+			head.count = 0;
+		}
+		urit_appendchar(text, '{');
+		if (op) {
+			urit_appendchar(text, op);
+		}
+		for (size_t k = head.count; k < part->count; k++) {
+			const UritVarSpec *spec = &part->varspecs[k];
+
+			if (k > head.count) {
+				urit_appendchar(text, ',');
+			}
+			urit_appendbytes(text, spec->name, spec->len);
+			if (spec->expl) {
+				urit_appendchar(text, '*');
+			} else if (spec->prefix) {
+				char prefix[24];
+
+				urit_appendbytes(text, prefix, sprintf(prefix, ":%zu", spec->prefix));
+			}
+		}
+		urit_appendchar(text, '}');
+	}
+	UritTemplate *t = urit_compile(text->str, NULL);
+
+	urit_freestring(text);
+	return t;
+}
+
+/**
+ * Appends to out a C function called name that expands tpl without the
+ * library, linking only against the encoder in uritrt.c. Like urit_expandto
+ * it takes a buffer of cap bytes, writes as much of the URI as fits,
+ * terminated, and returns its full length. Operators are resolved and
+ * literals become constant copies when the code is written. Each variable
+ * becomes parameters, in the order it first appears: const char *name and
+ * size_t name_len for a string, const UritSlice *name and size_t
+ * name_count for a list and const UritSlice (*name)[2] and size_t
+ * name_count for a map. A NULL pointer leaves the variable undefined. The
+ * type of each variable is taken from types, which may be NULL, and
+ * defaults to a string. Names that cannot be used as C identifiers become
+ * urit_var followed by their position. Returns URIT_INVALID_VARNAME if
+ * name is not an identifier.
+ */
+UritStatus
+urit_emitc(UritString *out, const UritTemplate *tpl, const char *name, const UritVars *typevars)
+{
+	if (!urit_isident(name, strlen(name))) {
+		return URIT_INVALID_VARNAME;
+	}
+	size_t total = 1;
+	bool more = false;
+
+	for (size_t i = 0; i < tpl->count; i++) {
+		total += tpl->parts[i].count;
+		more = more || urit_emittracks(&tpl->parts[i]);
+	}
+	const UritVarSpec **params = URIT_MALLOC(sizeof(UritVarSpec *) * total);
+	size_t count = urit_emitparams(tpl, params);
+	char **idents = URIT_MALLOC(sizeof(char *) * total);
+	UritValueType *types = URIT_MALLOC(sizeof(UritValueType) * total);
+
+	urit_appendformat(out, "/* urit --emit-c ");
+	urit_appendformat(out, "%s '", name);
+	for (const char *c = tpl->tpl; *c; c++) {
+		urit_appendchar(out, *c);
+		if (c[0] == '*' && c[1] == '/') {
+			urit_appendchar(out, ' ');
+		}
+	}
+	urit_appendformat(out, "' */\nsize_t\n%s(char *urit_buf, size_t urit_cap", name);
+
+	for (size_t i = 0; i < count; i++) {
+		const UritVar *var = typevars ? urit_getvar(typevars, params[i]->name, params[i]->len) : NULL;
+
+		idents[i] = urit_emitident(params, count, i);
+		types[i] = var ? var->type : URIT_STRING;
+		if (types[i] == URIT_STRING) {
+			urit_appendformat(out, ", const char *%s, size_t %s_len", idents[i], idents[i]);
+		} else {
+			urit_appendformat(out, types[i] == URIT_LIST ? ", const UritSlice *%s, size_t %s_count" :
+				", const UritSlice (*%s)[2], size_t %s_count", idents[i], idents[i]);
+		}
+	}
+	urit_appendformat(out, ")\n{\n\tsize_t urit_len = 0;\n%s\n", more ? "\tbool urit_more;\n" : "");
+
+	for (size_t i = 0; i < tpl->count; i++) {
+		const UritPart *part = &tpl->parts[i];
+
+		if (part->type == URIT_LITERAL) {
+			urit_emitput(out, part->str, part->len, "\t");
+			continue;
+		}
+		if (urit_emittracks(part)) {
+			urit_appendformat(out, "\turit_more = false;\n");
+		}
+		for (size_t k = 0; k < part->count; k++) {
+			size_t j = urit_findparam(params, count, &part->varspecs[k]);
+			bool more = urit_emittracks(part) && k + 1 < part->count;
+
+			urit_emitvarspec(out, &part->oprule, &part->varspecs[k], types[j], idents[j], k, more);
+		}
+	}
+	urit_appendformat(out, "\tif (urit_cap) {\n\t\turit_buf[urit_len < urit_cap ? urit_len : urit_cap - 1] = '\\0';\n"
+		"\t}\n\treturn urit_len;\n}\n");
+
+	for (size_t i = 0; i < count; i++) {
+		urit_free(idents[i]);
+	}
+	urit_free(idents);
+	urit_free(types);
+	urit_free(params);
+	return URIT_OK;
+}
+
+void
+urit_freetemplate(UritTemplate *tpl)
+{
+	if (tpl == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < tpl->count; i++) {
+		if (tpl->parts[i].type == URIT_LITERAL) {
+			urit_free(tpl->parts[i].str);
+		} else {
+			urit_free(tpl->parts[i].varspecs);
+		}
+	}
+	urit_free(tpl->parts);
+	urit_free(tpl->code);
+	urit_free(tpl->tpl);
+	urit_free(tpl);
+}
+
+/**
+ * Appends the expansion of rows first to last - 1, each followed by sep, to
+ * des, recording where each row starts
+ */
+static void
+urit_expandrows(const UritTemplate *tpl, const UritVars *sets, size_t first, size_t last, char sep, UritString *des, size_t *offsets)
+{
+	for (size_t i = first; i < last; i++) {
+		offsets[i] = des->len;
+		urit_expandtemplate(tpl, &sets[i], des);
+		urit_appendchar(des, sep);
+	}
+}
+
+static void *
+urit_batchworker(void *arg)
+{
+	UritBatchWorker *w = arg;
+
+	urit_expandrows(w->tpl, w->sets, w->first, w->last, w->sep, w->uris, w->offsets);
+	return NULL;
+}
+
+/**
+ * Splits the rows of a batch into one range per thread. The first range is
+ * expanded on the calling thread straight into the batch and the others are
+ * appended after it as their threads finish.
+ */
+static void
+urit_expandparallel(UritBatch *batch, const UritTemplate *tpl, const UritVars *sets, size_t count, char sep, size_t threads)
+{
+	UritBatchWorker *workers = URIT_MALLOC(sizeof(UritBatchWorker) * threads);
+
+	for (size_t t = 0; t < threads; t++) {
+		workers[t].tpl = tpl;
+		workers[t].sets = sets;
+		workers[t].first = count * t / threads;
+		workers[t].last = count * (t + 1) / threads;
+		workers[t].sep = sep;
+		workers[t].offsets = batch->offsets;
+		workers[t].uris = t ? urit_newstring() : batch->uris;
+		workers[t].started = t && pthread_create(&workers[t].thread, NULL, urit_batchworker, &workers[t]) == 0;
+	}
+	urit_batchworker(&workers[0]);
+
+	for (size_t t = 1; t < threads; t++) {
+		size_t base = batch->uris->len;
+
+		if (workers[t].started) {
+			pthread_join(workers[t].thread, NULL);
+		} else {
+			urit_batchworker(&workers[t]);
+		}
+		urit_appendbytes(batch->uris, workers[t].uris->str, workers[t].uris->len);
+
+		for (size_t i = workers[t].first; i < workers[t].last; i++) {
+			batch->offsets[i] += base;
+		}
+		urit_freestring(workers[t].uris);
+	}
+	urit_free(workers);
+}
+
+/**
+ * Appends var to vars and indexes it by name. The caller makes sure no
+ * variable of the same name is already there.
+ */
+static void
+urit_addvar(UritVars *vars, UritVar *var)
+{
+	if (vars->count == vars->size) {
+		vars->size = vars->size ? vars->size * 2 : 8;
+		vars->vars = URIT_REALLOC(vars->vars, sizeof(UritVar *) * vars->size);
+	}
+	vars->vars[vars->count++] = var;
+	var->hash = urit_hash(var->name, strlen(var->name));
+
+	if (vars->count * 2 > vars->mask + 1) {
+		urit_growtable(vars);
+	} else {
+		urit_indexvar(vars, var);
+	}
+}
+
+/**
+ * Returns the variable named by the len bytes at name, adding it if vars has
+ * none, with any value it owned released and its type set to type
+ */
+static UritVar *
+urit_setvar(UritVars *vars, const char *name, size_t len, UritValueType type)
+{
+	UritVar *var = urit_getvar(vars, name, len);
+
+	if (var == NULL) {
+		var = URIT_MALLOC(sizeof(UritVar));
+		var->name = urit_copybytes(name, len);
+		urit_addvar(vars, var);
+	} else {
+		urit_freevalue(var);
+	}
+	var->type = type;
+	var->len = 0;
+	var->borrowed = false;
+	var->val_string = NULL;
+	return var;
+}
+
+static void
+urit_freevalue(UritVar *var)
+{
+	switch (var->type) {
+		case URIT_STRING:
+			if (!var->borrowed) {
+				urit_free(var->val_string);
+			}
+			break;
+		case URIT_LIST:
+			urit_freelist(var->val_list);
+			break;
+		case URIT_MAP:
+			urit_freemap(var->val_map);
+			break;
+	}
+}
+
+/**
+ * Makes room in list for items more items taking bytes more bytes of the
+ * pool. The offsets and lengths share one allocation and every item lives
+ * in the one pool, so iterating a list walks two arrays and one buffer.
+ */
+static void
+urit_growlist(UritList *list, size_t items, size_t bytes)
+{
+	if (list->count + items > list->size) {
+		size_t size = list->size ? list->size * 2 : (items > 4 ? items : 4);
+
+		while (size < list->count + items) {
+			size *= 2;
+		}
+		size_t *index = URIT_MALLOC(sizeof(size_t) * 2 * size);
+
+		if (list->count) {
+			memcpy(index, list->offsets, sizeof(size_t) * list->count);
+			memcpy(index + size, list->lens, sizeof(size_t) * list->count);
+		}
+		urit_free(list->offsets);
+		list->offsets = index;
+		list->lens = index + size;
+		list->size = size;
+	}
+	urit_growpool(&list->pool, &list->poolsize, list->poollen + bytes);
+}
+
+/**
+ * Appends an item of len bytes to list and returns where they are to be
+ * written. The item is terminated and may be shortened by lowering its
+ * length afterwards.
+ */
+static char *
+urit_listpush(UritList *list, size_t len)
+{
+	urit_growlist(list, 1, len + 1);
+	char *item = list->pool + list->poollen;
+
+	list->offsets[list->count] = list->poollen;
+	list->lens[list->count++] = len;
+	list->poollen += len + 1;
+	item[len] = '\0';
+	return item;
+}
+
+/**
+ * Makes room in map for pairs more pairs taking bytes more bytes of the
+ * pool, laid out like a list with four index arrays in one allocation
+ */
+static void
+urit_growmap(UritMap *map, size_t pairs, size_t bytes)
+{
+	if (map->count + pairs > map->size) {
+		size_t size = map->size ? map->size * 2 : (pairs > 4 ? pairs : 4);
+
+		while (size < map->count + pairs) {
+			size *= 2;
+		}
+		size_t *index = URIT_MALLOC(sizeof(size_t) * 4 * size);
+
+		if (map->count) {
+			memcpy(index, map->keyoffsets, sizeof(size_t) * map->count);
+			memcpy(index + size, map->keylens, sizeof(size_t) * map->count);
+			memcpy(index + size * 2, map->valoffsets, sizeof(size_t) * map->count);
+			memcpy(index + size * 3, map->vallens, sizeof(size_t) * map->count);
+		}
+		urit_free(map->keyoffsets);
+		map->keyoffsets = index;
+		map->keylens = index + size;
+		map->valoffsets = index + size * 2;
+		map->vallens = index + size * 3;
+		map->size = size;
+	}
+	urit_growpool(&map->pool, &map->poolsize, map->poollen + bytes);
+}
+
+/**
+ * Appends a pair with a key of keylen bytes and a value of vallen bytes to
+ * map, both terminated, and returns its index
+ */
+static size_t
+urit_mappush(UritMap *map, size_t keylen, size_t vallen)
+{
+	urit_growmap(map, 1, keylen + vallen + 2);
+	size_t i = map->count++;
+
+	map->keyoffsets[i] = map->poollen;
+	map->keylens[i] = keylen;
+	map->pool[map->poollen + keylen] = '\0';
+	map->poollen += keylen + 1;
+	map->valoffsets[i] = map->poollen;
+	map->vallens[i] = vallen;
+	map->pool[map->poollen + vallen] = '\0';
+	map->poollen += vallen + 1;
+	return i;
+}
+
+/**
+ * Grows the pool at *pool to hold at least min bytes, doubling it
+ */
+static void
+urit_growpool(char **pool, size_t *size, size_t min)
+{
+	if (min <= *size) {
+		return;
+	}
+	size_t grown = *size ? *size * 2 : 64;
+
+	while (grown < min) {
+		grown *= 2;
+	}
+	*pool = URIT_REALLOC(*pool, grown);
+	*size = grown;
+}
+
+/**
+ * Doubles the open-addressing table, keeping it at most half full, and
+ * reindexes every variable
+ */
+static void
+urit_growtable(UritVars *vars)
+{
+	size_t buckets = vars->mask ? (vars->mask + 1) * 2 : 16;
+
+	while (vars->count * 2 > buckets) {
+		buckets *= 2;
+	}
+	urit_free(vars->table);
+	vars->table = URIT_CALLOC(buckets, sizeof(UritVar *));
+	vars->mask = buckets - 1;
+
+	for (size_t i = 0; i < vars->count; i++) {
+		urit_indexvar(vars, vars->vars[i]);
+	}
+}
+
+static void
+urit_indexvar(UritVars *vars, UritVar *var)
+{
+	size_t slot = var->hash & vars->mask;
+
+	while (vars->table[slot]) {
+		slot = (slot + 1) & vars->mask;
+	}
+	vars->table[slot] = var;
+}
+
+/**
+ * FNV-1a over the first len bytes of name
+ */
+static size_t
+urit_hash(const char *name, size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char) name[i];
+		hash *= 1099511628211ULL;
+	}
+	return (size_t) hash;
+}
+
+static void
+urit_adderror(UritResult *res, size_t pos, UritCode code)
+{
+	UritError *e = res->ctx ? urit_arenaalloc(res->ctx, sizeof(UritError)) : URIT_MALLOC(sizeof(UritError));
+	e->pos = pos;
+	e->code = code;
+	e->next = NULL;
+
+	if (res->error == NULL) {
+		res->error = e;
+	} else {
+		UritError *err = res->error;
+		while (err->next != NULL) {
+			err = (UritError *) err->next;
+		}
+		err->next = (struct UritError *) e;
+	}
+	res->status = URIT_FAILURE;
+}
+
+static UritBlock *
+urit_newblock(size_t size)
+{
+	UritBlock *block = URIT_MALLOC(URIT_BLOCKHEADER + size);
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+	return block;
+}
+
+/**
+ * Bump-allocates size bytes from the context's newest block, starting a new
+ * block when it is full
+ */
+static void *
+urit_arenaalloc(UritContext *ctx, size_t size)
+{
+	UritBlock *block = ctx->blocks;
+	size_t aligned = (size + URIT_ALIGN - 1) & ~((size_t) URIT_ALIGN - 1);
+
+	if (block == NULL || block->size - block->used < aligned) {
+		block = urit_newblock(aligned > URIT_BLOCK_SIZE ? aligned : URIT_BLOCK_SIZE);
+		block->next = ctx->blocks;
+		ctx->blocks = block;
+	}
+	ctx->last = (char *) block + URIT_BLOCKHEADER + block->used;
+	ctx->lastsize = aligned;
+	block->used += aligned;
+
+	return ctx->last;
+}
+
+/**
+ * Grows an allocation from the context, in place when it is the most recent
+ * one and its block has room
+ */
+static void *
+urit_arenarealloc(UritContext *ctx, void *ptr, size_t oldsize, size_t size)
+{
+	UritBlock *block = ctx->blocks;
+	size_t aligned = (size + URIT_ALIGN - 1) & ~((size_t) URIT_ALIGN - 1);
+	void *grown;
+
+	if (ptr && ptr == ctx->last && block->size - (block->used - ctx->lastsize) >= aligned) {
+		block->used += aligned - ctx->lastsize;
+		ctx->lastsize = aligned;
+		return ptr;
+	}
+	grown = urit_arenaalloc(ctx, size);
+	if (ptr) {
+		memcpy(grown, ptr, oldsize < size ? oldsize : size);
+	}
+	return grown;
+}
+
+static UritString *
+urit_newstringin(UritContext *ctx)
+{
+	UritString *str = urit_arenaalloc(ctx, sizeof(UritString));
+	str->len = 0;
+	str->size = sizeof(char);
+	str->str = urit_arenaalloc(ctx, sizeof(char));
+	str->str[0] = '\0';
+	str->fixed = false;
+	str->ctx = ctx;
+
+	return str;
+}
+
+static bool
 urit_isvarchar(const char *str)
 {
-	if (urit_ispct(str) || isalnum(str[0]) || str[0] == '_') {
+	return (urit_charclass[(unsigned char) str[0]] & URIT_CHAR_VARCHAR) || urit_ispct(str);
+}
+
+/**
+ * Loads a list literal such as ("a","b") in one pass. Items are copied a run
+ * at a time between quotes and escapes straight into a pool sized for the
+ * whole literal, which is trimmed to what was used at the end.
+ */
+static UritList *
+urit_compilelistvar(char *varvalue)
+{
+	const char *end = varvalue + strlen(varvalue);
+	const char *str = varvalue + 1;
+	UritList *list = urit_newlist();
+	size_t len;
+
+	list->pool = URIT_MALLOC(end - varvalue);
+	list->poolsize = end - varvalue;
+	urit_growlist(list, urit_countquotes(str, end) / 2, 0);
+	do {
+		if (!urit_skipto(&str, end, '"') || !(str = urit_scanquoted(str, end, list->pool + list->poollen, &len))) {
+			urit_freelist(list);
+			return NULL;
+		}
+		urit_growlist(list, 1, 0);
+		list->offsets[list->count] = list->poollen;
+		list->lens[list->count++] = len;
+		list->poollen += len + 1;
+	} while (urit_skipto(&str, end, ','));
+
+	if (!urit_skipto(&str, end, ')') || str != end) {
+		urit_freelist(list);
+		return NULL;
+	}
+	list->pool = URIT_REALLOC(list->pool, list->poollen);
+	list->poolsize = list->poollen;
+	return list;
+}
+
+/**
+ * Loads a map literal such as [("k","v")] the same way as a list literal
+ */
+static UritMap *
+urit_compilemapvar(char *varvalue)
+{
+	const char *end = varvalue + strlen(varvalue);
+	const char *str = varvalue + 1;
+	UritMap *map = urit_newmap();
+	size_t keylen;
+	size_t vallen;
+
+	map->pool = URIT_MALLOC(end - varvalue);
+	map->poolsize = end - varvalue;
+	urit_growmap(map, urit_countquotes(str, end) / 4, 0);
+	if (urit_skipto(&str, end, ']')) {
+		if (str != end) {
+			urit_freemap(map);
+			return NULL;
+		}
+		return map;
+	}
+	do {
+		char *key = map->pool + map->poollen;
+		char *val = NULL;
+
+		if (!urit_skipto(&str, end, '(') || !urit_skipto(&str, end, '"') ||
+			!(str = urit_scanquoted(str, end, key, &keylen)) ||
+			!urit_skipto(&str, end, ',') || !urit_skipto(&str, end, '"') ||
+			!(str = urit_scanquoted(str, end, val = key + keylen + 1, &vallen)) ||
+			!urit_skipto(&str, end, ')')) {
+			urit_freemap(map);
+			return NULL;
+		}
+		urit_growmap(map, 1, 0);
+		map->keyoffsets[map->count] = key - map->pool;
+		map->keylens[map->count] = keylen;
+		map->valoffsets[map->count] = val - map->pool;
+		map->vallens[map->count++] = vallen;
+		map->poollen += keylen + vallen + 2;
+	} while (urit_skipto(&str, end, ','));
+
+	if (!urit_skipto(&str, end, ']') || str != end) {
+		urit_freemap(map);
+		return NULL;
+	}
+	map->pool = URIT_REALLOC(map->pool, map->poollen);
+	map->poolsize = map->poollen;
+	return map;
+}
+
+/**
+ * Skips the spaces at *str and steps over c if it comes next
+ */
+static bool
+urit_skipto(const char **str, const char *end, char c)
+{
+	while (*str < end && **str == ' ') {
+		(*str)++;
+	}
+	if (*str == end || **str != c) {
+		return false;
+	}
+	(*str)++;
+	return true;
+}
+
+/**
+ * Copies the quoted string starting after its opening quote at str to dst,
+ * dropping the backslash of every escape, and stores its length. Returns
+ * the character after the closing quote, or NULL if there is none.
+ */
+static const char *
+urit_scanquoted(const char *str, const char *end, char *dst, size_t *len)
+{
+	size_t n = 0;
+
+	for (;;) {
+		const char *stop = urit_findquote(str, end);
+
+		memcpy(dst + n, str, stop - str);
+		n += stop - str;
+		if (stop == end || (*stop == '\\' && stop + 1 == end)) {
+			return NULL;
+		}
+		if (*stop == '"') {
+			dst[n] = '\0';
+			*len = n;
+			return stop + 1;
+		}
+		dst[n++] = stop[1];
+		str = stop + 2;
+	}
+}
+
+/**
+ * Counts the quotes between str and end that are not escaped, which for a
+ * well-formed literal is twice the number of strings in it
+ */
+static size_t
+urit_countquotes(const char *str, const char *end)
+{
+	size_t count = 0;
+
+	while ((str = urit_findquote(str, end)) < end) {
+		if (*str == '"') {
+			count++;
+			str++;
+		} else {
+			str += 2;
+		}
+	}
+	return count;
+}
+
+/**
+ * Returns the first quote or backslash between str and end, or end
+ */
+static const char *
+urit_findquote(const char *str, const char *end)
+{
+#ifdef __SSE2__
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+
+	for (; end - str >= 16; str += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) str);
+		unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+
+		if (mask) {
+			return str + __builtin_ctz(mask);
+		}
+	}
+#endif
+	while (str < end && *str != '"' && *str != '\\') {
+		str++;
+	}
+	return str;
+}
+
+static UritString *
+urit_appendbytes(UritString *des, const char *src, size_t len)
+{
+	size_t min = sizeof(char) * (des->len + len + 1);
+
+	if (des->size < min) {
+		if (des->fixed) {
+			return urit_appendtruncated(des, src, len);
+		}
+		urit_growstring(des, min);
+	}
+	memcpy(des->str + des->len, src, len);
+	des->len += len;
+	des->str[des->len] = '\0';
+
+	return des;
+}
+
+static UritString *
+urit_appendchar(UritString *des, char src)
+{
+	if (des->size < des->len + 2) {
+		if (des->fixed) {
+			return urit_appendtruncated(des, &src, 1);
+		}
+		urit_growstring(des, des->len + 2);
+	}
+	des->str[des->len++] = src;
+	des->str[des->len] = '\0';
+
+	return des;
+}
+
+/**
+ * Grows des to hold at least min bytes, at least doubling its size so that
+ * appending is amortized O(1)
+ */
+static void
+urit_growstring(UritString *des, size_t min)
+{
+	size_t size = des->size * 2 > URIT_MIN_STRING ? des->size * 2 : URIT_MIN_STRING;
+
+	if (size < min) {
+		size = min;
+	}
+	if (des->ctx) {
+		des->str = urit_arenarealloc(des->ctx, des->str, des->size, size);
+	} else {
+		des->str = URIT_REALLOC(des->str, size);
+	}
+	des->size = size;
+}
+
+/**
+ * Appends to a fixed string that has run out of room: whatever still fits is
+ * copied and the length keeps counting, so it ends up as the size needed
+ */
+static UritString *
+urit_appendtruncated(UritString *des, const char *src, size_t len)
+{
+	if (des->len + 1 < des->size) {
+		memcpy(des->str + des->len, src, des->size - des->len - 1);
+		des->str[des->size - 1] = '\0';
+	}
+	des->len += len;
+
+	return des;
+}
+
+static UritString *
+urit_appendpct(UritString *des, const unsigned char c)
+{
+	char pct[3] = {'%', urit_hexdigits[c >> 4], urit_hexdigits[c & 0x0F]};
+
+	return urit_appendbytes(des, pct, 3);
+}
+
+/**
+ * Appends the first len bytes of str to des, percent-encoded by
+ * urit_encodebytes. When the result does not fit, des grows to its full
+ * length and str is encoded again, unless des is fixed.
+ */
+static void
+urit_encode(UritString *des, const char *str, size_t len, bool allowreserved, size_t max)
+{
+	size_t start = des->len;
+
+	des->len = urit_encodebytes(des->str, des->size, start, str, len, allowreserved, max);
+
+	if (des->len >= des->size && !des->fixed) {
+		urit_growstring(des, des->len + 1);
+		des->len = urit_encodebytes(des->str, des->size, start, str, len, allowreserved, max);
+	}
+	if (des->size) {
+		des->str[des->len < des->size ? des->len : des->size - 1] = '\0';
+	}
+}
+
+static UritOpRule
+urit_getoprule(char c)
+{
+	UritOpRule oprule = {'\0', '\0', ',', false, '\0', false};
+
+	switch (c) {
+		case '#':
+			oprule.first = true;
+		case '+':
+			oprule.allow = true;
+			oprule.op = c;
+			break;
+		case ';':
+			oprule.named = true;
+		case '.':
+		case '/':
+			oprule.first = true;
+			oprule.sep = c;
+			oprule.op = c;
+			break;
+		case '?':
+		case '&':
+			oprule.first = true;
+			oprule.sep = '&';
+			oprule.named = true;
+			oprule.ifemp = true;
+			oprule.op = c;
+			break;
+	}
+	return oprule;
+}
+
+static UritVar *
+urit_getvar(const UritVars *vars, const char *name, size_t len)
+{
+	if (!vars->count) {
+		return NULL;
+	}
+	return urit_findvar(vars, name, len, urit_hash(name, len));
+}
+
+/**
+ * Looks up the variable called name when the hash of its name is known
+ */
+static UritVar *
+urit_findvar(const UritVars *vars, const char *name, size_t len, size_t hash)
+{
+	if (!vars->count) {
+		return NULL;
+	}
+	size_t slot = hash & vars->mask;
+	UritVar *var;
+
+	while ((var = vars->table[slot])) {
+		if (var->hash == hash && strncmp(var->name, name, len) == 0 && var->name[len] == '\0') {
+			return var;
+		}
+		slot = (slot + 1) & vars->mask;
+	}
+	return NULL;
+}
+
+static bool
+urit_isfatal(UritCode code)
+{
+	return code == URIT_MALFORMED_EXPRESSION || code == URIT_NONLITERAL_FOUND;
+}
+
+/**
+ * Copies the literal text at tpl + *i into lit, validating and encoding it,
+ * until the next expression or the end of the template (tpllen bytes long).
+ * Runs that need neither validation nor encoding are found with
+ * urit_saferun and copied whole. *i is the byte and
+ * *j the character offset into tpl; both are left just past the expression.
+ * expr and exprlen receive the body of the expression between its braces and
+ * pos the position of its opening brace, or expr is NULL at the end.
+ * Any other code reports an error at pos. Unless it is fatal, scanning can
+ * carry on from where it stopped.
+ */
+static UritCode
+urit_scanliteral(const char *tpl, size_t tpllen, size_t *i, size_t *j, UritString *lit, const char **expr, size_t *exprlen, size_t *pos)
+{
+	const char *exprend;
+	size_t numbytes;
+	size_t len;
+	char curr;
+
+	*expr = NULL;
+
+	while ((curr = tpl[*i])) {
+		*pos = *j;
+
+		if ((len = urit_saferun(tpl + *i, tpllen - *i, true))) {
+			urit_appendbytes(lit, tpl + *i, len);
+			*i += len;
+			*j += len;
+		} else if (curr == '{') {
+			exprend = memchr(tpl + *i, '}', tpllen - *i);
+
+			if (exprend == NULL) {
+				return URIT_MALFORMED_EXPRESSION;
+			}
+			len = exprend - (tpl + *i) - 1;
+			*i += len + 2;
+			*j += len + 2;
+
+			if (len == 0) {
+				urit_appendbytes(lit, "{}", 2);
+				return URIT_EMPTY_EXPRESSION;
+			}
+			if (!urit_getoprule(exprend[-len]).op && !urit_isvarchar(exprend - len)) {
+				urit_appendbytes(lit, exprend - len - 1, len + 2);
+				(*pos)++;
+				return URIT_UNIMPLEMENTED_OPERATOR;
+			}
+			*expr = exprend - len;
+			*exprlen = len;
+			return URIT_OK;
+		} else if (urit_ispct(tpl + *i)) {
+			urit_appendbytes(lit, tpl + *i, 3);
+			*i += 3;
+			*j += 3;
+		} else if ((numbytes = urit_numbytes(curr)) > 1 && urit_isutf8(tpl + *i, numbytes) && urit_isliteral(tpl + *i)) {
+			for (size_t k = 0; k < numbytes; k++, (*i)++) {
+				urit_appendpct(lit, tpl[*i]);
+			}
+			(*j)++;
+		} else {
+			return URIT_NONLITERAL_FOUND;
+		}
+	}
+	return URIT_OK;
+}
+
+/**
+ * Parses the next varspec of an expression body, moving *expr past it.
+ * Empty varspecs are skipped and spec->len is 0 once none are left. The name
+ * in spec points into the body rather than being copied. On an invalid
+ * varspec pos is left at the offending character.
+ */
+static UritCode
+urit_nextvarspec(const char **expr, const char *end, UritVarSpec *spec, size_t *pos)
+{
+	const char *curr;
+	const char *nameend = NULL;
+	size_t digits = 0;
+	bool colon = false;
+	bool namestate = true;
+	bool dot = true;
+
+	while (*expr < end && **expr == ',') {
+		(*expr)++;
+		(*pos)++;
+	}
+	spec->name = *expr;
+	spec->len = 0;
+	spec->expl = false;
+	spec->prefix = 0;
+	spec->slot = URIT_NOSLOT;
+
+	for (curr = *expr; curr < end && *curr != ','; curr++, (*pos)++) {
+		if (namestate) {
+			if (*curr == '.') {
+				if (dot) {
+					return URIT_INVALID_VARNAME;
+				}
+				dot = true;
+			} else if (*curr == '*' || *curr == ':') {
+				if (dot) {
+					return URIT_INVALID_VARNAME;
+				}
+				spec->expl = *curr == '*';
+				colon = *curr == ':';
+				namestate = false;
+				nameend = curr;
+			} else if (!urit_isvarchar(curr)) {
+				return URIT_INVALID_VARNAME;
+			} else {
+				dot = false;
+			}
+		} else {
+			if (*curr == ':') {
+				if (colon) {
+					return URIT_MALFORMED_EXPRESSION;
+				}
+				colon = true;
+			} else if (colon) {
+				if (!isdigit(*curr) || (!digits && *curr == '0') || digits == 4) {
+					return URIT_MALFORMED_EXPRESSION;
+				}
+				spec->prefix = spec->prefix * 10 + (*curr - '0');
+				digits++;
+			} else {
+				return URIT_MALFORMED_EXPRESSION;
+			}
+		}
+	}
+	spec->len = (nameend ? nameend : curr) - spec->name;
+	*expr = curr;
+
+	return URIT_OK;
+}
+
+static UritPart *
+urit_addpart(UritTemplate *tpl, UritPartType type, size_t pos)
+{
+	tpl->parts = URIT_REALLOC(tpl->parts, sizeof(UritPart) * ++tpl->count);
+	UritPart *part = &tpl->parts[tpl->count - 1];
+
+	part->type = type;
+	part->pos = pos;
+	part->len = 0;
+	part->str = NULL;
+	part->count = 0;
+	part->varspecs = NULL;
+	part->oprule = (UritOpRule) {0};
+
+	return part;
+}
+
+/**
+ * Moves any pending literal text into a new literal part of the template
+ */
+static void
+urit_flushliteral(UritTemplate *tpl, UritString *lit, size_t pos)
+{
+	if (!lit->len) {
+		return;
+	}
+	UritPart *part = urit_addpart(tpl, URIT_LITERAL, pos - lit->len);
+
+	part->len = lit->len;
+	part->str = URIT_MALLOC(sizeof(char) * (lit->len + 1));
+	memcpy(part->str, lit->str, lit->len + 1);
+
+	lit->len = 0;
+	lit->str[0] = '\0';
+}
+
+/**
+ * Expands tpl with its bytecode, or by walking its parts when it has none
+ */
+static void
+urit_expandtemplate(const UritTemplate *tpl, const UritVars *vars, UritString *des)
+{
+	if (tpl->code) {
+		urit_run(tpl->code, vars, des);
+		return;
+	}
+	for (size_t i = 0; i < tpl->count; i++) {
+		urit_expandpart(&tpl->parts[i], vars, des);
+	}
+}
+
+static void
+urit_expandpart(const UritPart *part, const UritVars *vars, UritString *des)
+{
+	if (part->type == URIT_LITERAL) {
+		urit_appendbytes(des, part->str, part->len);
+	} else {
+		bool firstappend = true;
+
+		for (size_t k = 0; k < part->count; k++) {
+			urit_expandvarspec(&part->oprule, &part->varspecs[k], vars, des, &firstappend);
+		}
+	}
+}
+
+/**
+ * Emits the bytecode of tpl. Each literal becomes URIT_OP_LITERAL and each
+ * expression URIT_OP_BEGIN and one URIT_OP_VAR per varspec, whose handlers
+ * are chosen here from the explode modifier and the operator instead of
+ * being branched on for every value expanded.
+ */
+static void
+urit_assemble(UritTemplate *tpl)
+{
+	size_t count = 1;
+
+	for (size_t i = 0; i < tpl->count; i++) {
+		count += tpl->parts[i].type == URIT_LITERAL ? 1 : tpl->parts[i].count + 1;
+	}
+	UritInstr *ip = tpl->code = URIT_CALLOC(count, sizeof(UritInstr));
+
+	for (size_t i = 0; i < tpl->count; i++) {
+		const UritPart *part = &tpl->parts[i];
+
+		if (part->type == URIT_LITERAL) {
+			ip->opcode = URIT_OP_LITERAL;
+			ip->str = part->str;
+			ip->len = part->len;
+			ip++;
+			continue;
+		}
+		bool named = part->oprule.named;
+		ip++->opcode = URIT_OP_BEGIN;
+
+		for (size_t k = 0; k < part->count; k++) {
+			const UritVarSpec *spec = &part->varspecs[k];
+
+			ip->opcode = URIT_OP_VAR;
+			ip->handlers[URIT_STRING] = named ? URIT_OP_STRING_NAMED : URIT_OP_STRING;
+			if (spec->expl) {
+				ip->handlers[URIT_LIST] = named ? URIT_OP_LIST_EXPLODED_NAMED : URIT_OP_LIST_EXPLODED;
+				ip->handlers[URIT_MAP] = named ? URIT_OP_MAP_KV_NAMED : URIT_OP_MAP_KV;
+			} else {
+				ip->handlers[URIT_LIST] = named ? URIT_OP_LIST_NAMED : URIT_OP_LIST;
+				ip->handlers[URIT_MAP] = named ? URIT_OP_MAP_NAMED : URIT_OP_MAP;
+			}
+			ip->oprule = part->oprule;
+			ip->prefix = spec->prefix;
+			ip->hash = urit_hash(spec->name, spec->len);
+			ip->str = spec->name;
+			ip->len = spec->len;
+			ip++;
+		}
+	}
+	ip->opcode = URIT_OP_END;
+}
+
+/**
+ * Runs bytecode emitted by urit_assemble, appending the URI to des. With GCC
+ * and Clang each handler jumps straight to the next through a table of label
+ * addresses; elsewhere, or with URIT_NO_COMPUTED_GOTO defined, a switch is
+ * used instead.
+ */
+static void
+urit_run(const UritInstr *ip, const UritVars *vars, UritString *des)
+{
+#ifdef URIT_COMPUTED_GOTO
+	static void *const urit_labels[] = {
+		&&URIT_OP_END, &&URIT_OP_LITERAL, &&URIT_OP_BEGIN, &&URIT_OP_VAR,
+		&&URIT_OP_STRING, &&URIT_OP_STRING_NAMED,
+		&&URIT_OP_LIST, &&URIT_OP_LIST_NAMED, &&URIT_OP_LIST_EXPLODED, &&URIT_OP_LIST_EXPLODED_NAMED,
+		&&URIT_OP_MAP, &&URIT_OP_MAP_NAMED, &&URIT_OP_MAP_KV, &&URIT_OP_MAP_KV_NAMED
+	};
+#else
+	uint8_t opcode;
+#endif
+	const UritVar *var = NULL;
+	bool firstappend = true;
+	size_t len;
+	const char *item;
+	UritPair pair;
+
+	URIT_DISPATCH(ip->opcode);
+#ifndef URIT_COMPUTED_GOTO
+dispatch:
+	switch (opcode) {
+#endif
+	URIT_TARGET(URIT_OP_END):
+		return;
+	URIT_TARGET(URIT_OP_LITERAL):
+		urit_appendbytes(des, ip->str, ip->len);
+		URIT_DISPATCH((++ip)->opcode);
+	URIT_TARGET(URIT_OP_BEGIN):
+		firstappend = true;
+		URIT_DISPATCH((++ip)->opcode);
+	URIT_TARGET(URIT_OP_VAR):
+		if ((var = urit_findvar(vars, ip->str, ip->len, ip->hash)) == NULL) {
+			URIT_DISPATCH((++ip)->opcode);
+		}
+		if (firstappend) {
+			if (ip->oprule.first) {
+				urit_appendchar(des, ip->oprule.op);
+			}
+			firstappend = false;
+		} else {
+			urit_appendchar(des, ip->oprule.sep);
+		}
+		URIT_DISPATCH(ip->handlers[var->type]);
+	URIT_TARGET(URIT_OP_STRING):
+		urit_encode(des, var->val_string, var->len, ip->oprule.allow, ip->prefix);
+		URIT_DISPATCH((++ip)->opcode);
+	URIT_TARGET(URIT_OP_STRING_NAMED):
+		urit_appendbytes(des, ip->str, ip->len);
+		urit_appendnamedvalue(des, var->val_string, var->len, &ip->oprule, ip->prefix);
+		URIT_DISPATCH((++ip)->opcode);
+	URIT_TARGET(URIT_OP_LIST_NAMED):
+		urit_appendbytes(des, ip->str, ip->len);
+		if (!var->val_list->count) {
+			if (ip->oprule.ifemp) {
+				urit_appendchar(des, '=');
+			}
+			URIT_DISPATCH((++ip)->opcode);
+		}
+		urit_appendchar(des, '=');
+		/* fall through */
+	URIT_TARGET(URIT_OP_LIST):
+		for (size_t k = 0; k < var->val_list->count; k++) {
+			item = urit_listitem(var->val_list, k, &len);
+			if (k) {
+				urit_appendchar(des, ',');
+			}
+			urit_encode(des, item, len, ip->oprule.allow, ip->prefix);
+		}
+		URIT_DISPATCH((++ip)->opcode);
+	URIT_TARGET(URIT_OP_LIST_EXPLODED):
+		for (size_t k = 0; k < var->val_list->count; k++) {
+			item = urit_listitem(var->val_list, k, &len);
+			if (k) {
+				urit_appendchar(des, ip->oprule.sep);
+			}
+			urit_encode(des, item, len, ip->oprule.allow, ip->prefix);
+		}
+		URIT_DISPATCH((++ip)->opcode);
+	URIT_TARGET(URIT_OP_LIST_EXPLODED_NAMED):
+		for (size_t k = 0; k < var->val_list->count; k++) {
+			item = urit_listitem(var->val_list, k, &len);
+			if (k) {
+				urit_appendchar(des, ip->oprule.sep);
+			}
+			urit_appendbytes(des, ip->str, ip->len);
+			urit_appendnamedvalue(des, item, len, &ip->oprule, ip->prefix);
+		}
+		URIT_DISPATCH((++ip)->opcode);
+	URIT_TARGET(URIT_OP_MAP_NAMED):
+		urit_appendbytes(des, ip->str, ip->len);
+		if (!var->val_map->count) {
+			if (ip->oprule.ifemp) {
+				urit_appendchar(des, '=');
+			}
+			URIT_DISPATCH((++ip)->opcode);
+		}
+		urit_appendchar(des, '=');
+		/* fall through */
+	URIT_TARGET(URIT_OP_MAP):
+		for (size_t k = 0; k < var->val_map->count; k++) {
+			pair = urit_mapitem(var->val_map, k);
+			if (k) {
+				urit_appendchar(des, ',');
+			}
+			urit_encode(des, pair.key, pair.keylen, ip->oprule.allow, ip->prefix);
+			urit_appendchar(des, ',');
+			urit_encode(des, pair.val, pair.vallen, ip->oprule.allow, ip->prefix);
+		}
+		URIT_DISPATCH((++ip)->opcode);
+	URIT_TARGET(URIT_OP_MAP_KV):
+		for (size_t k = 0; k < var->val_map->count; k++) {
+			pair = urit_mapitem(var->val_map, k);
+			if (k) {
+				urit_appendchar(des, ip->oprule.sep);
+			}
+			urit_encode(des, pair.key, pair.keylen, ip->oprule.allow, ip->prefix);
+			urit_appendchar(des, '=');
+			urit_encode(des, pair.val, pair.vallen, ip->oprule.allow, ip->prefix);
+		}
+		URIT_DISPATCH((++ip)->opcode);
+	URIT_TARGET(URIT_OP_MAP_KV_NAMED):
+		for (size_t k = 0; k < var->val_map->count; k++) {
+			pair = urit_mapitem(var->val_map, k);
+			if (k) {
+				urit_appendchar(des, ip->oprule.sep);
+			}
+			urit_encode(des, pair.key, pair.keylen, ip->oprule.allow, ip->prefix);
+			urit_appendnamedvalue(des, pair.val, pair.vallen, &ip->oprule, ip->prefix);
+		}
+		URIT_DISPATCH((++ip)->opcode);
+#ifndef URIT_COMPUTED_GOTO
+	}
+#endif
+}
+
+/**
+ * Replaces the output of part i of an expansion with the len bytes at str,
+ * moving what follows it and the offsets of the later parts
+ */
+static void
+urit_splice(UritExpansion *exp, size_t i, const char *str, size_t len)
+{
+	UritString *uri = exp->uri;
+	size_t start = exp->offsets[i];
+	size_t oldend = exp->offsets[i + 1];
+	size_t newlen = uri->len - (oldend - start) + len;
+
+	if (uri->size < newlen + 1) {
+		urit_growstring(uri, newlen + 1);
+	}
+	memmove(uri->str + start + len, uri->str + oldend, uri->len - oldend + 1);
+	memcpy(uri->str + start, str, len);
+	uri->len = newlen;
+	for (size_t k = i + 1; k <= exp->tpl->count; k++) {
+		exp->offsets[k] = exp->offsets[k] - oldend + start + len;
+	}
+}
+
+/**
+ * Like urit_expandtemplate, but takes each variable from the slot its
+ * varspec was bound to. Slots left empty are undefined.
+ */
+static void
+urit_expandbound(const UritTemplate *tpl, const UritSlots *slots, UritString *des)
+{
+	for (size_t i = 0; i < tpl->count; i++) {
+		const UritPart *part = &tpl->parts[i];
+
+		if (part->type == URIT_LITERAL) {
+			urit_appendbytes(des, part->str, part->len);
+		} else {
+			bool firstappend = true;
+
+			for (size_t k = 0; k < part->count; k++) {
+				size_t slot = part->varspecs[k].slot;
+
+				if (slot < slots->count && slots->values[slot].val_string) {
+					urit_expandvar(&part->oprule, &part->varspecs[k], &slots->values[slot], des, &firstappend);
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Expands tpl into des in a single pass without compiling it. Errors are
+ * added to res when it is not NULL and the first one is stored in first when
+ * that is not NULL. Returns false if a fatal error stopped the expansion.
+ */
+static bool
+urit_expandstream(const char *tpl, const UritVars *vars, UritString *des, UritResult *res, UritCode *first)
+{
+	const char *expr;
+	size_t tpllen = strlen(tpl);
+	size_t exprlen;
+	size_t pos;
+	size_t i = 0;
+	size_t j = 0;
+	UritCode code;
+
+	if (first) {
+		*first = URIT_OK;
+	}
+	while ((code = urit_scanliteral(tpl, tpllen, &i, &j, des, &expr, &exprlen, &pos)) != URIT_OK || expr) {
+		if (code == URIT_OK) {
+			code = urit_expandbody(expr, exprlen, &pos, vars, des);
+		}
+		if (code == URIT_OK) {
+			continue;
+		}
+		if (res) {
+			urit_adderror(res, pos, code);
+		}
+		if (first && *first == URIT_OK) {
+			*first = code;
+		}
+		if (urit_isfatal(code)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Expands an expression body straight from the template, parsing each varspec
+ * as it goes. Varspecs before an invalid one are still expanded.
+ */
+static UritCode
+urit_expandbody(const char *expr, size_t len, size_t *pos, const UritVars *vars, UritString *des)
+{
+	UritOpRule oprule = urit_getoprule(*expr);
+	const char *end = expr + len;
+	bool firstappend = true;
+	UritVarSpec spec;
+	UritCode code;
+
+	(*pos)++;
+	if (oprule.op) {
+		expr++;
+		(*pos)++;
+	}
+	while ((code = urit_nextvarspec(&expr, end, &spec, pos)) == URIT_OK && spec.len) {
+		urit_expandvarspec(&oprule, &spec, vars, des, &firstappend);
+	}
+	return code;
+}
+
+/**
+ * Appends "=value" for a named operator, or just "=" for an empty value
+ * when the operator asks for it
+ */
+static void
+urit_appendnamedvalue(UritString *des, const char *val, size_t len, const UritOpRule *oprule, size_t prefix)
+{
+	if (len) {
+		urit_appendchar(des, '=');
+		urit_encode(des, val, len, oprule->allow, prefix);
+	} else if (oprule->ifemp) {
+		urit_appendchar(des, '=');
+	}
+}
+
+static void
+urit_expandvarspec(const UritOpRule *oprule, const UritVarSpec *spec, const UritVars *vars, UritString *des, bool *firstappend)
+{
+	UritVar *var = urit_getvar(vars, spec->name, spec->len);
+
+	if (var) {
+		urit_expandvar(oprule, spec, var, des, firstappend);
+	}
+}
+
+/**
+ * Appends the expansion of one varspec whose variable has been resolved
+ */
+static void
+urit_expandvar(const UritOpRule *oprule, const UritVarSpec *spec, const UritVar *var, UritString *des, bool *firstappend)
+{
+	size_t count;
+
+	if (*firstappend) {
+		if (oprule->first) {
+			urit_appendchar(des, oprule->op);
+		}
+		*firstappend = false;
+	} else {
+		urit_appendchar(des, oprule->sep);
+	}
+
+	if (var->type == URIT_STRING) {
+		if (oprule->named) {
+			urit_appendbytes(des, spec->name, spec->len);
+			urit_appendnamedvalue(des, var->val_string, var->len, oprule, spec->prefix);
+		} else {
+			urit_encode(des, var->val_string, var->len, oprule->allow, spec->prefix);
+		}
+	} else if (!spec->expl) {
+		count = var->type == URIT_LIST ? var->val_list->count : var->val_map->count;
+
+		if (oprule->named) {
+			urit_appendbytes(des, spec->name, spec->len);
+
+			if (!count) {
+				if (oprule->ifemp) {
+					urit_appendchar(des, '=');
+				}
+				return;
+			}
+			urit_appendchar(des, '=');
+		}
+		for (size_t k = 0; k < count; k++) {
+			if (var->type == URIT_LIST) {
+				size_t len;
+				const char *item = urit_listitem(var->val_list, k, &len);
+
+				urit_encode(des, item, len, oprule->allow, spec->prefix);
+			} else {
+				UritPair pair = urit_mapitem(var->val_map, k);
+
+				urit_encode(des, pair.key, pair.keylen, oprule->allow, spec->prefix);
+				urit_appendchar(des, ',');
+				urit_encode(des, pair.val, pair.vallen, oprule->allow, spec->prefix);
+			}
+			if (k + 1 < count) {
+				urit_appendchar(des, ',');
+			}
+		}
+	} else if (var->type == URIT_LIST) {
+		UritList *list = var->val_list;
+
+		for (size_t k = 0; k < list->count; k++) {
+			size_t len;
+			const char *item = urit_listitem(list, k, &len);
+
+			if (oprule->named) {
+				urit_appendbytes(des, spec->name, spec->len);
+				urit_appendnamedvalue(des, item, len, oprule, spec->prefix);
+			} else {
+				urit_encode(des, item, len, oprule->allow, spec->prefix);
+			}
+			if (k + 1 < list->count) {
+				urit_appendchar(des, oprule->sep);
+			}
+		}
+	} else {
+		UritMap *map = var->val_map;
+
+		for (size_t k = 0; k < map->count; k++) {
+			UritPair pair = urit_mapitem(map, k);
+
+			urit_encode(des, pair.key, pair.keylen, oprule->allow, spec->prefix);
+			if (oprule->named) {
+				urit_appendnamedvalue(des, pair.val, pair.vallen, oprule, spec->prefix);
+			} else {
+				urit_appendchar(des, '=');
+				urit_encode(des, pair.val, pair.vallen, oprule->allow, spec->prefix);
+			}
+			if (k + 1 < map->count) {
+				urit_appendchar(des, oprule->sep);
+			}
+		}
+	}
+}
+
+/**
+ * Finds the first occurrence of the len bytes of lit that starts before end
+ */
+static const char *
+urit_findliteral(const char *str, const char *end, const char *lit, size_t len)
+{
+	while ((str = memchr(str, *lit, end - str))) {
+		if (strncmp(str, lit, len) == 0) {
+			return str;
+		}
+		str++;
+	}
+	return NULL;
+}
+
+/**
+ * Skips the characters an expression without reserved expansion could have
+ * produced: its operator, unreserved characters, percent-encoded triplets
+ * and the separators between its values
+ */
+static const char *
+urit_matchrun(const UritOpRule *oprule, const char *str, const char *end)
+{
+	if (oprule->first && str < end && *str == oprule->op) {
+		str++;
+	}
+	while (str < end && ((urit_charclass[(unsigned char) *str] & URIT_CHAR_UNRESERVED) ||
+		*str == '%' || *str == ',' || *str == '=' || *str == oprule->sep)) {
+		str++;
+	}
+	return str;
+}
+
+/**
+ * Works out where the text of an expression starting at str ends, looking
+ * only at the part that follows it. A final literal anchors at the end of
+ * the URI, any other literal at its first occurrence and a following
+ * expression at its operator.
+ */
+static const char *
+urit_matchextent(const UritPart *part, const UritPart *next, bool nextlast, const char *str, const char *end)
+{
+	const char *run = part->oprule.allow ? end : urit_matchrun(&part->oprule, str, end);
+	const char *found;
+
+	if (next == NULL) {
+		return run;
+	}
+	if (next->type == URIT_LITERAL) {
+		if (nextlast) {
+			found = (size_t) (end - str) >= next->len ? end - next->len : NULL;
+			return found && found <= run ? found : run;
+		}
+		found = urit_findliteral(str, (size_t) (end - run) > next->len ? run + next->len : end, next->str, next->len);
+		return found && found <= run ? found : run;
+	}
+	if (part->oprule.allow && next->oprule.first && str < end) {
+		found = memchr(str + 1, next->oprule.op, end - str - 1);
+		return found ? found : end;
+	}
+	return run;
+}
+
+/**
+ * Splits the text of an expression between str and stop back into values.
+ * Named values are told apart by name, the rest are handed out in varspec
+ * order, with an exploded varspec taking every value the varspecs after it
+ * do not need. Returns where the expression ended, which is before stop if
+ * the remaining text belongs to the next part. With out NULL nothing is
+ * decoded or allocated and only the end is worked out.
+ */
+static const char *
+urit_matchexpression(const UritPart *part, const char *str, const char *stop, UritVars *out)
+{
+	const UritOpRule *oprule = &part->oprule;
+	const char *start = str;
+	const char *item;
+	const char *itemend;
+	const char *eq;
+	size_t items = 1;
+	size_t expl = part->count;
+	size_t k = 0;
+	size_t open = part->count;
+	bool pairs = false;
+	UritList *list = NULL;
+	UritMap *map = NULL;
+
+	if (str == stop) {
+		return str;
+	}
+	if (oprule->first) {
+		if (*str != oprule->op) {
+			return str;
+		}
+		str++;
+	}
+	for (const char *c = str; (c = memchr(c, oprule->sep, stop - c)); c++) {
+		items++;
+	}
+	for (size_t i = 0; i < part->count; i++) {
+		if (part->varspecs[i].expl) {
+			expl = i;
+			break;
+		}
+	}
+
+	for (item = str; k < part->count || oprule->named; item = itemend + 1, items--) {
+		const UritVarSpec *spec;
+
+		itemend = memchr(item, oprule->sep, stop - item);
+		itemend = itemend ? itemend : stop;
+
+		if (oprule->named) {
+			eq = memchr(item, '=', itemend - item);
+			k = urit_findvarspec(part, item, eq ? eq - item : itemend - item);
+
+			if (k == part->count && expl == part->count) {
+				return item == str ? start : item - 1;
+			}
+			spec = &part->varspecs[k == part->count ? expl : k];
+			if (k == part->count) {
+				if (open != expl || map == NULL) {
+					map = out ? urit_newmap() : NULL;
+					list = NULL;
+					open = expl;
+					urit_addmatchvar(out, spec, NULL, map);
+				}
+				urit_addmatchpair(map, item, itemend);
+			} else if (spec->expl) {
+				if (open != k || list == NULL) {
+					list = out ? urit_newlist() : NULL;
+					map = NULL;
+					open = k;
+					urit_addmatchvar(out, spec, list, NULL);
+				}
+				urit_addmatchitem(list, eq ? eq + 1 : itemend, itemend);
+			} else {
+				urit_matchvalue(spec, eq ? eq + 1 : itemend, itemend, true, out);
+			}
+		} else {
+			spec = &part->varspecs[k];
+
+			if (spec->expl) {
+				eq = memchr(item, '=', itemend - item);
+				if (open != k) {
+					open = k;
+					pairs = eq != NULL;
+					list = out && !pairs ? urit_newlist() : NULL;
+					map = out && pairs ? urit_newmap() : NULL;
+					urit_addmatchvar(out, spec, list, map);
+				}
+				if (pairs && eq) {
+					urit_addmatchpair(map, item, itemend);
+				} else if (!pairs) {
+					urit_addmatchitem(list, item, itemend);
+				} else {
+					return item == str ? start : item - 1;
+				}
+				if (items <= part->count - k) {
+					k++;
+				}
+			} else if (k + 1 == part->count && items > 1) {
+				if (oprule->sep != ',') {
+					urit_matchvalue(spec, item, itemend, true, out);
+					return itemend;
+				}
+				urit_matchvalue(spec, item, stop, true, out);
+				return stop;
+			} else {
+				urit_matchvalue(spec, item, itemend, oprule->sep != ',', out);
+				k++;
+			}
+		}
+		if (itemend == stop) {
+			return stop;
+		}
+	}
+	return item - 1;
+}
+
+/**
+ * Returns the index of the varspec called name, or part->count
+ */
+static size_t
+urit_findvarspec(const UritPart *part, const char *name, size_t len)
+{
+	for (size_t i = 0; i < part->count; i++) {
+		if (part->varspecs[i].len == len && strncmp(part->varspecs[i].name, name, len) == 0) {
+			return i;
+		}
+	}
+	return part->count;
+}
+
+/**
+ * Adds the value between val and end as a string, or as a list when split
+ * is set and it holds commas
+ */
+static void
+urit_matchvalue(const UritVarSpec *spec, const char *val, const char *end, bool split, UritVars *out)
+{
+	if (out == NULL) {
+		return;
+	}
+	char *name = urit_copybytes(spec->name, spec->len);
+	const char *comma = split ? memchr(val, ',', end - val) : NULL;
+
+	if (comma == NULL) {
+		UritVar *var = urit_setvar(out, name, strlen(name), URIT_STRING);
+		var->val_string = URIT_MALLOC(sizeof(char) * (end - val + 1));
+		var->len = urit_decode(var->val_string, val, end - val);
+		urit_free(name);
+		return;
+	}
+	UritList *list = urit_newlist();
+
+	while (comma) {
+		urit_addmatchitem(list, val, comma);
+		val = comma + 1;
+		comma = memchr(val, ',', end - val);
+	}
+	urit_addmatchitem(list, val, end);
+	urit_varsaddlist(out, name, list);
+	urit_free(name);
+}
+
+/**
+ * Adds list or map to out under the name of spec
+ */
+static void
+urit_addmatchvar(UritVars *out, const UritVarSpec *spec, UritList *list, UritMap *map)
+{
+	if (out == NULL) {
+		return;
+	}
+	char *name = urit_copybytes(spec->name, spec->len);
+
+	if (list) {
+		urit_varsaddlist(out, name, list);
+	} else {
+		urit_varsaddmap(out, name, map);
+	}
+	urit_free(name);
+}
+
+/**
+ * Adds the decoded item between item and end to list
+ */
+static void
+urit_addmatchitem(UritList *list, const char *item, const char *end)
+{
+	if (list == NULL) {
+		return;
+	}
+	char *dec = urit_listpush(list, end - item);
+
+	list->lens[list->count - 1] = urit_decode(dec, item, end - item);
+}
+
+/**
+ * Adds the key=value item between item and end to map, the value being
+ * empty when there is no '='
+ */
+static void
+urit_addmatchpair(UritMap *map, const char *item, const char *end)
+{
+	if (map == NULL) {
+		return;
+	}
+	const char *eq = memchr(item, '=', end - item);
+	const char *keyend = eq ? eq : end;
+	const char *val = eq ? eq + 1 : end;
+	size_t i = urit_mappush(map, keyend - item, end - val);
+
+	map->keylens[i] = urit_decode(map->pool + map->keyoffsets[i], item, keyend - item);
+	map->vallens[i] = urit_decode(map->pool + map->valoffsets[i], val, end - val);
+}
+
+static char *
+urit_copybytes(const char *str, size_t len)
+{
+	char *copy = URIT_MALLOC(sizeof(char) * (len + 1));
+
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+	return copy;
+}
+
+/**
+ * Writes the len bytes at str to dec, which has room for len + 1, with
+ * every percent-encoded triplet decoded, and returns the decoded length
+ */
+static size_t
+urit_decode(char *dec, const char *str, size_t len)
+{
+	const char *end = str + len;
+	size_t n = 0;
+
+	while (str < end) {
+		if (*str == '%' && end - str >= 3 && urit_ispct(str)) {
+			const char *hi = strchr(urit_hexdigits, toupper((unsigned char) str[1]));
+			const char *lo = strchr(urit_hexdigits, toupper((unsigned char) str[2]));
+			dec[n++] = (char) ((hi - urit_hexdigits) << 4 | (lo - urit_hexdigits));
+			str += 3;
+		} else {
+			dec[n++] = *str++;
+		}
+	}
+	dec[n] = '\0';
+	return n;
+}
+
+/**
+ * Makes a node for the edge part. Literal labels are copied, expressions
+ * keep pointing at the varspecs of the template they came from.
+ */
+static UritRouteNode *
+urit_newroutenode(const UritPart *part)
+{
+	UritRouteNode *node = URIT_MALLOC(sizeof(UritRouteNode));
+
+	node->part = *part;
+	if (part->type == URIT_LITERAL) {
+		node->part.str = urit_copybytes(part->str ? part->str : "", part->len);
+	}
+	node->route = false;
+	node->id = 0;
+	node->literalcount = 0;
+	node->literals = NULL;
+	node->exprcount = 0;
+	node->exprs = NULL;
+	return node;
+}
+
+/**
+ * Binary searches the literal edges of node, which are kept sorted by their
+ * first byte, for the one starting with c. Returns its index or where it
+ * would be inserted.
+ */
+static size_t
+urit_findedge(const UritRouteNode *node, char c)
+{
+	size_t lo = 0;
+	size_t hi = node->literalcount;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if ((unsigned char) node->literals[mid]->part.str[0] < (unsigned char) c) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/**
+ * Follows the len bytes of str down the literal edges of node, splitting
+ * the edge where they part ways, and returns the node they end at
+ */
+static UritRouteNode *
+urit_insertliteral(UritRouteNode *node, const char *str, size_t len)
+{
+	while (len) {
+		size_t at = urit_findedge(node, *str);
+		UritRouteNode *child;
+		size_t common = 0;
+
+		if (at == node->literalcount || node->literals[at]->part.str[0] != *str) {
+			UritPart part = {URIT_LITERAL, 0, len, (char *) str};
+
+			child = urit_newroutenode(&part);
+			node->literals = URIT_REALLOC(node->literals, sizeof(UritRouteNode *) * (node->literalcount + 1));
+			memmove(node->literals + at + 1, node->literals + at, sizeof(UritRouteNode *) * (node->literalcount - at));
+			node->literals[at] = child;
+			node->literalcount++;
+			return child;
+		}
+		child = node->literals[at];
+
+		while (common < len && common < child->part.len && child->part.str[common] == str[common]) {
+			common++;
+		}
+		if (common < child->part.len) {
+			UritPart part = {URIT_LITERAL, 0, common, child->part.str};
+			UritRouteNode *mid = urit_newroutenode(&part);
+			char *rest = urit_copybytes(child->part.str + common, child->part.len - common);
+
+			urit_free(child->part.str);
+			child->part.str = rest;
+			child->part.len -= common;
+			mid->literals = URIT_MALLOC(sizeof(UritRouteNode *));
+			mid->literals[0] = child;
+			mid->literalcount = 1;
+			node->literals[at] = mid;
+			child = mid;
+		}
+		node = child;
+		str += common;
+		len -= common;
+	}
+	return node;
+}
+
+static UritRouteNode *
+urit_insertexpression(UritRouteNode *node, const UritPart *part)
+{
+	for (size_t i = 0; i < node->exprcount; i++) {
+		if (urit_samepart(&node->exprs[i]->part, part)) {
+			return node->exprs[i];
+		}
+	}
+	node->exprs = URIT_REALLOC(node->exprs, sizeof(UritRouteNode *) * (node->exprcount + 1));
+	node->exprs[node->exprcount] = urit_newroutenode(part);
+	return node->exprs[node->exprcount++];
+}
+
+/**
+ * Tells whether two expressions have the same operator and varspecs
+ */
+static bool
+urit_samepart(const UritPart *a, const UritPart *b)
+{
+	if (a->oprule.op != b->oprule.op || a->count != b->count) {
+		return false;
+	}
+	for (size_t i = 0; i < a->count; i++) {
+		const UritVarSpec *x = &a->varspecs[i];
+		const UritVarSpec *y = &b->varspecs[i];
+
+		if (x->expl != y->expl || x->prefix != y->prefix) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Tries to finish a match from node, whose edge ends just before str
+ */
+static bool
+urit_routefrom(const UritRouteNode *node, const char *str, const char *end, size_t *id)
+{
+	if (str == end && node->route) {
+		*id = node->id;
 		return true;
 	}
-	return false;
+	if (str < end) {
+		size_t at = urit_findedge(node, *str);
+
+		if (at < node->literalcount) {
+			const UritRouteNode *child = node->literals[at];
+
+			if ((size_t) (end - str) >= child->part.len && memcmp(str, child->part.str, child->part.len) == 0 &&
+				urit_routefrom(child, str + child->part.len, end, id)) {
+				return true;
+			}
+		}
+	}
+	for (size_t i = 0; i < node->exprcount; i++) {
+		if (urit_routeexpression(node->exprs[i], str, end, id)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Tries to finish a match from the expression edge node starting at str.
+ * The extent of the expression depends on what follows it, so it is worked
+ * out separately against each edge below node, the same way urit_match
+ * does against the next part. Routes that go on past the expression are
+ * tried before the one ending with it.
+ */
+static bool
+urit_routeexpression(const UritRouteNode *node, const char *str, const char *end, size_t *id)
+{
+	const char *stop;
+
+	for (size_t i = 0; i < node->literalcount; i++) {
+		const UritRouteNode *child = node->literals[i];
+		bool last = !child->literalcount && !child->exprcount;
+
+		stop = urit_matchextent(&node->part, &child->part, last, str, end);
+		stop = urit_matchexpression(&node->part, str, stop, NULL);
+		if ((size_t) (end - stop) >= child->part.len && memcmp(stop, child->part.str, child->part.len) == 0 &&
+			urit_routefrom(child, stop + child->part.len, end, id)) {
+			return true;
+		}
+	}
+	for (size_t i = 0; i < node->exprcount; i++) {
+		stop = urit_matchextent(&node->part, &node->exprs[i]->part, false, str, end);
+		stop = urit_matchexpression(&node->part, str, stop, NULL);
+		if (urit_routeexpression(node->exprs[i], stop, end, id)) {
+			return true;
+		}
+	}
+	if (node->route) {
+		stop = urit_matchextent(&node->part, NULL, false, str, end);
+		if (urit_matchexpression(&node->part, str, stop, NULL) == end) {
+			*id = node->id;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void
+urit_freeroutenode(UritRouteNode *node)
+{
+	for (size_t i = 0; i < node->literalcount; i++) {
+		urit_freeroutenode(node->literals[i]);
+	}
+	for (size_t i = 0; i < node->exprcount; i++) {
+		urit_freeroutenode(node->exprs[i]);
+	}
+	if (node->part.type == URIT_LITERAL) {
+		urit_free(node->part.str);
+	}
+	urit_free(node->literals);
+	urit_free(node->exprs);
+	urit_free(node);
+}
+
+/**
+ * Looks tpl up in the template cache, compiling and adding it on a miss.
+ * The entry returned is pinned until urit_cacherelease so it is not freed
+ * if evicted meanwhile. Returns NULL when the cache is off, without hashing
+ * tpl or taking the lock.
+ */
+static UritCacheEntry *
+urit_cacheget(const char *tpl)
+{
+	size_t hash;
+	UritCacheEntry *entry;
+	UritCacheEntry *found;
+	UritResult errors = {URIT_OK, NULL, NULL, (char *) tpl, NULL, NULL};
+
+	/* a relaxed load is enough, the lock is taken again before trusting it */
+	if (!__atomic_load_n(&urit_cache.stats.capacity, __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+	hash = urit_hash(tpl, strlen(tpl));
+	pthread_mutex_lock(&urit_cache.lock);
+	if (!urit_cache.stats.capacity) {
+		pthread_mutex_unlock(&urit_cache.lock);
+		return NULL;
+	}
+	if ((entry = urit_cachefind(tpl, hash))) {
+		urit_cache.stats.hits++;
+		if (entry != urit_cache.head) {
+			entry->prev->next = entry->next;
+			if (entry->next) {
+				entry->next->prev = entry->prev;
+			} else {
+				urit_cache.tail = entry->prev;
+			}
+			entry->prev = NULL;
+			entry->next = urit_cache.head;
+			urit_cache.head->prev = entry;
+			urit_cache.head = entry;
+		}
+		entry->refs++;
+		pthread_mutex_unlock(&urit_cache.lock);
+		return entry;
+	}
+	urit_cache.stats.misses++;
+	pthread_mutex_unlock(&urit_cache.lock);
+
+	entry = URIT_MALLOC(sizeof(UritCacheEntry));
+	entry->key = urit_copybytes(tpl, strlen(tpl));
+	entry->hash = hash;
+	entry->tpl = urit_compile(tpl, &errors);
+	entry->refs = 1;
+	entry->evicted = false;
+
+	if (errors.status != URIT_OK) {
+		urit_freetemplate(entry->tpl);
+		entry->tpl = NULL;
+		urit_freeresult(&errors);
+	}
+	pthread_mutex_lock(&urit_cache.lock);
+	if (!urit_cache.stats.capacity) {
+		entry->evicted = true;
+	} else if ((found = urit_cachefind(tpl, hash))) {
+		urit_freecacheentry(entry);
+		entry = found;
+		entry->refs++;
+	} else {
+		urit_cacheinsert(entry);
+	}
+	pthread_mutex_unlock(&urit_cache.lock);
+
+	return entry;
+}
+
+/**
+ * Returns the cached entry for tpl or NULL. Called with the lock held.
+ */
+static UritCacheEntry *
+urit_cachefind(const char *tpl, size_t hash)
+{
+	UritCacheEntry *entry = urit_cache.buckets[hash & urit_cache.mask];
+
+	while (entry && (entry->hash != hash || strcmp(entry->key, tpl) != 0)) {
+		entry = entry->chain;
+	}
+	return entry;
+}
+
+static void
+urit_cacherelease(UritCacheEntry *entry)
+{
+	pthread_mutex_lock(&urit_cache.lock);
+	if (--entry->refs == 0 && entry->evicted) {
+		urit_freecacheentry(entry);
+	}
+	pthread_mutex_unlock(&urit_cache.lock);
+}
+
+/**
+ * Puts entry at the front of the cache, evicting the least recently used
+ * entries beyond the capacity. Called with the lock held.
+ */
+static void
+urit_cacheinsert(UritCacheEntry *entry)
+{
+	UritCacheEntry **bucket = &urit_cache.buckets[entry->hash & urit_cache.mask];
+
+	entry->chain = *bucket;
+	*bucket = entry;
+	entry->prev = NULL;
+	entry->next = urit_cache.head;
+	if (urit_cache.head) {
+		urit_cache.head->prev = entry;
+	} else {
+		urit_cache.tail = entry;
+	}
+	urit_cache.head = entry;
+
+	if (++urit_cache.stats.count > urit_cache.stats.capacity) {
+		urit_cacheevict(urit_cache.tail);
+	}
+}
+
+/**
+ * Unlinks entry from the cache, freeing it unless it is pinned. Called
+ * with the lock held.
+ */
+static void
+urit_cacheevict(UritCacheEntry *entry)
+{
+	UritCacheEntry **link = &urit_cache.buckets[entry->hash & urit_cache.mask];
+
+	while (*link != entry) {
+		link = &(*link)->chain;
+	}
+	*link = entry->chain;
+
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		urit_cache.head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		urit_cache.tail = entry->prev;
+	}
+	urit_cache.stats.count--;
+	urit_cache.stats.evictions++;
+
+	entry->evicted = true;
+	if (!entry->refs) {
+		urit_freecacheentry(entry);
+	}
+}
+
+static void
+urit_freecacheentry(UritCacheEntry *entry)
+{
+	urit_freetemplate(entry->tpl);
+	urit_free(entry->key);
+	urit_free(entry);
+}
+
+static void *
+urit_stdalloc(size_t size, void *ctx)
+{
+	return malloc(size);
+}
+
+static void *
+urit_stdrealloc(void *ptr, size_t size, void *ctx)
+{
+	return realloc(ptr, size);
+}
+
+static void
+urit_stdfree(void *ptr, void *ctx)
+{
+	free(ptr);
+}
+
+/**
+ * Allocates size bytes, or resizes ptr to them, on behalf of the function
+ * site through the current allocator
+ */
+static void *
+urit_allocate(void *ptr, size_t size, const char *site)
+{
+	if (__atomic_load_n(&urit_allocator.counting, __ATOMIC_RELAXED)) {
+		urit_countallocation(site, size);
+	}
+	if (ptr) {
+		return urit_allocator.realloc(ptr, size, urit_allocator.ctx);
+	}
+	return urit_allocator.alloc(size, urit_allocator.ctx);
+}
+
+static void *
+urit_zeroalloc(size_t size, const char *site)
+{
+	void *ptr = urit_allocate(NULL, size, site);
+
+	if (ptr) {
+		memset(ptr, 0, size);
+	}
+	return ptr;
+}
+
+/**
+ * Adds an allocation of size bytes to the count of site, unless counting was
+ * stopped since urit_allocate looked at the flag. Sites are the __func__
+ * strings of the library, so they are told apart by address.
+ */
+static void
+urit_countallocation(const char *site, size_t size)
+{
+	size_t i = 0;
+
+	pthread_mutex_lock(&urit_allocator.lock);
+	if (!urit_allocator.counting) {
+		pthread_mutex_unlock(&urit_allocator.lock);
+		return;
+	}
+	while (i < urit_allocator.sites && urit_allocator.counts[i].function != site) {
+		i++;
+	}
+
+	if (i == urit_allocator.sites && i < URIT_ALLOC_SITES) {
+		urit_allocator.counts[i].function = site;
+		urit_allocator.counts[i].calls = 0;
+		urit_allocator.counts[i].bytes = 0;
+		urit_allocator.sites++;
+	}
+	if (i < URIT_ALLOC_SITES) {
+		urit_allocator.counts[i].calls++;
+		urit_allocator.counts[i].bytes += size;
+	}
+	pthread_mutex_unlock(&urit_allocator.lock);
+}
+
+static const char *
+urit_jsonspace(const char *str, const char *end)
+{
+	while (str < end && (*str == ' ' || *str == '\t' || *str == '\n' || *str == '\r')) {
+		str++;
+	}
+	return str;
+}
+
+/**
+ * Finds the end of the JSON string whose opening quote is at str, storing
+ * where its raw contents start, their length and whether they hold escapes.
+ * Returns the character after the closing quote, or NULL.
+ */
+static const char *
+urit_jsonstring(const char *str, const char *end, const char **raw, size_t *len, bool *escaped)
+{
+	const char *stop = ++str;
+
+	*escaped = false;
+	while ((stop = urit_findquote(stop, end)) < end && *stop == '\\') {
+		*escaped = true;
+		stop += 2;
+	}
+	if (stop >= end) {
+		return NULL;
+	}
+	*raw = str;
+	*len = stop - str;
+	return stop + 1;
+}
+
+/**
+ * Reads a string, number, true, false or null at str. A null leaves raw
+ * NULL. Returns the character after the value, or NULL.
+ */
+static const char *
+urit_jsonscalar(const char *str, const char *end, const char **raw, size_t *len, bool *escaped)
+{
+	const char *stop = str;
+
+	if (str == end) {
+		return NULL;
+	}
+	if (*str == '"') {
+		return urit_jsonstring(str, end, raw, len, escaped);
+	}
+	while (stop < end && (isalnum((unsigned char) *stop) || *stop == '-' || *stop == '+' || *stop == '.')) {
+		stop++;
+	}
+	*raw = str;
+	*len = stop - str;
+	*escaped = false;
+
+	if (*len == 4 && strncmp(str, "null", 4) == 0) {
+		*raw = NULL;
+	} else if (!(*len == 4 && strncmp(str, "true", 4) == 0) && !(*len == 5 && strncmp(str, "false", 5) == 0) &&
+		(*len == 0 || !(isdigit((unsigned char) *str) || *str == '-') || strspn(str, "0123456789+-.eE") < *len)) {
+		return NULL;
+	}
+	return stop;
+}
+
+/**
+ * Decodes the escapes in the len raw bytes of a JSON string into dst, which
+ * has room for len + 1 bytes since no escape decodes to more bytes than it
+ * takes up
+ */
+static bool
+urit_jsonunescape(char *dst, const char *raw, size_t len, size_t *declen)
+{
+	const char *end = raw + len;
+	size_t n = 0;
+
+	while (raw < end) {
+		const char *stop = memchr(raw, '\\', end - raw);
+
+		if (stop == NULL) {
+			stop = end;
+		}
+		memcpy(dst + n, raw, stop - raw);
+		n += stop - raw;
+		raw = stop;
+		if (raw == end) {
+			break;
+		}
+		switch (raw[1]) {
+			case '"': case '\\': case '/': dst[n++] = raw[1]; break;
+			case 'b': dst[n++] = '\b'; break;
+			case 'f': dst[n++] = '\f'; break;
+			case 'n': dst[n++] = '\n'; break;
+			case 'r': dst[n++] = '\r'; break;
+			case 't': dst[n++] = '\t'; break;
+			case 'u': {
+				unsigned cp = 0;
+
+				for (int i = 0; i < 2; i++) {
+					unsigned unit = 0;
+
+					if (end - raw < 6) {
+						return false;
+					}
+					for (int k = 2; k < 6; k++) {
+						if (!isxdigit((unsigned char) raw[k])) {
+							return false;
+						}
+						unit = unit << 4 | (unsigned) (strchr(urit_hexdigits, toupper((unsigned char) raw[k])) - urit_hexdigits);
+					}
+					if (i == 0 && unit >= 0xD800 && unit < 0xDC00) {
+						cp = unit;
+						raw += 6;
+						if (end - raw < 2 || raw[0] != '\\' || raw[1] != 'u') {
+							return false;
+						}
+					} else if (i == 1) {
+						if (unit < 0xDC00 || unit >= 0xE000) {
+							return false;
+						}
+						cp = 0x10000 + ((cp - 0xD800) << 10) + (unit - 0xDC00);
+						break;
+					} else if (unit >= 0xDC00 && unit < 0xE000) {
+						return false;
+					} else {
+						cp = unit;
+						break;
+					}
+				}
+				if (cp < 0x80) {
+					dst[n++] = (char) cp;
+				} else if (cp < 0x800) {
+					dst[n++] = (char) (0xC0 | cp >> 6);
+					dst[n++] = (char) (0x80 | (cp & 0x3F));
+				} else if (cp < 0x10000) {
+					dst[n++] = (char) (0xE0 | cp >> 12);
+					dst[n++] = (char) (0x80 | (cp >> 6 & 0x3F));
+					dst[n++] = (char) (0x80 | (cp & 0x3F));
+				} else {
+					dst[n++] = (char) (0xF0 | cp >> 18);
+					dst[n++] = (char) (0x80 | (cp >> 12 & 0x3F));
+					dst[n++] = (char) (0x80 | (cp >> 6 & 0x3F));
+					dst[n++] = (char) (0x80 | (cp & 0x3F));
+				}
+				raw += 4;
+				break;
+			}
+			default:
+				return false;
+		}
+		raw += 2;
+	}
+	dst[n] = '\0';
+	*declen = n;
+	return true;
 }
 
+/**
+ * Copies the len raw bytes of a JSON scalar to dst, decoding them if they
+ * hold escapes, and returns dst or NULL on a bad escape
+ */
 static char *
-urit_pctencodechar(const unsigned char c)
+urit_jsoncopy(char *dst, const char *raw, size_t len, bool escaped, size_t *declen)
+{
+	if (escaped) {
+		return urit_jsonunescape(dst, raw, len, declen) ? dst : NULL;
+	}
+	memcpy(dst, raw, len);
+	dst[len] = '\0';
+	*declen = len;
+	return dst;
+}
+
+/**
+ * Reads the value at str into the variable named by the namelen bytes at
+ * name and returns the character after it, or NULL
+ */
+static const char *
+urit_jsonvalue(UritVars *out, const char *name, size_t namelen, const char *str, const char *end)
 {
-	char *pct = malloc(4);
+	const char *raw;
+	size_t len;
+	bool escaped;
+
+	if (str < end && *str == '[') {
+		UritList *list = urit_newlist();
+
+		if (!(str = urit_jsonlist(list, str + 1, end)) || list->count == 0) {
+			urit_freelist(list);
+			return str;
+		}
+		urit_setvar(out, name, namelen, URIT_LIST)->val_list = list;
+		return str;
+	}
+	if (str < end && *str == '{') {
+		UritMap *map = urit_newmap();
 
-	pct[0] = '%';
-	sprintf(pct + 1, "%02X", c);
-	pct[3] = '\0';
+		if (!(str = urit_jsonmap(map, str + 1, end)) || map->count == 0) {
+			urit_freemap(map);
+			return str;
+		}
+		urit_setvar(out, name, namelen, URIT_MAP)->val_map = map;
+		return str;
+	}
+	if (!(str = urit_jsonscalar(str, end, &raw, &len, &escaped)) || raw == NULL) {
+		return str;
+	}
+	UritVar *var = urit_setvar(out, name, namelen, URIT_STRING);
 
-	return pct;
+	if (escaped) {
+		var->val_string = URIT_MALLOC(len + 1);
+		if (!urit_jsonunescape(var->val_string, raw, len, &var->len)) {
+			return NULL;
+		}
+	} else {
+		var->val_string = (char *) raw;
+		var->len = len;
+		var->borrowed = true;
+	}
+	return str;
 }
 
-static UritList *
-urit_compilelistvar(char *varvalue)
+/**
+ * Reads the scalars of the array whose opening bracket comes before str
+ * into list, skipping nulls
+ */
+static const char *
+urit_jsonlist(UritList *list, const char *str, const char *end)
 {
-	UritList *list = malloc(sizeof(UritList));
-	list->count = 0;
-	list->values = malloc(sizeof(char *));
-	UritString *buff = urit_newstring();
-	char curr;
-	bool esc = false;
-	bool quot = false;
-	bool delim = true;
-
-	while ((curr = (++varvalue)[0])) {
-		if (quot) {
-			if (esc && (curr == '"' || curr == '\\')) {
-				buff = urit_appendchar(buff, curr);
-				esc = false;
-			} else if (curr == '"') {
-				list->values[list->count] = malloc(sizeof(char) * (buff->len + 1));
-				strcpy(list->values[list->count], buff->str);
-				list->count++;
-				buff = urit_newstring();
-				quot = false;
-			} else if(curr == '\\') {
-				esc = true;
-			} else {
-				buff = urit_appendchar(buff, curr);
-				esc = false;
-			}
-		} else if (curr == '"') {
-			if (delim) {
-				quot = true;
-				delim = false;
-			} else {
-				return NULL;
-			}
-		} else if (curr == ',') {
-			if (delim) {
-				return NULL;
-			}
-			delim = true;
-		} else if (curr == ')') {
-			if ((varvalue + 1)[0] != '\0' || delim) {
+	const char *raw;
+	size_t len;
+	bool escaped;
+
+	str = urit_jsonspace(str, end);
+	if (str < end && *str == ']') {
+		return str + 1;
+	}
+	for (;;) {
+		if (!(str = urit_jsonscalar(str, end, &raw, &len, &escaped))) {
+			return NULL;
+		}
+		if (raw) {
+			char *item = urit_listpush(list, len);
+
+			if (!urit_jsoncopy(item, raw, len, escaped, &list->lens[list->count - 1])) {
 				return NULL;
 			}
-		} else if (curr != ' ') {
+		}
+		str = urit_jsonspace(str, end);
+		if (str < end && *str == ',') {
+			str = urit_jsonspace(str + 1, end);
+		} else if (str < end && *str == ']') {
+			return str + 1;
+		} else {
 			return NULL;
 		}
 	}
-	return list;
 }
 
-static UritMap *
-urit_compilemapvar(char *varvalue)
+/**
+ * Reads the scalar members of the object whose opening brace comes before
+ * str into map, skipping nulls
+ */
+static const char *
+urit_jsonmap(UritMap *map, const char *str, const char *end)
 {
-	UritMap *map = malloc(sizeof(UritMap));
-	map->count = 0;
-	map->pairs = malloc(sizeof(UritPair *));
-
-	UritString *buff = urit_newstring();
-	bool esc = false;
-	bool keyval = false;
-	bool keyvals = false;
-	bool quot = false;
-	bool item = false;
-	int8_t delim = -1;
-	char curr;
-	UritPair *pair;
-	
-	while ((curr = (++varvalue)[0])) {
-		if (quot) {
-			if (esc && (curr == '"' || curr == '\\')) {
-				buff = urit_appendchar(buff, curr);
-				esc = false;
-			} else if (curr == '"') {
-				if (!item) {
-					pair = malloc(sizeof(UritPair));
-					pair->key = malloc(sizeof(char) * (buff->len + 1));
-					pair->val = NULL;
-					strcpy(pair->key, buff->str);
-				} else {
-					pair->val = malloc(sizeof(char) * (buff->len + 1));
-					strcpy(pair->val, buff->str);
-					map->pairs[map->count] = pair;
-					map->count++;
-					keyvals = true;
-				}
-				buff = urit_newstring();
-				quot = false;
-				item = !item;
-			} else if (curr == '\\') {
-				esc = true;
-			} else {
-				buff = urit_appendchar(buff, curr);
-				esc = false;
-			}
-		} else if (curr == '(') {
-			if (keyval || delim == 0) {
-				return NULL;
-			}
-			if (delim == 1) {
-				delim = 0;
-			}
-			keyval = true;
-			keyvals = false;
-		} else if (curr == '"') {
-			if (!keyval || (delim == 0 && item) || keyvals) {
-				return NULL;
-			}
-			quot = true;
-			delim = 0;
-		} else if (curr == ',') {
-			if (delim != 0 || (keyval && !item)) {
-				return NULL;
-			}
-			delim = 1;
-		} else if (curr == ')') {
-			if (delim == 1 || item || !keyval) {
-				return NULL;
-			}
-			keyval = false;
-		} else if (curr == ']') {
-			if ((varvalue + 1)[0] != '\0' || delim == 1 || keyval) {
+	const char *key;
+	const char *val;
+	size_t keylen;
+	size_t vallen;
+	bool keyescaped;
+	bool valescaped;
+
+	str = urit_jsonspace(str, end);
+	if (str < end && *str == '}') {
+		return str + 1;
+	}
+	for (;;) {
+		if (str == end || *str != '"' || !(str = urit_jsonstring(str, end, &key, &keylen, &keyescaped))) {
+			return NULL;
+		}
+		str = urit_jsonspace(str, end);
+		if (str == end || *str++ != ':') {
+			return NULL;
+		}
+		str = urit_jsonspace(str, end);
+		if (!(str = urit_jsonscalar(str, end, &val, &vallen, &valescaped))) {
+			return NULL;
+		}
+		if (val) {
+			size_t i = urit_mappush(map, keylen, vallen);
+
+			if (!urit_jsoncopy(map->pool + map->keyoffsets[i], key, keylen, keyescaped, &map->keylens[i]) ||
+				!urit_jsoncopy(map->pool + map->valoffsets[i], val, vallen, valescaped, &map->vallens[i])) {
 				return NULL;
 			}
-		} else if (curr != ' ') {
+		}
+		str = urit_jsonspace(str, end);
+		if (str < end && *str == ',') {
+			str = urit_jsonspace(str + 1, end);
+		} else if (str < end && *str == '}') {
+			return str + 1;
+		} else {
 			return NULL;
 		}
 	}
-	return map;
 }
 
-static UritString *
-urit_appendstring(UritString *des, char *src)
+/**
+ * Fills params with the first varspec of every variable in tpl, in the order
+ * they appear, and returns how many there are
+ */
+static size_t
+urit_emitparams(const UritTemplate *tpl, const UritVarSpec **params)
 {
-	size_t rem = des->size - (sizeof(char) * (des->len + 1));
-	size_t len = strlen(src);
-	size_t min = sizeof(char) * len;
-	size_t inc;
+	size_t count = 0;
 
-	if (rem < min) {
-		inc = (min / 10 + 1) * 10;
-		des->size += inc;
-		des->str = realloc(des->str, des->size);
-	}
-	strcat(des->str, src);
-	des->len += len;
+	for (size_t i = 0; i < tpl->count; i++) {
+		for (size_t k = 0; k < tpl->parts[i].count; k++) {
+			const UritVarSpec *spec = &tpl->parts[i].varspecs[k];
 
-	return des;
+			if (urit_findparam(params, count, spec) == count) {
+				params[count++] = spec;
+			}
+		}
+	}
+	return count;
 }
 
-static UritString *
-urit_appendchar(UritString *des, char src)
+static size_t
+urit_findparam(const UritVarSpec **params, size_t count, const UritVarSpec *spec)
 {
-	int rem = des->size - (sizeof(char) * (des->len + 1));
-
-	if (rem < 1) {
-		des->size += 10;
-		des->str = realloc(des->str, des->size);
+	for (size_t i = 0; i < count; i++) {
+		if (params[i]->len == spec->len && strncmp(params[i]->name, spec->name, spec->len) == 0) {
+			return i;
+		}
 	}
-	strncat(des->str, &src, 1);
-	des->len++;
-
-	return des;
+	return count;
 }
 
-static char *
-urit_encode(char *str, bool allowreserved, size_t max)
+/**
+ * Checks that the len bytes of name are a C identifier, not a keyword and
+ * not one the generated code uses itself
+ */
+static bool
+urit_isident(const char *name, size_t len)
 {
-	UritString *enc = urit_newstring();
-	size_t count = 0;
-	uint8_t numbytes;
-	unsigned char curr;
-
-	while ((curr = *str++)) {
-		numbytes = urit_numbytes(curr);
-		if (numbytes == 1) {
-			if (urit_ispct(str - 1)) {
-				urit_appendchar(enc, *(str - 1));
-				urit_appendchar(enc, *str);
-				urit_appendchar(enc, *(str + 1));
-				str += 2;
-			} else if (urit_isunreserved(curr) || (allowreserved && urit_isreserved(curr))) {
-				urit_appendchar(enc, curr);
-			} else {
-				urit_appendstring(enc, urit_pctencodechar(curr));
-			}
-		} else if (urit_isliteral(str - 1)) {
-			str--;
-			for (size_t i = 0; i < numbytes; i++, str++) {
-				urit_appendstring(enc, urit_pctencodechar(*str));
-			}
+	static const char *reserved[] = {
+		"auto", "break", "case", "char", "const", "continue", "default", "do", "double", "else", "enum",
+		"extern", "float", "for", "goto", "if", "inline", "int", "long", "register", "restrict", "return",
+		"short", "signed", "sizeof", "static", "struct", "switch", "typedef", "union", "unsigned", "void",
+		"volatile", "while", "_Bool", "_Complex", "_Imaginary", "bool", "true", "false", "size_t", "NULL"
+	};
+
+	if (!len || isdigit((unsigned char) name[0]) || (len >= 5 && strncmp(name, "urit_", 5) == 0)) {
+		return false;
+	}
+	for (size_t i = 0; i < len; i++) {
+		if (!isalnum((unsigned char) name[i]) && name[i] != '_') {
+			return false;
 		}
-		count++;
-		if (count == max) {
-			return enc->str;
+	}
+	for (size_t i = 0; i < sizeof(reserved) / sizeof(reserved[0]); i++) {
+		if (strlen(reserved[i]) == len && strncmp(reserved[i], name, len) == 0) {
+			return false;
 		}
 	}
-	return enc->str;
+	return true;
 }
 
-static UritOpRule
-urit_getoprule(char c)
+/**
+ * Returns the name of parameter i: the name of its variable, or urit_var
+ * and i when that is not an identifier or would clash with the _len or
+ * _count parameter of another variable
+ */
+static char *
+urit_emitident(const UritVarSpec **params, size_t count, size_t i)
 {
-	UritOpRule oprule = {'\0', '\0', ',', false, '\0', false};
+	const UritVarSpec *spec = params[i];
+	bool clash = false;
 
-	switch (c) {
-		case '#':
-			oprule.first = true;
-		case '+':
-			oprule.allow = true;
-			oprule.op = c;
-			break;
-		case ';':
-			oprule.named = true;
-		case '.':
-		case '/':
-			oprule.first = true;
-			oprule.sep = c;
-			oprule.op = c;
-			break;
-		case '?':
-		case '&':
-			oprule.first = true;
-			oprule.sep = '&';
-			oprule.named = true;
-			oprule.ifemp = true;
-			oprule.op = c;
-			break;
+	for (size_t j = 0; j < count && !clash; j++) {
+		size_t len = params[j]->len;
+
+		clash = spec->len > len && spec->name[len] == '_' && strncmp(spec->name, params[j]->name, len) == 0 &&
+			(strncmp(spec->name + len, "_len", spec->len - len) == 0 || strncmp(spec->name + len, "_count", spec->len - len) == 0) &&
+			(spec->len - len == 4 || spec->len - len == 6);
 	}
-	return oprule;
+	if (clash || !urit_isident(spec->name, spec->len)) {
+		char *ident = URIT_MALLOC(32);
+
+		snprintf(ident, 32, "urit_var%zu", i);
+		return ident;
+	}
+	return urit_copybytes(spec->name, spec->len);
 }
 
-static UritVar *
-urit_getvar(UritVars *vars, char *name)
+/**
+ * Checks whether the code for part has to track if a value has been
+ * appended yet, which is when what goes before a later value depends on it
+ */
+static bool
+urit_emittracks(const UritPart *part)
 {
-	for (size_t i = 0; i < (size_t) vars->count; i++) {
-		if (strcmp(vars->vars[i]->name, name) == 0) {
-			return vars->vars[i];
-		}
-	}
-	return NULL;
+	return part->count > 1 && !(part->oprule.first && part->oprule.sep == part->oprule.op);
 }
 
+/**
+ * Writes the code for varspec k of an expression, whose variable has the
+ * given type and is passed as ident. When more is set the code records
+ * that a value has been appended.
+ */
 static void
-urit_processexpression(char *expr, UritOpRule oprule, UritVars vars, UritResult *res, size_t pos)
+urit_emitvarspec(UritString *des, const UritOpRule *oprule, const UritVarSpec *spec, UritValueType type, const char *ident, size_t k, bool more)
 {
-	UritVar *var;
-	UritString *varname;
-	UritString *prefixstr;
-	bool expl;
-	bool colon;
-	bool namestate;
-	bool dot;
-	bool firstdig;
-	int prefix;
-	char curr;
-	bool firstappend = true;
-	char *varspec = strtok(expr, ",");
-
-	while (varspec != NULL) {
-		var = malloc(sizeof(UritVar));
-		varname = urit_newstring();
-		prefixstr = urit_newstring();
-		prefix = 0;
-		firstdig = false;
-		expl = false;
-		colon = false;
-		dot = true;
-		namestate = true;
-
-		while ((curr = *varspec++)) {
-			pos++;
-			if (namestate) {
-				if (curr == '.') {
-					if (dot) {
-						urit_adderror(res, pos, URIT_INVALID_VARNAME);
-						return;
-					}
-					dot = true;
-				} else if (curr == '*') {
-					if (dot || !varname->len) {
-						urit_adderror(res, pos, URIT_INVALID_VARNAME);
-						return;
-					}
-					expl = true;
-					namestate = false;
-				} else if (curr == ':') {
-					if (dot || !varname->len) {
-						urit_adderror(res, pos, URIT_INVALID_VARNAME);
-						return;
-					}
-					colon = true;
-					firstdig = true;
-					namestate = false;
-				} else if (!urit_isvarchar(varspec - 1)) {
-					urit_adderror(res, pos, URIT_INVALID_VARNAME);
-					return;
-				} else {
-					varname = urit_appendchar(varname, curr);
-					dot = false;
-				}
-			} else {
-				if (curr == ':') {
-					if (colon) {
-						urit_adderror(res, pos, URIT_MALFORMED_EXPRESSION);
-						return;
-					}
-					colon = true;
-				} else if (colon) {
-					if (!isdigit(curr) || (firstdig && curr == '0') || prefixstr->len == 4) {
-						urit_adderror(res, pos, URIT_MALFORMED_EXPRESSION);
-						return;
-					}
-					prefixstr = urit_appendchar(prefixstr, curr);
-					firstdig = false;
-				} else {
-					urit_adderror(res, pos, URIT_MALFORMED_EXPRESSION);
-					return;
-				}
+	UritString *tail = urit_newstring();
+	bool named = oprule->named;
+	char item[64];
+
+	urit_appendformat(des, "\tif (%s) {\n", ident);
+	if (type == URIT_STRING || !spec->expl) {
+		if (named) {
+			urit_appendbytes(tail, spec->name, spec->len);
+			if (oprule->ifemp) {
+				urit_appendchar(tail, '=');
 			}
 		}
-
-		if (prefixstr->len) {
-			prefix = atoi(prefixstr->str);
+		urit_emitprefix(des, oprule, k, tail->str, tail->len, "\t\t");
+		if (named && !oprule->ifemp) {
+			urit_appendformat(des, type == URIT_STRING ? "\t\tif (%s_len) {\n" : "\t\tif (%s_count) {\n", ident);
+			urit_emitput(des, "=", 1, "\t\t\t");
+			if (type == URIT_STRING) {
+				urit_emitencode(des, ident, "", "_len", oprule, spec->prefix, "\t\t\t");
+			}
+			urit_appendformat(des, "\t\t}\n");
+		} else if (type == URIT_STRING) {
+			urit_emitencode(des, ident, "", "_len", oprule, spec->prefix, "\t\t");
 		}
+	} else {
+		urit_emitprefix(des, oprule, k, "", 0, "\t\t");
+	}
+	if (type != URIT_STRING) {
+		char sep = spec->expl ? oprule->sep : ',';
 
-		var = urit_getvar(&vars, varname->str);
-		if (!var) {
-			varspec = strtok(NULL, ",");
-			continue;
-		}
+		urit_appendformat(des, "\t\tfor (size_t urit_i = 0; urit_i < %s_count; urit_i++) {\n"
+			"\t\t\tif (urit_i) {\n\t\t\t\turit_len = urit_putchar(urit_buf, urit_cap, urit_len, ", ident);
+		urit_appendcstring(des, &sep, 1, '\'');
+		urit_appendformat(des, ");\n\t\t\t}\n");
 
-		if (firstappend) {
-			if (oprule.first) {
-				urit_appendchar(res->uriref, oprule.op);
+		snprintf(item, sizeof(item), type == URIT_LIST ? "[urit_i]" : "[urit_i][0]");
+		if (type == URIT_LIST && spec->expl && named) {
+			urit_resetstring(tail);
+			urit_appendbytes(tail, spec->name, spec->len);
+			if (oprule->ifemp) {
+				urit_appendchar(tail, '=');
 			}
-			firstappend = false;
+			urit_emitput(des, tail->str, tail->len, "\t\t\t");
+		}
+		if (type == URIT_MAP) {
+			urit_emitencode(des, ident, item, ".len", oprule, spec->prefix, "\t\t\t");
+			if (!spec->expl) {
+				urit_emitput(des, ",", 1, "\t\t\t");
+			} else if (!named || oprule->ifemp) {
+				urit_emitput(des, "=", 1, "\t\t\t");
+			}
+			snprintf(item, sizeof(item), "[urit_i][1]");
+		}
+		if (spec->expl && named && !oprule->ifemp) {
+			urit_appendformat(des, "\t\t\tif (%s%s.len) {\n", ident, item);
+			urit_emitput(des, "=", 1, "\t\t\t\t");
+			urit_emitencode(des, ident, item, ".len", oprule, spec->prefix, "\t\t\t\t");
+			urit_appendformat(des, "\t\t\t}\n");
 		} else {
-			urit_appendchar(res->uriref, oprule.sep);
+			urit_emitencode(des, ident, item, ".len", oprule, spec->prefix, "\t\t\t");
 		}
+		urit_appendformat(des, "\t\t}\n");
+	}
+	if (more) {
+		urit_appendformat(des, "\t\turit_more = true;\n");
+	}
+	urit_appendformat(des, "\t}\n");
+	urit_freestring(tail);
+}
 
-		if (var->type == URIT_STRING) {
-			
-			char *val = urit_encode(var->val_string, oprule.allow, prefix);
+/**
+ * Writes the code that appends the operator or separator due before
+ * varspec k, followed by the taillen bytes of tail. When it is known which
+ * is due they are written as one constant.
+ */
+static void
+urit_emitprefix(UritString *des, const UritOpRule *oprule, size_t k, const char *tail, size_t taillen, const char *indent)
+{
+	UritString *first = urit_newstring();
 
-			if (val == NULL) {
-				puts("unable to encode");
-				exit(EXIT_FAILURE);
-			}
-			if (oprule.named) {
-				urit_appendstring(res->uriref, var->name);
-				
-				if (strlen(val)) {
-					urit_appendchar(res->uriref, '=');
-					urit_appendstring(res->uriref, val);
-				} else {
-					if (oprule.ifemp) {
-						urit_appendchar(res->uriref, '=');
-					}
-					varspec = strtok(NULL, ",");
-					continue;
-				}
-			} else {
-				if (strlen(val)) {
-					urit_appendstring(res->uriref, val);
-				}
-			}
-		} else if (!expl) {
-			if (var->type == URIT_LIST) {
-				UritList *list = var->val_list;
+	if (oprule->first) {
+		urit_appendchar(first, oprule->op);
+	}
+	urit_appendbytes(first, tail, taillen);
 
-				if (oprule.named) {
-					urit_appendstring(res->uriref, var->name);
+	if (k == 0 || (oprule->first && oprule->sep == oprule->op)) {
+		urit_emitput(des, first->str, first->len, indent);
+	} else if (oprule->first && first->len == 1) {
+		urit_appendformat(des, "%surit_len = urit_putchar(urit_buf, urit_cap, urit_len, urit_more ? ", indent);
+		urit_appendcstring(des, &oprule->sep, 1, '\'');
+		urit_appendformat(des, " : ");
+		urit_appendcstring(des, &oprule->op, 1, '\'');
+		urit_appendformat(des, ");\n");
+	} else if (oprule->first) {
+		urit_appendformat(des, "%surit_len = urit_putbytes(urit_buf, urit_cap, urit_len, urit_more ? ", indent);
+		first->str[0] = oprule->sep;
+		urit_appendcstring(des, first->str, first->len, '"');
+		urit_appendformat(des, " : ");
+		first->str[0] = oprule->op;
+		urit_appendcstring(des, first->str, first->len, '"');
+		urit_appendformat(des, ", %zu);\n", first->len);
+	} else {
+		urit_appendformat(des, "%sif (urit_more) {\n%s\turit_len = urit_putchar(urit_buf, urit_cap, urit_len, ", indent, indent);
+		urit_appendcstring(des, &oprule->sep, 1, '\'');
+		urit_appendformat(des, ");\n%s}\n", indent);
+		urit_emitput(des, tail, taillen, indent);
+	}
+	urit_freestring(first);
+}
 
-					if (list->count) {
-						urit_appendchar(res->uriref, '=');
-					} else {
-						if (oprule.ifemp) {
-							urit_appendchar(res->uriref, '=');
-						}
-						varspec = strtok(NULL, ",");
-						continue;
-					}
-				}
-				for (size_t i = 0; i < list->count; i++) {
-					urit_appendstring(res->uriref, urit_encode(list->values[i], oprule.allow, prefix));
-					if (i + 1 < list->count) {
-						urit_appendchar(res->uriref, ',');
-					}
-				}
-			} else {
-				UritMap *map = var->val_map;
+/**
+ * Writes the code that appends the len bytes of str, if there are any
+ */
+static void
+urit_emitput(UritString *des, const char *str, size_t len, const char *indent)
+{
+	if (len == 1) {
+		urit_appendformat(des, "%surit_len = urit_putchar(urit_buf, urit_cap, urit_len, ", indent);
+		urit_appendcstring(des, str, 1, '\'');
+		urit_appendformat(des, ");\n");
+	} else if (len) {
+		urit_appendformat(des, "%surit_len = urit_putbytes(urit_buf, urit_cap, urit_len, ", indent);
+		urit_appendcstring(des, str, len, '"');
+		urit_appendformat(des, ", %zu);\n", len);
+	}
+}
 
-				if (oprule.named) {
-					urit_appendstring(res->uriref, var->name);
+/**
+ * Writes the code that encodes ident followed by item, whose length is
+ * found by appending len to the same
+ */
+static void
+urit_emitencode(UritString *des, const char *ident, const char *item, const char *len, const UritOpRule *oprule, size_t prefix, const char *indent)
+{
+	urit_appendformat(des, "%surit_len = urit_encodebytes(urit_buf, urit_cap, urit_len, %s%s%s, %s%s%s, %s, %zu);\n",
+		indent, ident, item, *item ? ".str" : "", ident, item, len, oprule->allow ? "true" : "false", prefix);
+}
 
-					if (map->count) {
-						urit_appendchar(res->uriref, '=');
-					} else {
-						if (oprule.ifemp) {
-							urit_appendchar(res->uriref, '=');
-						}
-						varspec = strtok(NULL, ",");
-						continue;
-					}
-				}
-				for (size_t i = 0; i < map->count; i++) {
-					urit_appendstring(res->uriref, urit_encode(map->pairs[i]->key, oprule.allow, prefix));
-					urit_appendchar(res->uriref, ',');
-					urit_appendstring(res->uriref, urit_encode(map->pairs[i]->val, oprule.allow, prefix));
-					if (i + 1 < map->count) {
-						urit_appendchar(res->uriref, ',');
-					}
-				}
-			}
+static void
+urit_appendformat(UritString *des, const char *fmt, ...)
+{
+	va_list args;
+	char buf[256];
+
+	va_start(args, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	if (len < (int) sizeof(buf)) {
+		urit_appendbytes(des, buf, len);
+		return;
+	}
+	char *big = URIT_MALLOC(len + 1);
+
+	va_start(args, fmt);
+	vsnprintf(big, len + 1, fmt, args);
+	va_end(args);
+	urit_appendbytes(des, big, len);
+	urit_free(big);
+}
+
+/**
+ * Appends the len bytes of str as a C string or character literal, quoted
+ * with quote. Anything but printable ASCII is written as an octal escape,
+ * and a ? that follows another is escaped so that no trigraph can form.
+ */
+static void
+urit_appendcstring(UritString *des, const char *str, size_t len, char quote)
+{
+	urit_appendchar(des, quote);
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = str[i];
+
+		if (c == quote || c == '\\' || (c == '?' && i && str[i - 1] == '?')) {
+			urit_appendchar(des, '\\');
+			urit_appendchar(des, c);
+		} else if (c < 0x20 || c > 0x7E) {
+			char esc[4] = {'\\', '0' + (c >> 6), '0' + ((c >> 3) & 7), '0' + (c & 7)};
+
+			urit_appendbytes(des, esc, 4);
 		} else {
-			if (oprule.named) {
-				if (var->type == URIT_LIST) {
-					UritList *list = var->val_list;
-					for (size_t i = 0; i < list->count; i++) {
-						urit_appendstring(res->uriref, var->name);
-						if (strlen(list->values[i])) {
-							urit_appendchar(res->uriref, '=');
-							urit_appendstring(res->uriref, urit_encode(list->values[i], oprule.allow, prefix));
-						} else if (oprule.ifemp) {
-							urit_appendchar(res->uriref, '=');
-						}
-						if (i + 1 < list->count) {
-							urit_appendchar(res->uriref, oprule.sep);
-						}
-					}
-				} else {
-					UritMap *map = var->val_map;
-					for (size_t i = 0; i < map->count; i++) {
-						urit_appendstring(res->uriref, urit_encode(map->pairs[i]->key, oprule.allow, prefix));
-						if (strlen(map->pairs[i]->val)) {
-							urit_appendchar(res->uriref, '=');
-							urit_appendstring(res->uriref, urit_encode(map->pairs[i]->val, oprule.allow, prefix));
-						} else if (oprule.ifemp) {
-							urit_appendchar(res->uriref, '=');
-						}
-						if (i + 1 < map->count) {
-							urit_appendchar(res->uriref, oprule.sep);
-						}
-					}
-				}
-			} else {
-				if (var->type == URIT_LIST) {
-					UritList *list = var->val_list;
-					for (size_t i = 0; i < list->count; i++) {
-						urit_appendstring(res->uriref, urit_encode(list->values[i], oprule.allow, prefix));
-						if (i + 1 < list->count) {
-							urit_appendchar(res->uriref, oprule.sep);
-						}
-					}
-				} else {
-					UritMap *map = var->val_map;
-					for (size_t i = 0; i < map->count; i++) {
-						urit_appendstring(res->uriref, urit_encode(map->pairs[i]->key, oprule.allow, prefix));
-						urit_appendchar(res->uriref, '=');
-						urit_appendstring(res->uriref, urit_encode(map->pairs[i]->val, oprule.allow, prefix));
-						if (i + 1 < map->count) {
-							urit_appendchar(res->uriref, oprule.sep);
-						}
-					}
-				}
-			}
+			urit_appendchar(des, c);
 		}
-		varspec = strtok(NULL, ",");
 	}
+	urit_appendchar(des, quote);
 }
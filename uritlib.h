@@ -17,36 +17,88 @@
 #define URIT_MALFORMED_MAP			7
 #define URIT_INVALID_VARNAME		8
 #define URIT_DUPLICATE_VARIABLE		9
+#define URIT_MALFORMED_JSON			10
+
+#define URIT_BLOCK_SIZE				4096
+#define URIT_ALIGN					16
+#define URIT_ALLOC_SITES			64
+#define URIT_NOSLOT					((size_t) -1)
 
 typedef enum { URIT_STRING, URIT_LIST, URIT_MAP } UritValueType;
 typedef int UritStatus;
 typedef int UritCode;
 
+typedef void *(*UritAllocFn)(size_t size, void *ctx);
+typedef void *(*UritReallocFn)(void *ptr, size_t size, void *ctx);
+typedef void (*UritFreeFn)(void *ptr, void *ctx);
+
+typedef struct {
+	const char *function;
+	size_t calls;
+	size_t bytes;
+} UritAllocCount;
+
+typedef struct UritBlock {
+	struct UritBlock *next;
+	size_t size;
+	size_t used;
+} UritBlock;
+
+typedef struct {
+	UritBlock *blocks;
+	void *last;
+	size_t lastsize;
+	bool shared;
+} UritContext;
+
 typedef struct {
 	size_t len;
 	size_t size;
 	char *str;
+	bool fixed;
+	UritContext *ctx;
 } UritString;
 
 typedef struct {
 	size_t count;
-	char **values;
+	size_t size;
+	size_t *offsets;
+	size_t *lens;
+	char *pool;
+	size_t poollen;
+	size_t poolsize;
+	const char **items;
+	bool borrowed;
 } UritList;
 
 typedef struct {
 	char *key;
 	char *val;
+	size_t keylen;
+	size_t vallen;
 } UritPair;
 
 typedef struct {
 	size_t count;
-	UritPair **pairs;
+	size_t size;
+	size_t *keyoffsets;
+	size_t *keylens;
+	size_t *valoffsets;
+	size_t *vallens;
+	char *pool;
+	size_t poollen;
+	size_t poolsize;
+	const UritPair *pairs;
+	bool borrowed;
 } UritMap;
 
 typedef struct {
 	char *name;
 	UritValueType type;
 	size_t index;
+	size_t hash;
+	size_t len;
+	bool borrowed;
 	union {
 		char *val_string;
 		UritList *val_list;
@@ -56,7 +108,10 @@ typedef struct {
 
 typedef struct {
 	size_t count;
+	size_t size;
 	UritVar **vars;
+	size_t mask;
+	UritVar **table;
 } UritVars;
 
 typedef struct {
@@ -80,25 +135,156 @@ typedef struct {
 	char *uri;
 	char *tpl;
 	UritError *error;
+	UritContext *ctx;
 } UritResult;
 
+typedef enum { URIT_LITERAL, URIT_EXPRESSION } UritPartType;
+
+typedef struct {
+	const char *name;
+	size_t len;
+	bool expl;
+	size_t prefix;
+	size_t slot;
+} UritVarSpec;
+
+typedef struct {
+	UritPartType type;
+	size_t pos;
+	size_t len;
+	char *str;
+	UritOpRule oprule;
+	size_t count;
+	UritVarSpec *varspecs;
+} UritPart;
+
+typedef struct {
+	char *tpl;
+	size_t count;
+	UritPart *parts;
+	struct UritInstr *code;
+} UritTemplate;
+
+typedef struct {
+	size_t count;
+	UritVar *values;
+} UritSlots;
+
+typedef struct UritRouteNode {
+	UritPart part;
+	bool route;
+	size_t id;
+	size_t literalcount;
+	struct UritRouteNode **literals;
+	size_t exprcount;
+	struct UritRouteNode **exprs;
+} UritRouteNode;
+
+typedef struct {
+	UritRouteNode *root;
+	size_t count;
+	UritTemplate **templates;
+} UritRouter;
+
+typedef struct {
+	size_t capacity;
+	size_t count;
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+} UritCacheStats;
+
+typedef struct {
+	UritString *uris;
+	size_t count;
+	size_t size;
+	size_t *offsets;
+} UritBatch;
+
+typedef struct {
+	const UritTemplate *tpl;
+	const UritVars *vars;
+	UritString *uri;
+	UritString *scratch;
+	size_t *offsets;
+} UritExpansion;
+
+void urit_setallocator(UritAllocFn allocfn, UritReallocFn reallocfn, UritFreeFn freefn, void *ctx);
+void urit_free(void *ptr);
+void urit_countallocations(bool enable);
+size_t urit_allocationcounts(UritAllocCount *counts, size_t cap);
+
 UritVars urit_newvars(void);
 void urit_printvars(UritVars vars);
 void urit_printerrors(UritResult *r);
 UritStatus urit_addvariable(UritVars *vars, char *varname, char *varvalue);
 
 UritString *urit_newstring(void);
+void urit_reservestring(UritString *str, size_t len);
+void urit_resetstring(UritString *str);
+void urit_freestring(UritString *str);
 void urit_addstringvar(UritVars *vars, char *varname, char *varvalue);
+void urit_borrowstringvar(UritVars *vars, char *name, const char *val, size_t len);
 
 UritList *urit_newlist(void);
 void urit_addlistvar(UritVars *vars, char *name, size_t count, char **list);
 void urit_listadditem(char *str, UritList *list);
+const char *urit_listitem(const UritList *list, size_t i, size_t *len);
 void urit_varsaddlist(UritVars *vars, char *name, UritList *list);
+void urit_borrowlistvar(UritVars *vars, char *name, size_t count, const char **items, const size_t *lens);
+void urit_freelist(UritList *list);
 
 UritMap *urit_newmap(void);
 void urit_addmapvar(UritVars *vars, char *name, size_t count, char *map[][2]);
 void urit_mapaddkeyval(char *key, char *val, UritMap *map);
+UritPair urit_mapitem(const UritMap *map, size_t i);
 void urit_varsaddmap(UritVars *vars, char *name, UritMap *map);
+void urit_borrowmapvar(UritVars *vars, char *name, size_t count, const UritPair *pairs);
+void urit_freemap(UritMap *map);
+void urit_freevars(UritVars *vars);
+UritStatus urit_varsfromjson(const char *buf, size_t len, UritVars *out);
 
 UritResult urit_parsetemplate(char *tpl, UritVars vars);
+void urit_freeresult(UritResult *res);
+
+UritContext *urit_newcontext(void);
+UritResult urit_parsetemplatein(UritContext *ctx, char *tpl, UritVars vars);
+void urit_resetcontext(UritContext *ctx);
+void urit_freecontext(UritContext *ctx);
+
+void urit_setcache(size_t capacity);
+UritCacheStats urit_cachestats(void);
+
+UritTemplate *urit_compile(const char *tpl, UritResult *errors);
+char *urit_expand(const UritTemplate *tpl, const UritVars *vars);
+void urit_expandinto(UritString *uri, const UritTemplate *tpl, const UritVars *vars);
+size_t urit_expandto(char *buf, size_t cap, const char *tpl, const UritVars *vars, UritStatus *st);
+UritTemplate *urit_partial(const UritTemplate *tpl, const UritVars *constants);
+UritStatus urit_emitc(UritString *out, const UritTemplate *tpl, const char *name, const UritVars *types);
+void urit_freetemplate(UritTemplate *tpl);
+
+UritStatus urit_bindtemplate(UritTemplate *tpl, const char **names, size_t count);
+UritSlots *urit_newslots(size_t count);
+void urit_setslotstring(UritSlots *slots, size_t slot, char *value);
+void urit_setslotbytes(UritSlots *slots, size_t slot, const char *value, size_t len);
+void urit_setslotlist(UritSlots *slots, size_t slot, UritList *list);
+void urit_setslotmap(UritSlots *slots, size_t slot, UritMap *map);
+void urit_clearslots(UritSlots *slots);
+void urit_freeslots(UritSlots *slots);
+char *urit_expandslots(const UritTemplate *tpl, const UritSlots *slots);
+void urit_expandslotsinto(UritString *uri, const UritTemplate *tpl, const UritSlots *slots);
+UritStatus urit_match(const UritTemplate *tpl, const char *uri, UritVars *out);
+
+UritRouter *urit_newrouter(void);
+UritStatus urit_addroute(UritRouter *router, const char *tpl, UritResult *errors);
+UritStatus urit_route(const UritRouter *router, const char *uri, size_t *id, UritVars *out);
+void urit_freerouter(UritRouter *router);
+
+UritBatch *urit_newbatch(void);
+void urit_expandbatch(UritBatch *batch, const UritTemplate *tpl, const UritVars *sets, size_t count, char sep, size_t threads);
+void urit_freebatch(UritBatch *batch);
+
+UritExpansion *urit_newexpansion(const UritTemplate *tpl, const UritVars *vars);
+const char *urit_reexpand(UritExpansion *exp, const char *name);
+void urit_freeexpansion(UritExpansion *exp);
 #endif
@@ -0,0 +1,280 @@
+#include <stdint.h>
+#include "uritrt.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define URIT_CHAR_UNRESERVED	0x01
+#define URIT_CHAR_RESERVED		0x02
+#define URIT_CHAR_VARCHAR		0x04
+#define URIT_CHAR_HEXDIG		0x08
+
+static size_t urit_putpct(char *buf, size_t cap, size_t len, const unsigned char c);
+static size_t urit_numbytes(unsigned char c);
+static unsigned urit_getcodepoint(const char *str);
+static bool urit_isucschar(const char *str);
+static bool urit_isiprivate(const char *str);
+static bool urit_ispct(const char *str);
+static bool urit_isliteral(const char *str);
+static bool urit_isutf8(const char *str, size_t numbytes);
+static size_t urit_saferun(const char *str, size_t len, bool allowreserved);
+
+static const char urit_hexdigits[] = "0123456789ABCDEF";
+
+/**
+ * Character classes of every byte, independent of the current locale
+ */
+static const uint8_t urit_charclass[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 2, 0, 2, 2, 0, 2, 2, 2, 2, 2, 2, 2, 1, 1, 2,
+	13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 2, 2, 0, 2, 0, 2,
+	2, 13, 13, 13, 13, 13, 13, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+	5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 2, 0, 2, 0, 5,
+	0, 13, 13, 13, 13, 13, 13, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+	5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 0, 2, 0, 1, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+/**
+ * Writes the first n bytes of str to buf at offset len, percent-encoding
+ * anything outside the unreserved set (and the reserved set when
+ * allowreserved). Runs of characters that need no encoding are copied in one
+ * go. At most max characters of str are encoded, 0 meaning no limit. Only
+ * what fits before the last of the cap bytes of buf is written and buf is
+ * not terminated. Returns len plus the length of the encoded text.
+ */
+size_t
+urit_encodebytes(char *buf, size_t cap, size_t len, const char *str, size_t n, bool allowreserved, size_t max)
+{
+	const char *end = str + n;
+	size_t count = 0;
+	size_t numbytes;
+	size_t run;
+
+	while (str < end) {
+		run = urit_saferun(str, end - str, allowreserved);
+
+		if (run) {
+			if (max && run > max - count) {
+				run = max - count;
+			}
+			len = urit_putbytes(buf, cap, len, str, run);
+			str += run;
+			count += run;
+		} else {
+			numbytes = urit_numbytes(*str);
+
+			if (numbytes == 1) {
+				if (end - str >= 3 && urit_ispct(str)) {
+					len = urit_putbytes(buf, cap, len, str, 3);
+					str += 3;
+				} else {
+					len = urit_putpct(buf, cap, len, *str++);
+				}
+			} else if (numbytes && numbytes <= (size_t) (end - str) && urit_isutf8(str, numbytes) && urit_isliteral(str)) {
+				for (size_t i = 0; i < numbytes; i++) {
+					len = urit_putpct(buf, cap, len, *str++);
+				}
+			} else {
+				str++;
+			}
+			count++;
+		}
+		if (count == max) {
+			break;
+		}
+	}
+	return len;
+}
+
+static size_t
+urit_putpct(char *buf, size_t cap, size_t len, const unsigned char c)
+{
+	char pct[3] = {'%', urit_hexdigits[c >> 4], urit_hexdigits[c & 0x0F]};
+
+	return urit_putbytes(buf, cap, len, pct, 3);
+}
+
+static size_t
+urit_numbytes(unsigned char c)
+{
+	if (c < 0xC0) {
+		return 1;
+	} else if (c < 0xE0) {
+		return 2;
+	} else if (c < 0xF0) {
+		return 3;
+	} else if (c < 0xF8) {
+		return 4;
+	} 
+	return 0;
+}
+
+static unsigned
+urit_getcodepoint(const char *str)
+{
+	uint8_t numbytes = urit_numbytes(*str);
+	unsigned mask = (1 << (7 - numbytes)) - 1;
+	unsigned submask = (1 << 6) - 1;
+	unsigned last = *str & mask;
+
+	switch (numbytes) {
+		case 1:
+			return *str;
+		case 2:
+			return (last << 6) + (str[1] & submask);
+		case 3:
+			return (last << 12) + ((str[1] & submask) << 6) + (str[2] & submask);
+		case 4:
+			return (last << 18) + ((str[1] & submask) << 12) + ((str[2] & submask) << 6) + (str[3] & submask);
+	}
+	return 0;
+}
+
+/**
+ * From RFC:
+ * ucschar	= %xA0-D7FF / %xF900-FDCF / %xFDF0-FFEF
+ *			/ %x10000-1FFFD / %x20000-2FFFD / %x30000-3FFFD
+ *			/ %x40000-4FFFD / %x50000-5FFFD / %x60000-6FFFD
+ *			/ %x70000-7FFFD / %x80000-8FFFD / %x90000-9FFFD
+ *			/ %xA0000-AFFFD / %xB0000-BFFFD / %xC0000-CFFFD
+ *			/ %xD0000-DFFFD / %xE1000-EFFFD
+ */
+
+static bool
+urit_isucschar(const char *str)
+{
+	unsigned c = urit_getcodepoint(str);
+
+	if ((0xA0 <= c && c <= 0xD7FF) || (0xF900 <= c && c <= 0xFDCF) || (0xFDF0 <= c && c <= 0xFFEF) ||
+		(0x10000 <= c && c <= 0x1FFFD) || (0x20000 <= c && c <= 0x2FFFD) || (0x30000 <= c && c <= 0x3FFFD) ||
+		(0x40000 <= c && c <= 0x4FFFD) || (0x50000 <= c && c <= 0x5FFFD) || (0x60000 <= c && c <= 0x6FFFD) ||
+		(0x70000 <= c && c <= 0x7FFFD) || (0x80000 <= c && c <= 0x8FFFD) || (0x90000 <= c && c <= 0x9FFFD) ||
+		(0xA0000 <= c && c <= 0xAFFFD) || (0xB0000 <= c && c <= 0xBFFFD) || (0xC0000 <= c && c <= 0xCFFFD) ||
+		(0xD0000 <= c && c <= 0xDFFFD) || (0xE0000 <= c && c <= 0xEFFFD)) {
+		return true;
+	}
+	return false;
+}
+
+/**
+ * From RFC:
+ * iprivate	= %xE000-F8FF / %xF0000-FFFFD / %x100000-10FFFD
+ */
+static bool
+urit_isiprivate(const char *str)
+{
+	unsigned c = urit_getcodepoint(str);
+
+	if ((0xE000 <= c && c <= 0xF8FF) || (0xF0000 <= c && c <= 0xFFFFD) || (0x100000 <= c && c <= 0x10FFFD)) {
+		return true;
+	}
+	return false;
+}
+
+static bool
+urit_ispct(const char *str)
+{
+	return str[0] == '%' && (urit_charclass[(unsigned char) str[1]] & URIT_CHAR_HEXDIG) &&
+		(urit_charclass[(unsigned char) str[2]] & URIT_CHAR_HEXDIG);
+}
+
+/**
+ * From RFC:
+ * literals	= %x21 / %x23-24 / %x26 / %x28-3B / %x3D / %x3F-5B / %x5D / %x5F
+ *			/ %x61-7A / %x7E / ucschar / iprivate / pct-encoded
+ *				; any Unicode character except: CTL, SP, DQUOTE, "'",
+ *				; "%" (aside from pct-encoded), "<", ">", "/", "^", `", "{"
+ *				; "|", "}"
+ */
+static bool
+urit_isliteral(const char *str)
+{
+	char c = *str;
+
+	if (c == 0x21 || c == 0x23 || c == 0x24 || c == 0x26 || (0x28 <= c && c <= 0x3B) ||
+		c == 0x3D || (0x3F <= c && c <= 0x5B) || c == 0x5D || c == 0x5F || (0x61 <= c && c <= 0x7A) ||
+		c == 0x7E || urit_ispct(str) || urit_isucschar(str) || urit_isiprivate(str)) {
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Checks that a multi-byte sequence is followed by enough continuation bytes
+ */
+static bool
+urit_isutf8(const char *str, size_t numbytes)
+{
+	for (size_t i = 1; i < numbytes; i++) {
+		if ((str[i] & 0xC0) != 0x80) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Returns how many bytes at the start of str (at most len) can be copied
+ * as they are, with SSE2 doing 16 at a time where it is available
+ */
+static size_t
+urit_saferun(const char *str, size_t len, bool allowreserved)
+{
+	uint8_t safe = allowreserved ? URIT_CHAR_UNRESERVED | URIT_CHAR_RESERVED : URIT_CHAR_UNRESERVED;
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i space = _mm_set1_epi8(0x20);
+	const __m128i del = _mm_set1_epi8(0x7F);
+	const __m128i lower = _mm_set1_epi8(0x20);
+	const __m128i a = _mm_set1_epi8('a' - 1);
+	const __m128i z = _mm_set1_epi8('z' + 1);
+	const __m128i zero = _mm_set1_epi8('0' - 1);
+	const __m128i nine = _mm_set1_epi8('9' + 1);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (str + i));
+		__m128i ok;
+
+		if (allowreserved) {
+			/* everything printable but " % < > \ ^ ` { } */
+			ok = _mm_and_si128(_mm_cmpgt_epi8(v, space), _mm_cmplt_epi8(v, del));
+			__m128i bad = _mm_or_si128(
+				_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('%'))),
+					_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('<')), _mm_cmpeq_epi8(v, _mm_set1_epi8('>')))),
+				_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\')), _mm_cmpeq_epi8(v, _mm_set1_epi8('^'))),
+					_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('`')),
+						_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('{')), _mm_cmpeq_epi8(v, _mm_set1_epi8('}'))))));
+			ok = _mm_andnot_si128(bad, ok);
+		} else {
+			/* letters (folded to lower case), digits and - . _ ~ */
+			__m128i folded = _mm_or_si128(v, lower);
+			ok = _mm_or_si128(
+				_mm_and_si128(_mm_cmpgt_epi8(folded, a), _mm_cmplt_epi8(folded, z)),
+				_mm_and_si128(_mm_cmpgt_epi8(v, zero), _mm_cmplt_epi8(v, nine)));
+			ok = _mm_or_si128(ok, _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('-')), _mm_cmpeq_epi8(v, _mm_set1_epi8('.'))),
+				_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('_')), _mm_cmpeq_epi8(v, _mm_set1_epi8('~')))));
+		}
+		unsigned mask = ~_mm_movemask_epi8(ok) & 0xFFFF;
+
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+#endif
+	while (i < len && (urit_charclass[(unsigned char) str[i]] & safe)) {
+		i++;
+	}
+	return i;
+}
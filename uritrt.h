@@ -0,0 +1,38 @@
+#ifndef URITRT_H
+#define URITRT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+typedef struct {
+	const char *str;
+	size_t len;
+} UritSlice;
+
+size_t urit_encodebytes(char *buf, size_t cap, size_t len, const char *str, size_t n, bool allowreserved, size_t max);
+
+/**
+ * Copies the n bytes at src to buf at offset len, or as many of them as fit
+ * before the last of its cap bytes, and returns len + n
+ */
+static inline size_t
+urit_putbytes(char *buf, size_t cap, size_t len, const char *src, size_t n)
+{
+	if (len + n < cap) {
+		memcpy(buf + len, src, n);
+	} else if (len + 1 < cap) {
+		memcpy(buf + len, src, cap - len - 1);
+	}
+	return len + n;
+}
+
+static inline size_t
+urit_putchar(char *buf, size_t cap, size_t len, char c)
+{
+	if (len + 1 < cap) {
+		buf[len] = c;
+	}
+	return len + 1;
+}
+#endif